@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "db.h"
+
+/*
+
+Allocation check, run by make test
+
+    - Linked with --wrap for malloc, calloc and realloc, so every heap allocation
+      the engine makes goes through the counters below
+    - Runs rounds of prepared inserts, point selects and tableFind lookups on a table
+      with an index. The first rounds warm up the statement cache and buffer pool
+    - The last round has to allocate nothing, with and without a write-ahead log
+
+*/
+
+#define ALLOC_TEST_ROUNDS 3
+#define ALLOC_TEST_ROWS_PER_ROUND 20000
+#define ALLOC_TEST_FILE "alloc_test.db"
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+
+// Background threads (read ahead, the checkpointer) allocate through these too
+bool counting = false;
+unsigned long allocations = 0;
+
+void countAllocation() {
+    if (__atomic_load_n(&counting, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void* __wrap_malloc(size_t size) {
+    countAllocation();
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    countAllocation();
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size) {
+    countAllocation();
+    return __real_realloc(pointer, size);
+}
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        printf("alloc_test: %s failed\n", what);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Returns the allocations made during the last round
+unsigned long runRounds(bool useWal) {
+    unlink(ALLOC_TEST_FILE);
+    unlink(ALLOC_TEST_FILE "-wal");
+    DbOptions options = { .cache_frames = 64, .use_mmap = false, .use_wal = useWal, .compress = false };
+    Table* table = dbOpen(ALLOC_TEST_FILE, &options);
+
+    PreparedStatement* prepared;
+    check(dbPrepare(table, "create index on users(email)", &prepared) == PREPARE_SUCCESS, "create index");
+    check(dbStep(prepared, NULL) == EXECUTE_SUCCESS, "create index");
+    dbFinalize(prepared);
+
+    for (uint32_t round = 0; round < ALLOC_TEST_ROUNDS; round++) {
+        __atomic_store_n(&allocations, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&counting, round == ALLOC_TEST_ROUNDS - 1, __ATOMIC_RELAXED);
+
+        for (uint32_t i = 0; i < ALLOC_TEST_ROWS_PER_ROUND; i++) {
+            uint32_t id = round * ALLOC_TEST_ROWS_PER_ROUND + i + 1;
+            check(dbPrepare(table, "insert ? ? ?", &prepared) == PREPARE_SUCCESS, "insert");
+            dbBindInt(prepared, 1, id);
+            dbBindText(prepared, 2, "user");
+            dbBindText(prepared, 3, "someone@example.com");
+            check(dbStep(prepared, NULL) == EXECUTE_SUCCESS, "insert");
+            dbFinalize(prepared);
+
+            Row row;
+            check(dbPrepare(table, "select where id = ?", &prepared) == PREPARE_SUCCESS, "select");
+            dbBindInt(prepared, 1, id / 2 + 1);
+            check(dbStep(prepared, &row) == EXECUTE_ROW && row.id == id / 2 + 1, "select");
+            dbFinalize(prepared);
+
+            Cursor cursor;
+            tableFind(table, id / 3 + 1, &cursor);
+            check(cursorKey(&cursor) == id / 3 + 1, "tableFind");
+            pagerUnpinAll(table->pager);
+        }
+    }
+
+    __atomic_store_n(&counting, false, __ATOMIC_RELAXED);
+    unsigned long counted = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+    dbClose(table);
+    unlink(ALLOC_TEST_FILE);
+    unlink(ALLOC_TEST_FILE "-wal");
+    return counted;
+}
+
+int main() {
+    bool failed = false;
+    for (int useWal = 0; useWal <= 1; useWal++) {
+        unsigned long counted = runRounds(useWal);
+        printf("alloc_test%s: %lu allocations in steady state\n", useWal ? " (wal)" : "", counted);
+        failed |= counted > 0;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,430 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "db.h"
+
+/*
+
+Benchmark driver
+
+    - Builds a table with sequential keys, then a second one with keys in random order
+    - Measures point lookups and a full scan against the random one. Lookups can be
+      split across several reader threads sharing the table
+    - Repeats the full scan with parallelScan, using the same number of threads
+    - Times "select count(*)", which never decodes a row
+    - Builds an index on email and times lookups through it
+    - Prints one JSON object, so results can be stored and compared between commits
+
+*/
+
+#define BENCH_DEFAULT_ROWS 100000
+#define BENCH_DEFAULT_LOOKUPS 100000
+#define BENCH_KEY_MULTIPLIER 2654435761u // Odd, so i -> i * multiplier is a permutation of uint32
+
+typedef struct {
+    uint64_t rows;
+    uint64_t lookups;
+    uint32_t batch;  // Rows per insert statement
+    uint32_t readers; // Threads the lookups are spread over
+    const char* path;
+    DbOptions options;
+} BenchOptions;
+
+typedef struct {
+    double seconds;
+    PagerStats stats;
+} Phase;
+
+double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+uint32_t sequentialKey(uint64_t i) {
+    return (uint32_t) i + 1;
+}
+
+// Distinct keys spread over the whole key space, without keeping a shuffled array around
+uint32_t randomKey(uint64_t i) {
+    return (uint32_t) (i + 1) * BENCH_KEY_MULTIPLIER;
+}
+
+void removeDatabase(const char* path) {
+    char walPath[4096];
+    snprintf(walPath, sizeof(walPath), "%s-wal", path);
+    unlink(path);
+    unlink(walPath);
+}
+
+// Prepare "insert values (?, ?, ?), ..." with one group of placeholders per row
+PreparedStatement* prepareBenchInsert(Table* table, uint32_t rows) {
+    size_t length = strlen("insert values ") + rows * strlen("(?, ?, ?), ") + 1;
+    char* sql = malloc(length);
+    strcpy(sql, rows > 1 ? "insert values " : "insert ? ? ?");
+    for (uint32_t i = 0; rows > 1 && i < rows; i++) {
+        strcat(sql, i == 0 ? "(?, ?, ?)" : ", (?, ?, ?)");
+    }
+
+    PreparedStatement* prepared;
+    if (dbPrepare(table, sql, &prepared) != PREPARE_SUCCESS) {
+        printf("Could not prepare %s\n", sql);
+        exit(EXIT_FAILURE);
+    }
+    free(sql);
+    return prepared;
+}
+
+void bindRow(PreparedStatement* prepared, uint32_t row, uint32_t key) {
+    char username[COLUMN_USERNAME_SIZE + 1];
+    char email[COLUMN_EMAIL_SIZE + 1];
+    snprintf(username, sizeof(username), "user%u", key);
+    snprintf(email, sizeof(email), "person%u@example.com", key);
+
+    dbBindInt(prepared, row * 3 + 1, key);
+    dbBindText(prepared, row * 3 + 2, username);
+    dbBindText(prepared, row * 3 + 3, email);
+}
+
+// Insert every key through the library API, committing once per statement like any client would
+Phase benchInsert(BenchOptions* bench, uint32_t (*key)(uint64_t)) {
+    removeDatabase(bench->path);
+    Table* table = dbOpen(bench->path, &bench->options);
+
+    PreparedStatement* full = prepareBenchInsert(table, bench->batch);
+    PreparedStatement* tail = NULL;
+    uint32_t tailRows = bench->rows % bench->batch;
+    if (tailRows > 0) {
+        tail = prepareBenchInsert(table, tailRows);
+    }
+
+    double start = now();
+    for (uint64_t i = 0; i < bench->rows;) {
+        PreparedStatement* prepared = bench->rows - i >= bench->batch ? full : tail;
+        uint32_t rows = prepared == full ? bench->batch : tailRows;
+        for (uint32_t row = 0; row < rows; row++) {
+            bindRow(prepared, row, key(i++));
+        }
+
+        dbReset(prepared);
+        if (dbStep(prepared, NULL) != EXECUTE_SUCCESS) {
+            printf("Insert failed at row %lu\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Phase phase = { .stats = table->pager->stats };
+    dbFinalize(full);
+    if (tail != NULL) {
+        dbFinalize(tail);
+    }
+    dbClose(table);
+    phase.seconds = now() - start;
+    return phase;
+}
+
+int compareLatencies(const void* a, const void* b) {
+    double left = *(double*) a;
+    double right = *(double*) b;
+    return (left > right) - (left < right);
+}
+
+typedef struct {
+    BenchOptions* bench;
+    Table* table;
+    double* latencies; // One slot per lookup this reader does
+    uint64_t count;
+    unsigned int seed;
+} LookupWorker;
+
+void* benchLookupWorker(void* argument) {
+    LookupWorker* worker = argument;
+    Row row;
+
+    for (uint64_t i = 0; i < worker->count; i++) {
+        uint64_t index = ((uint64_t) rand_r(&worker->seed) << 31 | rand_r(&worker->seed)) % worker->bench->rows;
+        uint32_t key = randomKey(index);
+
+        double start = now();
+        Cursor cursor;
+        tableFind(worker->table, key, &cursor);
+        cursorRow(&cursor, &row);
+        pagerUnpinAll(worker->table->pager);
+        worker->latencies[i] = now() - start;
+
+        if (row.id != key) {
+            printf("Lookup of %u found %u\n", key, row.id);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return NULL;
+}
+
+void benchLookups(BenchOptions* bench, Table* table, double* latencies) {
+    pthread_t* threads = malloc(bench->readers * sizeof(pthread_t));
+    LookupWorker* workers = malloc(bench->readers * sizeof(LookupWorker));
+
+    uint64_t first = 0;
+    for (uint32_t i = 0; i < bench->readers; i++) {
+        uint64_t count = bench->lookups / bench->readers + (i < bench->lookups % bench->readers);
+        workers[i] = (LookupWorker) { bench, table, latencies + first, count, 42 + i };
+        first += count;
+        pthread_create(&threads[i], NULL, benchLookupWorker, &workers[i]);
+    }
+    for (uint32_t i = 0; i < bench->readers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    free(workers);
+    qsort(latencies, bench->lookups, sizeof(double), compareLatencies);
+}
+
+double percentile(double* sorted, uint64_t count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t index = (uint64_t) (fraction * (count - 1));
+    return sorted[index] * 1e9;
+}
+
+// Bytes a row takes up in its leaf, the key plus the variable length value
+uint64_t storedRowSize(Row* row) {
+    return sizeof(row->id) + rowValueSize(row);
+}
+
+// Returns the rows scanned, and adds up their stored size in bytes
+uint64_t benchScan(Table* table, uint64_t* bytes) {
+    Row row;
+    uint64_t rows = 0;
+    Cursor* cursor = tableStart(table);
+
+    *bytes = 0;
+    while (!(cursor->end_of_table)) {
+        cursorRow(cursor, &row);
+        incrementCursor(cursor);
+        pagerUnpinAll(table->pager);
+        rows++;
+        *bytes += storedRowSize(&row);
+    }
+
+    free(cursor);
+    return rows;
+}
+
+// Per worker row counts, a cache line apart so workers don't slow each other down
+typedef struct {
+    uint64_t rows;
+    uint64_t bytes;
+    uint8_t padding[48];
+} ScanCount;
+
+void countRows(void* context, uint32_t worker, Row* rows, uint32_t count) {
+    ScanCount* scanCount = &((ScanCount*) context)[worker];
+    scanCount->rows += count;
+    for (uint32_t i = 0; i < count; i++) {
+        scanCount->bytes += storedRowSize(&rows[i]);
+    }
+}
+
+// Returns the rows scanned, and adds up their stored size in bytes
+uint64_t benchParallelScan(BenchOptions* bench, Table* table, uint64_t* bytes) {
+    ScanCount counts[SCAN_MAX_THREADS] = { 0 };
+    ParallelScan scan = {
+        .low = 0,
+        .high = SELECT_KEY_LIMIT,
+        .threads = bench->readers,
+        .ordered = false,
+        .visit = countRows,
+        .context = counts
+    };
+    parallelScan(table, &scan);
+
+    uint64_t rows = 0;
+    *bytes = 0;
+    for (uint32_t i = 0; i < SCAN_MAX_THREADS; i++) {
+        rows += counts[i].rows;
+        *bytes += counts[i].bytes;
+    }
+    return rows;
+}
+
+uint64_t benchCount(Table* table) {
+    PreparedStatement* prepared;
+    uint64_t count = 0;
+    dbPrepare(table, "select count(*)", &prepared);
+    if (dbStep(prepared, NULL) != EXECUTE_ROW || !dbAggregateValue(prepared, 0, &count)) {
+        printf("Count failed\n");
+        exit(EXIT_FAILURE);
+    }
+    dbFinalize(prepared);
+    return count;
+}
+
+// "select where email = ?" for random rows, through the index
+void benchEmailLookups(BenchOptions* bench, Table* table) {
+    PreparedStatement* prepared;
+    dbPrepare(table, "select where email = ?", &prepared);
+    unsigned int seed = 7;
+    Row row;
+
+    for (uint64_t i = 0; i < bench->lookups; i++) {
+        uint64_t index = ((uint64_t) rand_r(&seed) << 31 | rand_r(&seed)) % bench->rows;
+        uint32_t key = randomKey(index);
+        char email[COLUMN_EMAIL_SIZE + 1];
+        snprintf(email, sizeof(email), "person%u@example.com", key);
+
+        dbBindText(prepared, 1, email);
+        dbReset(prepared);
+        if (dbStep(prepared, &row) != EXECUTE_ROW || row.id != key || dbStep(prepared, &row) != EXECUTE_SUCCESS) {
+            printf("Email lookup of %u failed\n", key);
+            exit(EXIT_FAILURE);
+        }
+    }
+    dbFinalize(prepared);
+}
+
+double hitRatio(PagerStats* stats) {
+    uint64_t lookups = stats->hits + stats->misses;
+    return lookups ? (double) stats->hits / lookups : 0.0;
+}
+
+void printUsage(const char* program) {
+    printf("Usage: %s [--rows N] [--lookups N] [--batch N] [--readers N] [--cache-frames N] [--mmap] [--wal] [--compress] [--file PATH]\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions bench = {
+        .rows = BENCH_DEFAULT_ROWS,
+        .lookups = BENCH_DEFAULT_LOOKUPS,
+        .batch = 1,
+        .readers = 1,
+        .path = "bench.db",
+        .options = { .cache_frames = PAGER_DEFAULT_CACHE_FRAMES, .use_mmap = false, .use_wal = false, .compress = false }
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            bench.rows = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--lookups") == 0 && i + 1 < argc) {
+            bench.lookups = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            bench.batch = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--readers") == 0 && i + 1 < argc) {
+            bench.readers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache-frames") == 0 && i + 1 < argc) {
+            bench.options.cache_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            bench.options.use_mmap = true;
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            bench.options.use_wal = true;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            bench.options.compress = true;
+        } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+            bench.path = argv[++i];
+        } else {
+            printUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (bench.rows == 0 || bench.rows > UINT32_MAX || bench.batch == 0 || bench.readers == 0) {
+        printUsage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (bench.options.use_mmap && bench.options.use_wal) {
+        printf("--wal can't be combined with --mmap\n");
+        exit(EXIT_FAILURE);
+    }
+    if (bench.options.use_mmap && bench.options.compress) {
+        printf("--compress can't be combined with --mmap\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Phase sequential = benchInsert(&bench, sequentialKey);
+    Phase random = benchInsert(&bench, randomKey);
+
+    // Reopen so lookups and the scan start from a cold pool
+    Table* table = dbOpen(bench.path, &bench.options);
+    off_t fileBytes = lseek(table->pager->file_descriptor, 0, SEEK_END);
+    double* latencies = malloc((bench.lookups ? bench.lookups : 1) * sizeof(double));
+    double start = now();
+    benchLookups(&bench, table, latencies);
+    double lookupSeconds = now() - start;
+    PagerStats lookupStats = table->pager->stats;
+
+    start = now();
+    uint64_t scannedBytes;
+    uint64_t scanned = benchScan(table, &scannedBytes);
+    double scanSeconds = now() - start;
+    PagerStats scanStats = table->pager->stats;
+    scanStats.hits -= lookupStats.hits;
+    scanStats.misses -= lookupStats.misses;
+
+    start = now();
+    uint64_t parallelScannedBytes;
+    uint64_t parallelScanned = benchParallelScan(&bench, table, &parallelScannedBytes);
+    double parallelScanSeconds = now() - start;
+
+    start = now();
+    uint64_t counted = benchCount(table);
+    double countSeconds = now() - start;
+
+    PreparedStatement* createIndex;
+    dbPrepare(table, "create index on users(email)", &createIndex);
+    start = now();
+    if (dbStep(createIndex, NULL) != EXECUTE_SUCCESS) {
+        printf("Create index failed\n");
+        exit(EXIT_FAILURE);
+    }
+    double indexSeconds = now() - start;
+    dbFinalize(createIndex);
+
+    start = now();
+    benchEmailLookups(&bench, table);
+    double emailLookupSeconds = now() - start;
+
+    if (scanned != bench.rows || parallelScanned != bench.rows || counted != bench.rows) {
+        printf("Scans found %lu, %lu and %lu rows, expected %lu\n", scanned, parallelScanned, counted, bench.rows);
+        exit(EXIT_FAILURE);
+    }
+
+    const char* mode = bench.options.use_mmap ? "mmap" : (bench.options.use_wal ? "wal" : "pool");
+    printf("{\n");
+    printf("  \"rows\": %lu,\n", bench.rows);
+    printf("  \"batch\": %u,\n", bench.batch);
+    printf("  \"readers\": %u,\n", bench.readers);
+    printf("  \"mode\": \"%s\",\n", mode);
+    printf("  \"cache_frames\": %u,\n", bench.options.cache_frames);
+    printf("  \"compress\": %s,\n", bench.options.compress ? "true" : "false");
+    printf("  \"file_bytes\": %ld,\n", (long) fileBytes);
+    printf("  \"sequential_insert\": { \"seconds\": %.6f, \"rows_per_sec\": %.1f, \"hit_ratio\": %.4f },\n",
+           sequential.seconds, bench.rows / sequential.seconds, hitRatio(&sequential.stats));
+    printf("  \"random_insert\": { \"seconds\": %.6f, \"rows_per_sec\": %.1f, \"hit_ratio\": %.4f },\n",
+           random.seconds, bench.rows / random.seconds, hitRatio(&random.stats));
+    printf("  \"point_lookup\": { \"count\": %lu, \"lookups_per_sec\": %.1f, \"p50_ns\": %.0f, \"p90_ns\": %.0f, "
+           "\"p99_ns\": %.0f, \"max_ns\": %.0f, \"hit_ratio\": %.4f },\n",
+           bench.lookups, lookupSeconds > 0 ? bench.lookups / lookupSeconds : 0.0,
+           percentile(latencies, bench.lookups, 0.50), percentile(latencies, bench.lookups, 0.90),
+           percentile(latencies, bench.lookups, 0.99), percentile(latencies, bench.lookups, 1.0),
+           hitRatio(&lookupStats));
+    printf("  \"full_scan\": { \"seconds\": %.6f, \"rows_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"hit_ratio\": %.4f },\n",
+           scanSeconds, scanned / scanSeconds, scannedBytes / scanSeconds / 1e6, hitRatio(&scanStats));
+    printf("  \"parallel_scan\": { \"threads\": %u, \"seconds\": %.6f, \"rows_per_sec\": %.1f, \"mb_per_sec\": %.2f },\n",
+           bench.readers, parallelScanSeconds, parallelScanned / parallelScanSeconds,
+           parallelScannedBytes / parallelScanSeconds / 1e6);
+    printf("  \"count\": { \"seconds\": %.6f, \"rows_per_sec\": %.1f },\n", countSeconds, counted / countSeconds);
+    printf("  \"create_index\": { \"seconds\": %.6f, \"rows_per_sec\": %.1f },\n", indexSeconds, bench.rows / indexSeconds);
+    printf("  \"email_lookup\": { \"count\": %lu, \"lookups_per_sec\": %.1f }\n",
+           bench.lookups, emailLookupSeconds > 0 ? bench.lookups / emailLookupSeconds : 0.0);
+    printf("}\n");
+
+    free(latencies);
+    dbClose(table);
+    removeDatabase(bench.path);
+    return 0;
+}
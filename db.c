@@ -1,992 +1,6227 @@
-#include <errno.h>
-#include <fcntl.h>
-#define _GNU_SOURCE
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdbool.h>
-#include <string.h>
-#include <stdint.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#define _WIN32
-
-#define COLUMN_USERNAME_SIZE 32
-#define COLUMN_EMAIL_SIZE 255
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
-#define TABLE_MAX_PAGES 100
-
-
-// Enums
-typedef enum {
-    META_COMMAND_SUCCESS,
-    META_COMMAND_UNRECOGNIZED_COMMAND
-} MetaCommandResult;
-
-
-typedef enum {
-  PREPARE_SUCCESS,
-  PREPARE_SYNTAX_ERROR,
-  PREPARE_NEGATIVE_ID,
-  PREPARE_UNRECOGNIZED_STATEMENT,
-  PREPARE_STRING_TOO_LONG
- } PrepareResult;
-
-typedef enum {
-    STATEMENT_INSERT,
-    STATEMENT_SELECT
-} StatementType;
-
-typedef enum {
-    EXECUTE_SUCCESS,
-    EXECUTE_DUPLICATE_KEY,
-    EXECUTE_TABLE_FULL
-} ExecuteResult;
-
-typedef enum {
-    NODE_INTERNAL,
-    NODE_LEAF
- } NodeType;
-
-// Structs
-
-// Implement InputBuffer Wrapper
-typedef struct {
-    char* buffer;
-    size_t buffer_len;
-    size_t input_len;
-} InputBuffer;
-
-typedef struct {
-    uint32_t id;
-    char username[COLUMN_USERNAME_SIZE + 1]; // Add additional byte for null character
-                                            //          |
-    char email[COLUMN_EMAIL_SIZE + 1];     //       <---|  
-} Row;
-
-typedef struct {
-    StatementType type;
-    Row row_to_insert; // Used only by the "insert" command
-} Statement;
-
-// This structure will locate a certain block of memory and return it
-typedef struct {
-    FILE* file_descriptor;
-    uint32_t file_length;
-    uint32_t num_pages;
-    void* pages[TABLE_MAX_PAGES];
-} Pager;
-
-// Let's get a table structure to print to pages of rows. This will keep track of how many rows exist
-typedef struct {
-    uint32_t root_page_num; // A B-Tree is identified by its root node number
-    Pager* pager;
-} Table;
-
-typedef struct {
-    Table* table;
-    uint32_t page_num;
-    uint32_t cell_num;
-    bool end_of_table; // Indicates the next position past the last element
-} Cursor;
-
-// More definitions
-#define ID_SIZE size_of_attribute(Row, id)
-#define USERNAME_SIZE size_of_attribute(Row, username)
-#define EMAIL_SIZE size_of_attribute(Row, email)
-#define ID_OFFSET 0
-#define USERNAME_OFFSET (ID_OFFSET + ID_SIZE)
-
-// Constants
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
-const uint32_t PAGE_SIZE = 4096;
-#define ROWS_PER_PAGE (PAGE_SIZE / ROW_SIZE)
-#define TABLE_MAX_ROWS (ROWS_PER_PAGE * TABLE_MAX_PAGES)
-
-
-/*
-
-Important B-Tree Code
-
-*/
-
-/* 
-
-Common Node Metadata (In B-Tree)
-
-*/
-
-const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
-const uint32_t NODE_TYPE_OFFSET = 0;
-const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
-const uint32_t IS_ROOT_OFFSET = sizeof(uint8_t);
-const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-const uint32_t PARENT_POINTER_OFFSET = sizeof(uint8_t) + sizeof(uint8_t);
-const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
-#define COMMON_NODE_METADATA_SIZE NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE
-
-
-/* 
-
-Leaf Node Metadata
-
-    - Needs to store number of "cells"
-    - A cell is a key-value pair
-
-*/
-
-const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
-#define LEAF_NODE_NUM_CELLS_OFFSET COMMON_NODE_METADATA_SIZE
-#define LEAF_NODE_NEXT_LEAF_OFFSET LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE
-#define LEAF_NODE_METADATA_SIZE COMMON_NODE_METADATA_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE
-
-/*
-
-Leaf Node Body Format
-    - The body of a leaf node is an array of cells
-    - Each cell is a key followed by a value (i.e. a serialized table row)
-
-*/
-#define LEAF_NODE_KEY_SIZE sizeof(uint32_t)
-#define LEAF_NODE_KEY_OFFSET 0
-#define LEAF_NODE_VALUE_SIZE ROW_SIZE
-#define LEAF_NODE_VALUE_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
-#define LEAF_NODE_CELL_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE)
-#define LEAF_NODE_SPACE_FOR_CELLS PAGE_SIZE - LEAF_NODE_METADATA_SIZE
-#define LEAF_NODE_MAX_CELLS (LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE)
-#define LEAF_NODE_RIGHT_SPLIT_COUNT (LEAF_NODE_MAX_CELLS + 1) / 2
-#define LEAF_NODE_LEFT_SPLIT_COUNT (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT
-
-// Internal Node Header Layout
-#define INTERNAL_NODE_NUM_KEYS_SIZE sizeof(uint32_t)
-#define INTERNAL_NODE_NUM_KEYS_OFFSET COMMON_NODE_METADATA_SIZE
-#define INTERNAL_NODE_RIGHT_CHILD_SIZE sizeof(uint32_t)
-#define INTERNAL_NODE_RIGHT_CHILD_OFFSET (INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_OFFSET)
-#define INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_METADATA_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE)
-
-// Internal Node Body Format
-#define INTERNAL_NODE_KEY_SIZE sizeof(uint32_t)
-#define INTERNAL_NODE_CHILD_SIZE sizeof(uint32_t)
-#define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE)
-#define INTERNAL_NODE_MAX_CELLS 3
-
-// Some function declarations
-void* getPage(Pager* pager, uint32_t pageNum);
-void printConstants();
-void serializeRow(Row* source, void* destination);
-void deserializeRow(void* source, Row* destination);
-NodeType getNodeType(void* node);
-void setNodeType(void* node, NodeType type);
-void splitLeafNodeAndInsert(Cursor* cursor, uint32_t key, Row* value);
-void createNewRoot(Table* table, uint32_t rightChildPageNum);
-uint32_t* internalNodeNumKeys(void* node);
-uint32_t* internalNodeRightChild(void* node);
-uint32_t* internalNodeChild(void* node, uint32_t childNum);
-uint32_t* internalNodeKey(void* node, uint32_t keyNum);
-bool isRootNode(void* node);
-void setNodeRoot(void* node, bool isRoot);
-void initializeInternalNode(void* node);
-uint32_t getNodeMaxKey(void* node);
-void print_tree(Pager* pager, uint32_t pageNum, uint32_t indentationLevel);
-Cursor* internalNodeFind(Table* table, uint32_t pageNum, uint32_t key);
-Cursor* tableFind(Table* table, uint32_t key);
-void updateInternalNodeKey(void* node, uint32_t oldKey, uint32_t newKey);
-void insertInternalNode(Table* table, uint32_t parentPageNum, uint32_t childPageNum);
-uint32_t internalNodeFindChild(void* node, uint32_t key);
-
-uint32_t* leafNodeNextLeaf(void* node) {
-    return (uint32_t*) node + LEAF_NODE_NEXT_LEAF_OFFSET;
-}
-
-uint32_t* nodeParent(void* node){
-    return (uint32_t*) node + PARENT_POINTER_OFFSET;
-}
-
-uint32_t getUnusedPageNum(Pager* pager) {
-    return pager->num_pages;
-}
-
-uint32_t* leafNodeNumCells(void* node) {
-    return (uint32_t*) node + LEAF_NODE_NUM_CELLS_OFFSET;
-}
-
-void* leafNodeCell(void* node, uint32_t cellNum) {
-    return (uint32_t*) node + LEAF_NODE_METADATA_SIZE + cellNum * LEAF_NODE_CELL_SIZE;
-}
-
-uint32_t* leafNodeKey(void* node, uint32_t cellNum) {
-    return leafNodeCell(node, cellNum);
-}
-
-void* leafNodeValue(void* node, uint32_t cellNum) {
-    return (uint32_t*) leafNodeCell(node, cellNum) + LEAF_NODE_KEY_SIZE;
-}
-
-void initializeLeafNode(void* node) {
-    setNodeType(node, NODE_LEAF);
-    setNodeRoot(node, false);
-    *leafNodeNumCells(node) = 0;
-    *leafNodeNextLeaf(node) = 0; // The 0 means the leaf has no siblings
-}
-// Function to insert key-value pairs into a leaf node
-// Takes a cursor as input to represent where the pair should be inserted
-void insertLeafNode(Cursor* cursor, uint32_t key, Row* value) {
-    void* node = getPage(cursor->table->pager, cursor->page_num);
-    uint32_t numCells = *leafNodeNumCells(node);
-
-    if (numCells >= LEAF_NODE_MAX_CELLS) {
-        // Node is full
-        splitLeafNodeAndInsert(cursor, key, value);
-        return;
-    }
-
-    if (cursor->cell_num < numCells) {
-        // Make room for a new cell
-        for(uint32_t i = numCells; i > cursor->cell_num; i--){
-            memcpy(leafNodeCell(node, i), leafNodeCell(node, i - 1), LEAF_NODE_CELL_SIZE);
-        }
-    }
-
-    *(leafNodeNumCells(node)) += 1;
-    *(leafNodeKey(node, cursor->cell_num)) = key;
-    serializeRow(value, leafNodeValue(node, cursor->cell_num));
-}
-
-
-// Methods
-InputBuffer* newInputBuffer() {
-    InputBuffer* input_buffer = (InputBuffer*) malloc(sizeof(InputBuffer));
-    input_buffer->buffer = NULL;
-    input_buffer->buffer_len = 0;
-    input_buffer->input_len = 0;
-
-    return input_buffer;
-}
-
-void printPrompt() {
-    printf("db > ");
-}
-
-void printRow(Row* row){
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
-
-void readInput(InputBuffer* input_buffer) {
-    size_t bytesRead = getline(&(input_buffer->buffer), &(input_buffer->buffer_len), stdin);
-
-    // Basic error-handling
-    if (bytesRead <= 0) {
-        printf("Invalid input\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // Ignore any trailing newlines
-    input_buffer->input_len = bytesRead - 1;
-    input_buffer->buffer[bytesRead - 1] = 0;
-}
-
-void closeInputBuffer(InputBuffer* buffer) {
-    free(buffer->buffer);
-    free(buffer);
-}
-
-// Helper function to error-check "insert" statements
-PrepareResult prepareInsert(InputBuffer* buffer, Statement* statement) {
-    statement->type = STATEMENT_INSERT;
-
-    // Split each string to check its length.
-    // Do this to ensure no buffer overflows are caused 
-    char* keyword = strtok(buffer->buffer, " ");
-    char* idString = strtok(NULL, " ");
-    char* username = strtok(NULL, " ");
-    char* email = strtok(NULL, " ");
-
-    if (idString == NULL || username == NULL || email == NULL) {
-        return PREPARE_SYNTAX_ERROR;
-    }
-
-    int id = atoi(idString);
-
-    // Check for valid ID tag
-    if (id < 0) {
-        return PREPARE_NEGATIVE_ID;
-    }
-
-    if (strlen(username) > COLUMN_USERNAME_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
-    }
-
-    if (strlen(email) > COLUMN_EMAIL_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
-    }
-
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
-
-    return PREPARE_SUCCESS;
-
-}
-
-// Our very own minimalistic "SQL Compiler"
-PrepareResult prepareStatement(InputBuffer* buffer, Statement* statement) {
-    if (strncmp(buffer->buffer, "insert", 6) == 0) {
-        return prepareInsert(buffer, statement);
-    }
-
-    if (strcmp(buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
-    }
-
-    return PREPARE_UNRECOGNIZED_STATEMENT;
-}
-
-void serializeRow(Row* source, void* destination) {
-    memcpy((uint32_t*) destination + ID_OFFSET, &(source->id), ID_SIZE);
-    memcpy((uint32_t*) destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-    memcpy((uint32_t*) destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
-}
-
-void deserializeRow(void* source, Row* destination){
-    memcpy(&(destination->id), (uint32_t*) source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), (uint32_t*) source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), (uint32_t*) source + EMAIL_OFFSET, EMAIL_SIZE);
-}
-
-/* 
-
-The method below handles the logic for missing any cached files.
-Assumes pages are saved on after another with their own corresponding offset value.
-If the page lies outside the bounds of the file, it'll be NULL.
-From there, we can add the page to the file when the cache if flushed to disk later on.
-
-*/
-void* getPage(Pager* pager, uint32_t pageNum) {
-    if (pageNum > TABLE_MAX_PAGES) {
-        printf("Page number out of bounds. %d > %d\n", pageNum, TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
-    }
-    // If the pager is empty
-    if (pager->pages[pageNum] == NULL) {
-        // Cache miss. Allocate new memory and load from file.
-        void* page = malloc(PAGE_SIZE);
-        uint32_t numPages = pager->file_length / PAGE_SIZE;
-
-        // There's a possibility of a partial page being saved at end of file.
-        // To prevent this, increment numPages by 1
-        if (pager->file_length % PAGE_SIZE) {
-            numPages += 1;
-        }
-
-        if (pageNum <= numPages) {
-            fseek(pager->file_descriptor, pageNum * PAGE_SIZE, SEEK_SET);
-            // size_t bytesRead = fread(pager->file_descriptor, page, PAGE_SIZE);
-            // ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            size_t bytesRead = fread(page, PAGE_SIZE, pageNum * PAGE_SIZE, pager->file_descriptor);
-            if (bytesRead == -1) {
-                printf("Error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
-            }
-        }
-
-        pager->pages[pageNum] = page;
-
-        if (pageNum >= pager->num_pages) {
-            pager->num_pages = pageNum + 1;
-        }
-    }
-
-    return pager->pages[pageNum];
-}
-
-void pagerFlush(Pager* pager, uint32_t pageNum) {
-    if (pager->pages[pageNum] == NULL) {
-        printf("Tried to flush a null page\n");
-        exit(EXIT_FAILURE);
-    }
-
-    off_t offset = fseek(pager->file_descriptor, pageNum * PAGE_SIZE, SEEK_SET);
-
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
-    }
-
-    // size_t bytesWritten = write(pager->file_descriptor, pager->pages[pageNum], PAGE_SIZE);
-    size_t bytesWritten = fwrite(pager->pages[pageNum], pageNum * PAGE_SIZE, PAGE_SIZE, pager->file_descriptor);
-
-    if (bytesWritten == -1) {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
-    }
-
-
-}
-
-// When user exits the program, close the db connection
-void dbClose(Table* table) {
-    Pager* pager = table->pager;
-
-    for(uint32_t i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
-        }
-
-        pagerFlush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
-    }
-
-
-    // int res = close(pager->file_descriptor); <-- Older version
-    int res = fclose(pager->file_descriptor);
-    if (res == -1) {
-        printf("Error closing db file\n");
-        exit(EXIT_FAILURE);
-    }
-
-    for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void* page = pager->pages[i];
-        if(page) {
-            free(page);
-            pager->pages[i] = NULL;
-        }
-    }
-
-    free(pager);
-    free(table);
-}
-
-MetaCommandResult execMetaCommand(InputBuffer* buffer, Table* table){ 
-    if (strcmp(buffer->buffer, ".exit") == 0) {
-        dbClose(table);
-        exit(EXIT_SUCCESS);
-    } else if (strcmp(buffer->buffer, ".btree") == 0) {
-        printf("Tree:\n");
-        print_tree(table->pager, 0, 0);
-        return META_COMMAND_SUCCESS;
-    } else if (strcmp(buffer->buffer, ".constants") == 0) {
-        printf("Constants:\n");
-        printConstants();
-        return META_COMMAND_SUCCESS;
-    } else {
-        return  META_COMMAND_UNRECOGNIZED_COMMAND;
-    }
-}
-
-Cursor* tableStart(Table* table) {
-    Cursor* cursor = tableFind(table, 0);
-    void* node = getPage(table->pager, cursor->page_num);
-    uint32_t numCells = *leafNodeNumCells(node);
-    cursor->end_of_table = (numCells == 0);
-    return cursor;
-}
-
-// Return a pointer to the position which the cursor is located
-void* cursorValue(Cursor* cursor) {
-    uint32_t pageNum = cursor->page_num;
-    void* page = getPage(cursor->table->pager, pageNum);
-    return leafNodeValue(page, cursor->cell_num);
-}
-
-Cursor* findLeafNode(Table* table, uint32_t pageNum, uint32_t key) {
-    void* node = getPage(table->pager, pageNum);
-    uint32_t numCells = *leafNodeNumCells(node);
-
-    Cursor* cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = pageNum;
-
-    // Search for leaf node using binary search
-    uint32_t minIndex = 0;
-    uint32_t onePastMaxIndex = numCells;
-
-    while (onePastMaxIndex != minIndex) {
-        uint32_t index = (minIndex + onePastMaxIndex) / 2;
-        uint32_t keyAtIndex = *leafNodeKey(node, index);
-        if (key == keyAtIndex) {
-            cursor->cell_num = index;
-            return cursor;
-        }
-
-        if (key < keyAtIndex) {
-            onePastMaxIndex = index;
-        } else {
-            minIndex = index + 1;
-        }
-    }
-
-    cursor->cell_num = minIndex;
-    return cursor;
-}
-
-Cursor* tableFind(Table* table, uint32_t key) {
-    uint32_t rootPageNum = table->root_page_num;
-    void* rootNode = getPage(table->pager, rootPageNum);
-
-    if (getNodeType(rootNode) == NODE_LEAF) {
-        return findLeafNode(table, rootPageNum, key);
-    } else {
-        printf("Need to implement searching for internal nodes\n");
-        exit(EXIT_FAILURE);
-    }
-}
-
-void incrementCursor (Cursor* cursor) {
-    uint32_t pageNum = cursor->page_num;
-    void* node = getPage(cursor->table->pager, pageNum);
-    cursor->cell_num += 1;
-    if (cursor->cell_num >= (*leafNodeNumCells(node))) {
-        cursor->end_of_table = true;
-    }
-}
-
-// Makeshift "virtual machine"
-ExecuteResult executeInsert(Statement* statement, Table* table) {
-    Row* rowToInsert = &(statement->row_to_insert);
-    uint32_t keyToInsert = rowToInsert->id;
-    Cursor* cursor = tableFind(table, keyToInsert);
-
-    void* node = getPage(table->pager, table->root_page_num);
-    uint32_t numCells = *leafNodeNumCells(node);
-
-    if (cursor->cell_num < numCells) {
-        uint32_t keyAtIndex = *leafNodeKey(node, cursor->cell_num);
-        if (keyAtIndex == keyToInsert) {
-            return EXECUTE_DUPLICATE_KEY;
-        }
-    }
-
-    // serializeRow(rowToInsert, rowSlot(table, table->num_rows));
-    insertLeafNode(cursor, rowToInsert->id, rowToInsert);
-    
-    return EXECUTE_SUCCESS;
-}
-
-ExecuteResult executeSelect(Statement* statement, Table* table) {
-    Cursor* cursor = tableStart(table);
-    Row row;
-    // for (uint32_t i = 0; i < table->num_rows; i++) {
-    //     deserializeRow(rowSlot(table, i), &row);
-    //     printRow(&row);
-    // }
-
-    while (!(cursor->end_of_table)) {
-        deserializeRow(cursorValue(cursor), &row);
-        printRow(&row);
-        incrementCursor(cursor);
-    }
-
-    free(cursor);
-
-    return EXECUTE_SUCCESS;
-}
-
-ExecuteResult executeStatement(Statement* statement, Table* table) {
-    switch (statement->type) {
-        case (STATEMENT_INSERT):
-            return executeInsert(statement, table);
-            break;
-        case (STATEMENT_SELECT):
-            return executeSelect(statement, table);
-    }
-}
-
-Pager* pagerOpen(const char* filename) {
-    // int fileDescriptor = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
-    FILE* stream;
-    //  int fd = open(filename,
-    //             O_RDWR |      // Read/Write mode
-    //                 O_CREAT,  // Create file if it does not exist
-    //             S_IWRITE|     // User write permission
-    //                 S_IREAD   // User read permission
-    //             );
-
-    FILE* fd = fopen(filename, "r+");
-    // FILE* fd = fdopen();
-
-    if(!fd) {
-
-        fd = fopen(filename, "w+");
-
-        if (!fd) {
-            printf("Unable to open file\n");
-            exit(EXIT_FAILURE);
-        }
-    }
-
-    // off_t fileLength = lseek(fd, 0, SEEK_END); // <-- Older version
-    off_t fileLength = fseek(fd, 0, SEEK_END);
-
-    Pager* pager = malloc(sizeof(Pager));
-    pager->file_descriptor = fd;
-    pager->file_length = fileLength;
-    pager->num_pages = (fileLength / PAGE_SIZE);
-
-    if (fileLength % PAGE_SIZE != 0) {
-        printf("DB file is not a whole number of pages. Corrupt file detected\n");
-        exit(EXIT_FAILURE);
-    }
-
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
-    }
-
-    return pager;
-}
-
-// Initialize and open new database file 
-Table* dbOpen(const char* filename) {   
-    Pager* pager = pagerOpen(filename);
-
-    Table* table = (Table*)malloc(sizeof(Table));
-    table->pager = pager;
-    table->root_page_num = 0;
-    
-    if (pager->num_pages == 0) {
-        // New DB file. Initialize page 0 as leaf node
-        void* rootNode = getPage(pager, 0);
-        initializeLeafNode(rootNode);
-        setNodeRoot(rootNode, true);
-    }
-
-    return table;
-}
-
-NodeType getNodeType(void* node) {
-    uint8_t value = *((uint8_t*)((uint32_t*) node + NODE_TYPE_OFFSET));
-    return (NodeType) value;
-}
-
-void setNodeType(void* node, NodeType type) {
-    uint8_t value = type;
-    *((uint8_t*)((uint32_t*)node + NODE_TYPE_OFFSET)) = value;
-}
-
-void splitLeafNodeAndInsert(Cursor* cursor, uint32_t key, Row* value) {
-    // Create a new node and move half of cells over
-    // Insert the new value in one of the two nodes
-    // Update parent or create a new parent if needed
-    void* oldNode = getPage(cursor->table->pager, cursor->page_num);
-    uint32_t oldMax = getNodeMaxKey(oldNode);
-    uint32_t newPageNum = getUnusedPageNum(cursor->table->pager);
-    void* newNode = getPage(cursor->table->pager, newPageNum);
-    initializeLeafNode(newNode);
-    *nodeParent(newNode) = *nodeParent(oldNode);
-    *leafNodeNextLeaf(newNode) =*leafNodeNextLeaf(oldNode);
-    *leafNodeNextLeaf(oldNode) = newPageNum;
-
-    // Now all existing keys plus the new key should be divided
-    // evenly between old (left) and new (right) nodes.
-    // Starting from the right, move each key to correct position
-    for(int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-        void* destinationNode;
-
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-            destinationNode = newNode;
-        } else {
-            destinationNode = oldNode;
-        }
-
-        uint32_t indexWithinNode = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void* destination = leafNodeCell(destinationNode, indexWithinNode);
-        if (i == cursor->cell_num) {
-            // serializeRow(value, destination);
-            serializeRow(value, leafNodeValue(destinationNode, indexWithinNode));
-            *leafNodeKey(destinationNode, indexWithinNode) = key;
-        } else if (i > cursor->cell_num) {
-            memcpy(destination, leafNodeCell(oldNode, i - 1), LEAF_NODE_CELL_SIZE);
-        } else {
-            memcpy(destination, leafNodeCell(oldNode, i), LEAF_NODE_CELL_SIZE);
-        }
-    }
-
-    *(leafNodeNumCells(oldNode)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leafNodeNumCells(newNode)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-    // Now update the nodes' parent
-    if (isRootNode(oldNode)) {
-        return createNewRoot(cursor->table, newPageNum);
-    } else {
-        uint32_t parentPageNum = *nodeParent(oldNode);
-        uint32_t newMax = getNodeMaxKey(oldNode);
-        void* parent = getPage(cursor->table->pager, parentPageNum);
-        updateInternalNodeKey(parent, oldMax, newMax);
-        insertInternalNode(cursor->table, parentPageNum, newPageNum);
-        return;
-    }
-}
-
-void createNewRoot(Table* table, uint32_t rightChildPageNum) {
-    // Old root is copied to new page and becomes left child
-    // Address of right child is passed in
-    // Re-initialize root page to contain the new root node
-    // New root node points to two children
-
-    void* root = getPage(table->pager, table->root_page_num);
-    void* rightChild = getPage(table->pager, rightChildPageNum);
-    uint32_t leftChildPageNum = getUnusedPageNum(table->pager);
-    void* leftChild = getPage(table->pager, leftChildPageNum);
-
-    // Left child has data copied from old root
-    memcpy(leftChild, root, PAGE_SIZE);
-    setNodeRoot(leftChild, false);
-
-    initializeInternalNode(root);
-    setNodeRoot(root, true);
-    *internalNodeNumKeys(root) = 1;
-    *internalNodeChild(root, 0) = leftChildPageNum;
-    uint32_t leftChildMaxKey = getNodeMaxKey(leftChild);
-    *internalNodeKey(root, 0) = leftChildMaxKey;
-    *internalNodeRightChild(root) = rightChildPageNum;
-
-    // In order to get a reference to parent node, we need to record in each node a pointer to parent
-    *nodeParent(leftChild) = table->root_page_num;
-    *nodeParent(rightChild) = table->root_page_num;
-
-}
-
-uint32_t* internalNodeNumKeys(void* node) {
-    return (uint32_t*) node + INTERNAL_NODE_NUM_KEYS_OFFSET;
-}
-
-uint32_t* internalNodeRightChild(void* node) {
-    return (uint32_t*) node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
-}
-
-uint32_t* internalNodeCell(void* node, uint32_t cellNum) {
-    return (uint32_t*) node + INTERNAL_NODE_HEADER_SIZE + cellNum * INTERNAL_NODE_CELL_SIZE;
-}
-
-uint32_t* internalNodeChild(void* node, uint32_t childNum) {
-    uint32_t numKeys = *internalNodeNumKeys(node);
-    if (childNum > numKeys) {
-        printf("Tried to access child_num %d > num_keys %d\n", childNum, numKeys);
-        exit(EXIT_FAILURE);
-    } else if (childNum == numKeys) {
-        return internalNodeRightChild(node);
-    } else {
-        return internalNodeCell(node, childNum);
-    }
-}
-
-uint32_t* internalNodeKey(void* node, uint32_t keyNum) {
-    return internalNodeCell(node, keyNum) + INTERNAL_NODE_CHILD_SIZE;
-}
-
-void updateInternalNodeKey(void* node, uint32_t oldKey, uint32_t newKey) {
-    uint32_t oldChildIndex = internalNodeFindChild(node, oldKey);
-    *internalNodeKey(node, oldChildIndex) = newKey;
-}
-
-// For an internal node, the max key is its right key
-// For a leaf node, however, it's the key at the max index
-uint32_t getNodeMaxKey(void* node) {
-    switch(getNodeType(node)) {
-        case NODE_INTERNAL:
-            return *internalNodeKey(node, *internalNodeNumKeys(node) - 1);
-        case NODE_LEAF:
-            return *leafNodeKey(node, *leafNodeNumCells(node) - 1);
-    }
-}
-
-// Getter and Setter functions to help keep track of the root node
-bool isRootNode(void* node){
-    uint8_t value = *((uint8_t*)((uint32_t*)node + IS_ROOT_OFFSET));
-    return (bool) value;
-}
-
-void setNodeRoot(void* node, bool isRoot) {
-    uint8_t value = isRoot;
-    *((uint8_t*)((uint32_t*)node + IS_ROOT_OFFSET)) = value;
-}
-
-
-
-void initializeInternalNode(void* node) {
-    setNodeType(node, NODE_INTERNAL);
-    setNodeRoot(node, false);
-    *internalNodeNumKeys(node) = 0;
-}
-
-// Meta Commands
-void printConstants() {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_METADATA_SIZE: %d\n", COMMON_NODE_METADATA_SIZE);
-    printf("LEAF_NODE_METADATA_SIZE: %d\n", LEAF_NODE_METADATA_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %ld\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %ld\n", LEAF_NODE_MAX_CELLS);
-}
-
-// Metadata functions to visualize the B-Tree
-void indent(uint32_t level) {
-    for(uint32_t i = 0; i < level; i++) {
-        printf(" ");
-    }
-}
-
-void print_tree(Pager* pager, uint32_t pageNum, uint32_t indentationLevel) {
-    void* node = getPage(pager, pageNum);
-    uint32_t numKeys, child;
-
-    switch(getNodeType(node)) {
-        case (NODE_LEAF):
-            numKeys = *leafNodeNumCells(node);
-            indent(indentationLevel);
-            printf("- leaf (size %d)\n", numKeys);
-
-            for (uint32_t i = 0; i < numKeys; i++) {
-                indent(indentationLevel + 1);
-                printf("- %d\n", *leafNodeKey(node, i));
-            }
-            break;
-        case (NODE_INTERNAL):
-            numKeys = *internalNodeNumKeys(node);
-            indent(indentationLevel);
-            printf("- internal (size %d)\n", numKeys);
-            for (uint32_t i = 0; i < numKeys; i++) {
-                child = *internalNodeChild(node, i);
-                print_tree(pager, child, indentationLevel + 1);
-                indent(indentationLevel + 1);
-                printf("- key %d\n", *internalNodeKey(node, i));
-            }
-
-            child = *internalNodeRightChild(node);
-            print_tree(pager, child, indentationLevel + 1);
-            break;
-    }
-}
-
-// Return the index of the child node which 'should' contain the given key value
-uint32_t internalNodeFindChild(void* node, uint32_t key) {
-    uint32_t numKeys = *internalNodeNumKeys(node);
-
-    // Binary search to find index of child to search
-    uint32_t minIndex = 0;
-    uint32_t maxIndex = numKeys;
-
-    while (minIndex != maxIndex) {
-        uint32_t index = (minIndex + maxIndex) / 2;
-        uint32_t keyToRight = *internalNodeKey(node, index);
-
-        if (keyToRight >= key) {
-            maxIndex = index;
-        } else {
-            minIndex = index + 1;
-        }
-    }
-
-    return minIndex;
-}
-
-Cursor* internalNodeFind(Table* table, uint32_t pageNum, uint32_t key) {
-    void* node = getPage(table->pager, pageNum);
-    uint32_t numKeys = *internalNodeNumKeys(node);
-
-    uint32_t childIndex = internalNodeFindChild(node, key);
-    uint32_t childNum = *internalNodeChild(node, childIndex);
-    void* child = getPage(table->pager, childNum);
-    switch (getNodeType(child)) {
-        case NODE_LEAF:
-            return findLeafNode(table, childNum, key);
-        case NODE_INTERNAL:
-            return internalNodeFind(table, childNum, key);
-    }
-}
-
-void insertInternalNode(Table* table, uint32_t parentPageNum, uint32_t childPageNum) {
-    // Add a new child / key pair (aka cell) to corresponding parent node
-    void* parent = getPage(table->pager, parentPageNum);
-    void* child = getPage(table->pager, childPageNum);
-
-    // The index where the new cell should be depends on the max key in the new child
-    // If there's no room in the internal node for another cell, throw error (need to split internal node)
-    uint32_t childMaxKey = getNodeMaxKey(child);
-    uint32_t index = internalNodeFindChild(parent, childMaxKey);
-    uint32_t originalNumKeys = *internalNodeNumKeys(parent);
-    *internalNodeNumKeys(parent) = originalNumKeys + 1;
-
-    if (originalNumKeys >= INTERNAL_NODE_MAX_CELLS) {
-        printf("Need to split internal nodes\n");
-        exit(EXIT_FAILURE);
-    }
-
-    uint32_t rightChildPageNum = *internalNodeRightChild(parent);
-    void* rightChild = getPage(table->pager, rightChildPageNum);
-
-    if (childMaxKey > getNodeMaxKey(rightChild)) {
-        // Replace the right child
-        *internalNodeChild(parent, originalNumKeys) = rightChildPageNum;
-        *internalNodeKey(parent, originalNumKeys) = getNodeMaxKey(rightChild);
-        *internalNodeRightChild(parent) = childPageNum;
-    } else {
-        // Make room for a new cell
-        for (uint32_t i = originalNumKeys; i > index; i--) {
-            void* destination = internalNodeCell(parent, i);
-            void* source = internalNodeCell(parent, i - 1);
-            memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
-        }
-
-        *internalNodeChild(parent, index) = childPageNum;
-        *internalNodeKey(parent, index) = childMaxKey;
-    }
-
-}
-
-int main(int argc, char* argv[]) {
-
-    if (argc < 2) {
-        printf("Must supply a databse filename\n");
-        exit(EXIT_FAILURE);
-    }
-
-    char* filename = argv[1];
-    Table* table = dbOpen(filename);
-
-    InputBuffer* buffer = newInputBuffer();
-
-    while (true) {
-        printPrompt();
-        readInput(buffer);
-
-        if (buffer->buffer[0] == '.') {
-            switch (execMetaCommand(buffer, table)) {
-                case (META_COMMAND_SUCCESS):
-                    continue;
-                case (META_COMMAND_UNRECOGNIZED_COMMAND):
-                    printf("Unrecognized command %s\n", buffer->buffer);
-                    continue;
-            }
-        }
-    
-        
-        Statement statement;
-        switch (prepareStatement(buffer, &statement)) {
-            case (PREPARE_SUCCESS):
-                break;
-            case (PREPARE_NEGATIVE_ID):
-                printf("ID must be a positive number\n");
-                break;
-            case (PREPARE_STRING_TOO_LONG):
-                printf("String is too long\n");
-                continue;
-            case (PREPARE_SYNTAX_ERROR):
-                printf("Syntax error. Could not parse statement\n");
-                continue;
-            case (PREPARE_UNRECOGNIZED_STATEMENT):
-                printf("Unrecognized keyword at start of '%s'\n", buffer->buffer);
-                continue;
-        }
-
-        switch (executeStatement(&statement, table)) {
-            case (EXECUTE_SUCCESS):
-                printf("Executed\n");
-                break;
-            case (EXECUTE_TABLE_FULL):
-                printf("Error: Table full\n");
-                break;
-        }
-    }
-}
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#define _WIN32
+
+#include "db.h"
+
+
+// More definitions
+#define ID_SIZE size_of_attribute(Row, id)
+#define USERNAME_SIZE size_of_attribute(Row, username)
+#define EMAIL_SIZE size_of_attribute(Row, email)
+
+// Constants
+const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+const uint32_t PAGE_SIZE = 4096;
+
+
+/*
+
+Important B-Tree Code
+
+*/
+
+/* 
+
+Common Node Metadata (In B-Tree)
+
+*/
+
+const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
+const uint32_t NODE_TYPE_OFFSET = 0;
+const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
+const uint32_t IS_ROOT_OFFSET = sizeof(uint8_t);
+const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
+const uint32_t PARENT_POINTER_OFFSET = sizeof(uint8_t) + sizeof(uint8_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+#define COMMON_NODE_METADATA_SIZE (NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE)
+
+
+/* 
+
+Leaf Node Metadata
+
+    - Needs to store number of "cells"
+    - A cell is a key-value pair
+    - Also the next leaf to the right, and where the cell content area starts
+
+*/
+
+const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
+#define LEAF_NODE_NUM_CELLS_OFFSET COMMON_NODE_METADATA_SIZE
+#define LEAF_NODE_NEXT_LEAF_OFFSET (LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE)
+#define LEAF_NODE_CONTENT_START_SIZE sizeof(uint16_t)
+#define LEAF_NODE_CONTENT_START_OFFSET (LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE)
+#define LEAF_NODE_METADATA_SIZE (COMMON_NODE_METADATA_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_CONTENT_START_SIZE)
+
+/*
+
+Leaf Node Body Format (slotted page)
+    - After the metadata comes an array of slots, one per cell, kept in key order
+    - Each slot holds the cell's key along with the offset and size of its value
+    - Values are packed against the end of the page and grow down towards the slots.
+      The content start in the metadata is the lowest byte in use
+    - A value is the username and email lengths (one byte each) followed by their
+      bytes, with no terminators. The id isn't repeated, it's the key in the slot
+
+*/
+#define LEAF_NODE_KEY_SIZE sizeof(uint32_t)
+#define LEAF_NODE_KEY_OFFSET 0
+#define LEAF_NODE_VALUE_OFFSET_SIZE sizeof(uint16_t)
+#define LEAF_NODE_VALUE_OFFSET_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
+#define LEAF_NODE_VALUE_SIZE_SIZE sizeof(uint16_t)
+#define LEAF_NODE_VALUE_SIZE_OFFSET (LEAF_NODE_VALUE_OFFSET_OFFSET + LEAF_NODE_VALUE_OFFSET_SIZE)
+#define LEAF_NODE_SLOT_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_OFFSET_SIZE + LEAF_NODE_VALUE_SIZE_SIZE)
+#define LEAF_NODE_VALUE_HEADER_SIZE (2 * sizeof(uint8_t))
+#define LEAF_NODE_MAX_VALUE_SIZE (LEAF_NODE_VALUE_HEADER_SIZE + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE)
+#define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_METADATA_SIZE)
+#define LEAF_NODE_MAX_CELLS (LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_SLOT_SIZE + LEAF_NODE_VALUE_HEADER_SIZE)) // All rows empty strings
+
+// Internal Node Header Layout
+#define INTERNAL_NODE_NUM_KEYS_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_NUM_KEYS_OFFSET COMMON_NODE_METADATA_SIZE
+#define INTERNAL_NODE_RIGHT_CHILD_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_RIGHT_CHILD_OFFSET (INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE)
+#define INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_METADATA_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE)
+
+// Internal Node Body Format
+#define INTERNAL_NODE_KEY_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_CHILD_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE)
+#define INTERNAL_NODE_SPACE_FOR_CELLS (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE)
+#define INTERNAL_NODE_MAX_CELLS (INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE) // Fill the whole page
+
+/*
+
+Header Page
+    - Page 1, written along with the root when the file is created. The table's
+      root stays in page 0, so a next leaf of 0 still means there isn't one
+    - A magic number, then the root page of the index on each column (0 if none)
+    - Index leaves are keyed by a hash of the column value, and each value is the
+      id of a row with that hash. Keys repeat when rows share a value or a hash
+    - The first freelist trunk page (0 if there are no free pages), and how many
+      pages are free altogether, trunks included
+
+*/
+#define HEADER_PAGE_NUM 1
+#define HEADER_MAGIC 0x31424453 // "SDB1"
+#define HEADER_MAGIC_OFFSET 0
+#define HEADER_INDEX_ROOTS_OFFSET (HEADER_MAGIC_OFFSET + sizeof(uint32_t))
+#define HEADER_FREELIST_TRUNK_OFFSET (HEADER_INDEX_ROOTS_OFFSET + TEXT_COLUMNS * sizeof(uint32_t))
+#define HEADER_FREE_PAGES_OFFSET (HEADER_FREELIST_TRUNK_OFFSET + sizeof(uint32_t))
+
+/*
+
+Freelist Trunk Page
+    - Free pages are chained through trunk pages, each one free itself
+    - The next trunk (0 for the last one), then a count and the numbers of
+      free pages it holds. Pages are handed out from the first trunk, last in
+      first out, and the trunk itself goes once it's empty
+
+*/
+#define FREELIST_NEXT_TRUNK_OFFSET 0
+#define FREELIST_NUM_PAGES_OFFSET (FREELIST_NEXT_TRUNK_OFFSET + sizeof(uint32_t))
+#define FREELIST_PAGES_OFFSET (FREELIST_NUM_PAGES_OFFSET + sizeof(uint32_t))
+#define FREELIST_MAX_PAGES ((PAGE_SIZE - FREELIST_PAGES_OFFSET) / sizeof(uint32_t))
+
+// Some function declarations
+bool pagerPrefetch(Pager* pager, uint32_t pageNum);
+void pagerMarkDirty(Pager* pager, uint32_t pageNum);
+NodeType getNodeType(void* node);
+void setNodeType(void* node, NodeType type);
+void splitLeafNodeAndInsert(Cursor* cursor, uint32_t key, void* value, uint32_t valueSize);
+void createNewRoot(Table* table, uint32_t rightChildPageNum);
+uint32_t* internalNodeNumKeys(void* node);
+uint32_t* internalNodeRightChild(void* node);
+uint32_t* internalNodeChild(void* node, uint32_t childNum);
+uint32_t* internalNodeCell(void* node, uint32_t cellNum);
+uint32_t* internalNodeKey(void* node, uint32_t keyNum);
+bool isRootNode(void* node);
+void setNodeRoot(void* node, bool isRoot);
+void initializeInternalNode(void* node);
+uint32_t getNodeMaxKey(Pager* pager, void* node);
+void* descendToLeaf(Table* table, uint32_t key, uint32_t* leafPageNum, int64_t* fence, uint64_t readAheadEnd);
+Cursor* tableSeekRange(Table* table, uint32_t key, uint64_t end);
+void tableSeekInto(Table* table, uint32_t key, uint64_t end, Cursor* cursor, void* snapshot);
+void tableReadAhead(Table* table, uint32_t nextPageNum, uint32_t lastKey, uint64_t end);
+void cursorSkipExhaustedLeaves(Cursor* cursor);
+uint32_t internalNodeChildIndex(void* node, uint32_t childPageNum);
+void updateInternalNodeKey(void* node, uint32_t childPageNum, uint32_t newKey);
+void insertInternalNode(Table* table, uint32_t parentPageNum, uint32_t leftPageNum, uint32_t childPageNum);
+void internalNodeSplitAndInsert(Table* table, uint32_t parentPageNum, uint32_t leftPageNum, uint32_t childPageNum);
+uint32_t internalNodeFindChild(void* node, uint32_t key);
+ExecuteResult insertSortedRows(Table* table, Row* rows, uint32_t numRows);
+void indexRow(Table* table, Row* row);
+void destroyPreparedStatement(PreparedStatement* prepared);
+uint64_t hashText(const char* text);
+
+uint32_t* leafNodeNextLeaf(void* node) {
+    return (uint32_t*) ((uint8_t*) node + LEAF_NODE_NEXT_LEAF_OFFSET);
+}
+
+uint32_t* nodeParent(void* node){
+    return (uint32_t*) ((uint8_t*) node + PARENT_POINTER_OFFSET);
+}
+
+uint32_t* headerMagic(void* page) {
+    return (uint32_t*) ((uint8_t*) page + HEADER_MAGIC_OFFSET);
+}
+
+uint32_t* headerIndexRoot(void* page, TextColumn column) {
+    return (uint32_t*) ((uint8_t*) page + HEADER_INDEX_ROOTS_OFFSET) + column;
+}
+
+uint32_t* headerFreelistTrunk(void* page) {
+    return (uint32_t*) ((uint8_t*) page + HEADER_FREELIST_TRUNK_OFFSET);
+}
+
+uint32_t* headerFreePages(void* page) {
+    return (uint32_t*) ((uint8_t*) page + HEADER_FREE_PAGES_OFFSET);
+}
+
+uint32_t* freelistNextTrunk(void* page) {
+    return (uint32_t*) ((uint8_t*) page + FREELIST_NEXT_TRUNK_OFFSET);
+}
+
+uint32_t* freelistNumPages(void* page) {
+    return (uint32_t*) ((uint8_t*) page + FREELIST_NUM_PAGES_OFFSET);
+}
+
+uint32_t* freelistPage(void* page, uint32_t index) {
+    return (uint32_t*) ((uint8_t*) page + FREELIST_PAGES_OFFSET) + index;
+}
+
+// Take a page off the freelist, or extend the file by one if the list is empty
+// A reused page comes back zeroed, like a new one would. Only the writer allocates pages
+uint32_t getUnusedPageNum(Pager* pager) {
+    uint32_t mark = pagerPinMark();
+    void* header = getPage(pager, HEADER_PAGE_NUM);
+    uint32_t trunkPageNum = *headerFreelistTrunk(header);
+    if (trunkPageNum == 0) {
+        pagerUnpinTo(mark);
+        return pager->num_pages;
+    }
+
+    uint32_t pageNum;
+    void* trunk = getPage(pager, trunkPageNum);
+    if (*freelistNumPages(trunk) > 0) {
+        pageNum = *freelistPage(trunk, --(*freelistNumPages(trunk)));
+        pagerMarkDirty(pager, trunkPageNum);
+    } else {
+        pageNum = trunkPageNum;
+        *headerFreelistTrunk(header) = *freelistNextTrunk(trunk);
+    }
+    (*headerFreePages(header))--;
+    pagerMarkDirty(pager, HEADER_PAGE_NUM);
+
+    void* page = getPage(pager, pageNum);
+    memset(page, 0, PAGE_SIZE);
+    pagerMarkDirty(pager, pageNum);
+    pagerUnpinTo(mark);
+    return pageNum;
+}
+
+// Put a page nothing refers to any more on the freelist. It joins the first trunk
+// if that has room, otherwise it becomes the new first trunk
+void freePage(Pager* pager, uint32_t pageNum) {
+    uint32_t mark = pagerPinMark();
+    void* header = getPage(pager, HEADER_PAGE_NUM);
+    uint32_t trunkPageNum = *headerFreelistTrunk(header);
+    void* trunk = trunkPageNum != 0 ? getPage(pager, trunkPageNum) : NULL;
+
+    if (trunk != NULL && *freelistNumPages(trunk) < FREELIST_MAX_PAGES) {
+        *freelistPage(trunk, (*freelistNumPages(trunk))++) = pageNum;
+        pagerMarkDirty(pager, trunkPageNum);
+    } else {
+        void* page = getPage(pager, pageNum);
+        memset(page, 0, PAGE_SIZE);
+        *freelistNextTrunk(page) = trunkPageNum;
+        pagerMarkDirty(pager, pageNum);
+        *headerFreelistTrunk(header) = pageNum;
+    }
+    (*headerFreePages(header))++;
+    pagerMarkDirty(pager, HEADER_PAGE_NUM);
+    pagerUnpinTo(mark);
+}
+
+uint32_t* leafNodeNumCells(void* node) {
+    return (uint32_t*) ((uint8_t*) node + LEAF_NODE_NUM_CELLS_OFFSET);
+}
+
+uint16_t* leafNodeContentStart(void* node) {
+    return (uint16_t*) ((uint8_t*) node + LEAF_NODE_CONTENT_START_OFFSET);
+}
+
+void* leafNodeSlot(void* node, uint32_t cellNum) {
+    return (uint8_t*) node + LEAF_NODE_METADATA_SIZE + cellNum * LEAF_NODE_SLOT_SIZE;
+}
+
+uint32_t* leafNodeKey(void* node, uint32_t cellNum) {
+    return leafNodeSlot(node, cellNum);
+}
+
+uint16_t* leafNodeValueOffset(void* node, uint32_t cellNum) {
+    return (uint16_t*) ((uint8_t*) leafNodeSlot(node, cellNum) + LEAF_NODE_VALUE_OFFSET_OFFSET);
+}
+
+uint16_t* leafNodeValueSize(void* node, uint32_t cellNum) {
+    return (uint16_t*) ((uint8_t*) leafNodeSlot(node, cellNum) + LEAF_NODE_VALUE_SIZE_OFFSET);
+}
+
+void* leafNodeValue(void* node, uint32_t cellNum) {
+    return (uint8_t*) node + *leafNodeValueOffset(node, cellNum);
+}
+
+// Bytes between the end of the slot array and the start of the cell content
+uint32_t leafNodeFreeSpace(void* node) {
+    return *leafNodeContentStart(node) - (LEAF_NODE_METADATA_SIZE + *leafNodeNumCells(node) * LEAF_NODE_SLOT_SIZE);
+}
+
+// Whether a cell with a value of this size fits without splitting the node
+bool leafNodeHasRoom(void* node, uint32_t valueSize) {
+    return leafNodeFreeSpace(node) >= LEAF_NODE_SLOT_SIZE + valueSize;
+}
+
+// Add a cell after every other one. The value is copied in already serialized
+void leafNodeAppendCell(void* node, uint32_t key, void* value, uint32_t valueSize) {
+    uint32_t cellNum = *leafNodeNumCells(node);
+    *leafNodeContentStart(node) -= valueSize;
+    memcpy((uint8_t*) node + *leafNodeContentStart(node), value, valueSize);
+    *leafNodeKey(node, cellNum) = key;
+    *leafNodeValueOffset(node, cellNum) = *leafNodeContentStart(node);
+    *leafNodeValueSize(node, cellNum) = valueSize;
+    *leafNodeNumCells(node) = cellNum + 1;
+}
+
+void initializeLeafNode(void* node) {
+    setNodeType(node, NODE_LEAF);
+    setNodeRoot(node, false);
+    *leafNodeNumCells(node) = 0;
+    *leafNodeNextLeaf(node) = 0; // The 0 means the leaf has no siblings
+    *leafNodeContentStart(node) = PAGE_SIZE;
+}
+// Function to insert key-value pairs into a leaf node
+// Takes a cursor as input to represent where the pair should be inserted
+// The value is copied in already serialized, so index entries go through here too
+void leafNodeInsertCell(Cursor* cursor, uint32_t key, void* value, uint32_t valueSize) {
+    void* node = getPage(cursor->table->pager, cursor->page_num);
+    uint32_t numCells = *leafNodeNumCells(node);
+
+    if (!leafNodeHasRoom(node, valueSize)) {
+        // Node is full
+        splitLeafNodeAndInsert(cursor, key, value, valueSize);
+        return;
+    }
+
+    pagerMarkDirty(cursor->table->pager, cursor->page_num);
+
+    if (cursor->cell_num < numCells) {
+        // Make room for a new slot. Values stay where they are
+        memmove(leafNodeSlot(node, cursor->cell_num + 1), leafNodeSlot(node, cursor->cell_num),
+                (numCells - cursor->cell_num) * LEAF_NODE_SLOT_SIZE);
+    }
+
+    *leafNodeContentStart(node) -= valueSize;
+    memcpy((uint8_t*) node + *leafNodeContentStart(node), value, valueSize);
+    *(leafNodeNumCells(node)) += 1;
+    *(leafNodeKey(node, cursor->cell_num)) = key;
+    *leafNodeValueOffset(node, cursor->cell_num) = *leafNodeContentStart(node);
+    *leafNodeValueSize(node, cursor->cell_num) = valueSize;
+}
+
+void insertLeafNode(Cursor* cursor, uint32_t key, Row* value) {
+    uint8_t serialized[LEAF_NODE_MAX_VALUE_SIZE];
+    leafNodeInsertCell(cursor, key, serialized, serializeRow(value, serialized));
+}
+
+
+// Validate the column values of a row and copy them in
+// Shared by "insert" statements and the .load bulk loader
+
+PrepareResult parseRow(char* idString, char* username, char* email, Row* row) {
+    if (idString == NULL || username == NULL || email == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    int id = atoi(idString);
+
+    // Check for valid ID tag
+    if (id < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+
+    if (strlen(username) > COLUMN_USERNAME_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    if (strlen(email) > COLUMN_EMAIL_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    row->id = id;
+    strcpy(row->username, username);
+    strcpy(row->email, email);
+
+    return PREPARE_SUCCESS;
+}
+
+// Record a "?" placeholder. Parameters are numbered in the order they're added
+void addParam(Statement* statement, ParamTarget target, uint32_t index) {
+    statement->params = realloc(statement->params, (statement->num_params + 1) * sizeof(Param));
+    statement->params[statement->num_params].target = target;
+    statement->params[statement->num_params].index = index;
+    statement->params[statement->num_params].bound = false;
+    statement->num_params++;
+}
+
+// Like parseRow, but any column written as "?" is left to be bound later
+PrepareResult parseStatementRow(Statement* statement, uint32_t rowIndex, char* idString, char* username, char* email, Row* row) {
+    if (idString != NULL && strcmp(idString, "?") == 0) {
+        addParam(statement, PARAM_ID, rowIndex);
+        idString = "0";
+    }
+    if (username != NULL && strcmp(username, "?") == 0) {
+        addParam(statement, PARAM_USERNAME, rowIndex);
+        username = "";
+    }
+    if (email != NULL && strcmp(email, "?") == 0) {
+        addParam(statement, PARAM_EMAIL, rowIndex);
+        email = "";
+    }
+    return parseRow(idString, username, email, row);
+}
+
+// Strip surrounding whitespace (and optional single quotes) from a value in place
+char* trimValue(char* value) {
+    while (*value == ' ') {
+        value++;
+    }
+
+    char* end = value + strlen(value);
+    while (end > value && end[-1] == ' ') {
+        end--;
+    }
+    *end = 0;
+
+    if (end - value >= 2 && value[0] == '\'' && end[-1] == '\'') {
+        end[-1] = 0;
+        value++;
+    }
+    return value;
+}
+
+// Parse "(id, username, email), (id, username, email), ..." into statement->rows
+PrepareResult prepareInsertValues(char* values, Statement* statement) {
+    uint32_t capacity = 16;
+    statement->rows = malloc(capacity * sizeof(Row));
+    statement->num_rows = 0;
+
+    char* position = values;
+    while (true) {
+        while (*position == ' ') {
+            position++;
+        }
+
+        char* close = strchr(position, ')');
+        if (*position != '(' || close == NULL) {
+            break;
+        }
+        *close = 0;
+
+        if (statement->num_rows == capacity) {
+            capacity *= 2;
+            statement->rows = realloc(statement->rows, capacity * sizeof(Row));
+        }
+
+        char* idString = strtok(position + 1, ",");
+        char* username = strtok(NULL, ",");
+        char* email = strtok(NULL, ",");
+        if (strtok(NULL, ",") != NULL) {
+            break;
+        }
+
+        PrepareResult result = parseStatementRow(statement, statement->num_rows,
+                                                 idString ? trimValue(idString) : NULL,
+                                                 username ? trimValue(username) : NULL,
+                                                 email ? trimValue(email) : NULL,
+                                                 &statement->rows[statement->num_rows]);
+        if (result != PREPARE_SUCCESS) {
+            closeStatement(statement);
+            return result;
+        }
+        statement->num_rows++;
+
+        position = close + 1;
+        while (*position == ' ') {
+            position++;
+        }
+        if (*position == 0) {
+            return PREPARE_SUCCESS;
+        }
+        if (*position != ',') {
+            break;
+        }
+        position++;
+    }
+
+    closeStatement(statement);
+    return PREPARE_SYNTAX_ERROR;
+}
+
+// Helper function to error-check "insert" statements
+PrepareResult prepareInsert(char* sql, Statement* statement) {
+    statement->type = STATEMENT_INSERT;
+
+    char* rest = sql + strlen("insert");
+    while (*rest == ' ') {
+        rest++;
+    }
+    if (strncmp(rest, "values", 6) == 0) {
+        return prepareInsertValues(rest + 6, statement);
+    }
+
+    // Split each string to check its length.
+    // Do this to ensure no buffer overflows are caused 
+    strtok(sql, " ");
+    char* idString = strtok(NULL, " ");
+    char* username = strtok(NULL, " ");
+    char* email = strtok(NULL, " ");
+
+    return parseStatementRow(statement, 0, idString, username, email, &(statement->row_to_insert));
+}
+
+void closeStatement(Statement* statement) {
+    free(statement->rows);
+    statement->rows = NULL;
+    statement->num_rows = 0;
+    free(statement->params);
+    statement->params = NULL;
+    statement->num_params = 0;
+}
+
+// Parse an id in a "where" clause. Ids are unsigned, like in "insert"
+PrepareResult parseKey(char* token, uint64_t* key) {
+    if (token == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (token[0] == '-') {
+        return PREPARE_NEGATIVE_ID;
+    }
+
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(token, &end, 10);
+    if (*token == 0 || *end != 0 || errno != 0 || value > UINT32_MAX) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    *key = value;
+    return PREPARE_SUCCESS;
+}
+
+// Add one "id <op> <key>" condition to a select's "where" clause
+PrepareResult addKeyCondition(Statement* statement, char* op, char* token) {
+    if (statement->num_conditions == SELECT_MAX_CONDITIONS || op == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    KeyCondition* condition = &statement->conditions[statement->num_conditions];
+
+    if (strcmp(op, "=") == 0) {
+        condition->op = KEY_EQUAL;
+    } else if (strcmp(op, ">=") == 0) {
+        condition->op = KEY_GREATER_EQUAL;
+    } else if (strcmp(op, ">") == 0) {
+        condition->op = KEY_GREATER;
+    } else if (strcmp(op, "<") == 0) {
+        condition->op = KEY_LESS;
+    } else if (strcmp(op, "<=") == 0) {
+        condition->op = KEY_LESS_EQUAL;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (token != NULL && strcmp(token, "?") == 0) {
+        addParam(statement, PARAM_KEY, statement->num_conditions);
+        condition->key = 0;
+    } else {
+        PrepareResult result = parseKey(token, &condition->key);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+    }
+
+    statement->num_conditions++;
+    return PREPARE_SUCCESS;
+}
+
+// Turn the "where" clause into the half-open range of keys a select returns
+// Done when the select starts, since parameters can change the bounds between runs
+void resolveKeyRange(Statement* statement) {
+    statement->range_low = 0;
+    statement->range_high = SELECT_KEY_LIMIT;
+
+    for (uint32_t i = 0; i < statement->num_conditions; i++) {
+        uint64_t key = statement->conditions[i].key;
+        uint64_t low = 0;
+        uint64_t high = SELECT_KEY_LIMIT;
+
+        switch (statement->conditions[i].op) {
+            case (KEY_EQUAL):
+                low = key;
+                high = key + 1;
+                break;
+            case (KEY_GREATER_EQUAL):
+                low = key;
+                break;
+            case (KEY_GREATER):
+                low = key + 1;
+                break;
+            case (KEY_LESS):
+                high = key;
+                break;
+            case (KEY_LESS_EQUAL):
+                high = key + 1;
+                break;
+        }
+
+        if (low > statement->range_low) {
+            statement->range_low = low;
+        }
+        if (high < statement->range_high) {
+            statement->range_high = high;
+        }
+    }
+}
+
+bool parseColumn(const char* name, TextColumn* column) {
+    if (strcmp(name, "username") == 0) {
+        *column = COLUMN_USERNAME;
+    } else if (strcmp(name, "email") == 0) {
+        *column = COLUMN_EMAIL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+char* rowColumn(Row* row, TextColumn column) {
+    return column == COLUMN_USERNAME ? row->username : row->email;
+}
+
+// Copy a username or email value into row, or add a "?" parameter that's bound into it later
+PrepareResult parseColumnValue(Statement* statement, Row* row, TextColumn column, char* token, ParamTarget target) {
+    if (strcmp(token, "?") == 0) {
+        addParam(statement, target, 0);
+        token = "";
+    } else {
+        token = trimValue(token);
+    }
+    size_t limit = column == COLUMN_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE;
+    if (strlen(token) > limit) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    strcpy(rowColumn(row, column), token);
+    return PREPARE_SUCCESS;
+}
+
+// Add a "username = <value>" or "email = <value>" condition. Each column can be matched once
+PrepareResult addColumnCondition(Statement* statement, TextColumn column, char* op, char* token) {
+    if (op == NULL || strcmp(op, "=") != 0 || token == NULL || statement->match_columns[column]) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    PrepareResult result = parseColumnValue(statement, &statement->match, column, token,
+                                            column == COLUMN_USERNAME ? PARAM_USERNAME : PARAM_EMAIL);
+    if (result != PREPARE_SUCCESS) {
+        return result;
+    }
+    statement->match_columns[column] = true;
+    return PREPARE_SUCCESS;
+}
+
+// Add one of the aggregates a select can return in place of rows
+PrepareResult addAggregate(Statement* statement, char* token) {
+    const char* names[] = { "count(*)", "sum(id)", "min(id)", "max(id)" };
+
+    if (statement->num_aggregates == SELECT_MAX_AGGREGATES) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    for (uint32_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(token, names[i]) == 0) {
+            statement->aggregates[statement->num_aggregates++] = (AggregateFunction) i;
+            return PREPARE_SUCCESS;
+        }
+    }
+    return PREPARE_SYNTAX_ERROR;
+}
+
+// Conditions of a "where" clause, joined by "and". The text is already tokenized up to
+// the "where", so this carries on with strtok from there
+PrepareResult prepareWhere(Statement* statement) {
+    while (true) {
+        char* column = strtok(NULL, " ");
+        char* op = strtok(NULL, " ");
+        TextColumn textColumn;
+        if (column == NULL || op == NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        PrepareResult result;
+        if (parseColumn(column, &textColumn)) {
+            result = addColumnCondition(statement, textColumn, op, strtok(NULL, " "));
+        } else if (strcmp(column, "id") != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        } else if (strcmp(op, "between") == 0) {
+            char* low = strtok(NULL, " ");
+            char* conjunction = strtok(NULL, " ");
+            if (conjunction == NULL || strcmp(conjunction, "and") != 0) {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            result = addKeyCondition(statement, ">=", low);
+            if (result == PREPARE_SUCCESS) {
+                result = addKeyCondition(statement, "<=", strtok(NULL, " "));
+            }
+        } else {
+            result = addKeyCondition(statement, op, strtok(NULL, " "));
+        }
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+
+        char* token = strtok(NULL, " ");
+        if (token == NULL) {
+            return PREPARE_SUCCESS;
+        }
+        if (strcmp(token, "and") != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+}
+
+// Helper function for "select", "select where id <op> K [and id <op> K]"
+// and "select where id between A and B" (inclusive on both ends)
+// Conditions can also match "username = <value>" and "email = <value>"
+PrepareResult prepareSelect(char* sql, Statement* statement) {
+    statement->type = STATEMENT_SELECT;
+
+    strtok(sql, " ");
+    char* token = strtok(NULL, " ");
+
+    // Optional list of aggregates, separated by commas
+    bool expectAggregate = true;
+    while (token != NULL && strcmp(token, "where") != 0) {
+        // Commas can sit on either side of a space, or have none around them
+        char* piece = token;
+        while (true) {
+            char* comma = strchr(piece, ',');
+            if (comma != NULL) {
+                *comma = '\0';
+            }
+
+            if (piece[0] != '\0') {
+                if (!expectAggregate) {
+                    return PREPARE_SYNTAX_ERROR;
+                }
+                PrepareResult result = addAggregate(statement, piece);
+                if (result != PREPARE_SUCCESS) {
+                    return result;
+                }
+                expectAggregate = false;
+            }
+
+            if (comma == NULL) {
+                break;
+            }
+            if (expectAggregate) {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            expectAggregate = true;
+            piece = comma + 1;
+        }
+        token = strtok(NULL, " ");
+    }
+    if (statement->num_aggregates > 0 && expectAggregate) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (token == NULL) {
+        return PREPARE_SUCCESS;
+    }
+    if (strcmp(token, "where") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return prepareWhere(statement);
+}
+
+// "delete" removes every row, "delete where ..." takes the same conditions a select does
+PrepareResult prepareDelete(char* sql, Statement* statement) {
+    statement->type = STATEMENT_DELETE;
+
+    strtok(sql, " ");
+    char* token = strtok(NULL, " ");
+    if (token == NULL) {
+        return PREPARE_SUCCESS;
+    }
+    if (strcmp(token, "where") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return prepareWhere(statement);
+}
+
+// "update set email = <value> [, username = <value>] [where ...]". The where clause is
+// the same as a select's. Ids can't be changed, since they're the key rows are stored by
+PrepareResult prepareUpdate(char* sql, Statement* statement) {
+    statement->type = STATEMENT_UPDATE;
+
+    strtok(sql, " ");
+    char* token = strtok(NULL, " ");
+    if (token == NULL || strcmp(token, "set") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    while (true) {
+        char* name = strtok(NULL, " ");
+        char* op = strtok(NULL, " ");
+        char* value = strtok(NULL, " ");
+        TextColumn column;
+        if (name == NULL || op == NULL || value == NULL || strcmp(op, "=") != 0
+            || !parseColumn(name, &column) || statement->update_columns[column]) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        // The comma between assignments can end the value or stand on its own
+        size_t length = strlen(value);
+        bool more = length > 1 && value[length - 1] == ',';
+        if (more) {
+            value[length - 1] = '\0';
+        }
+
+        PrepareResult result = parseColumnValue(statement, &statement->row_to_insert, column, value,
+                                                column == COLUMN_USERNAME ? PARAM_SET_USERNAME : PARAM_SET_EMAIL);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+        statement->update_columns[column] = true;
+        if (more) {
+            continue;
+        }
+
+        token = strtok(NULL, " ");
+        if (token == NULL) {
+            return PREPARE_SUCCESS;
+        }
+        if (strcmp(token, "where") == 0) {
+            return prepareWhere(statement);
+        }
+        if (strcmp(token, ",") != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+}
+
+// "create index on users(email)". The only table is "users"
+PrepareResult prepareCreateIndex(char* sql, Statement* statement) {
+    statement->type = STATEMENT_CREATE_INDEX;
+
+    char name[16];
+    int length = 0;
+    if (sscanf(sql, "create index on users ( %15[a-z] ) %n", name, &length) != 1 || length == 0
+        || sql[length] != 0 || !parseColumn(name, &statement->index_column)) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+// Our very own minimalistic "SQL Compiler"
+// The text is tokenized in place
+PrepareResult prepareStatement(char* sql, Statement* statement) {
+    statement->rows = NULL;
+    statement->num_rows = 0;
+    statement->num_conditions = 0;
+    statement->num_aggregates = 0;
+    memset(statement->match_columns, 0, sizeof(statement->match_columns));
+    memset(statement->update_columns, 0, sizeof(statement->update_columns));
+    statement->params = NULL;
+    statement->num_params = 0;
+
+    if (strncmp(sql, "insert", 6) == 0) {
+        return prepareInsert(sql, statement);
+    }
+
+    if (strcmp(sql, "select") == 0 || strncmp(sql, "select ", 7) == 0) {
+        return prepareSelect(sql, statement);
+    }
+
+    if (strcmp(sql, "delete") == 0 || strncmp(sql, "delete ", 7) == 0) {
+        return prepareDelete(sql, statement);
+    }
+
+    if (strncmp(sql, "update ", 7) == 0) {
+        return prepareUpdate(sql, statement);
+    }
+
+    if (strncmp(sql, "create index ", 13) == 0) {
+        return prepareCreateIndex(sql, statement);
+    }
+
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+// Bytes a row's value takes up in a leaf
+uint32_t rowValueSize(Row* row) {
+    return LEAF_NODE_VALUE_HEADER_SIZE + strlen(row->username) + strlen(row->email);
+}
+
+// Write a row's value in the leaf cell format and return its size. The id isn't
+// part of the value, it's stored as the cell's key
+uint32_t serializeRow(Row* source, void* destination) {
+    uint8_t* bytes = destination;
+    uint8_t usernameLength = strlen(source->username);
+    uint8_t emailLength = strlen(source->email);
+
+    bytes[0] = usernameLength;
+    bytes[1] = emailLength;
+    memcpy(bytes + LEAF_NODE_VALUE_HEADER_SIZE, source->username, usernameLength);
+    memcpy(bytes + LEAF_NODE_VALUE_HEADER_SIZE + usernameLength, source->email, emailLength);
+    return LEAF_NODE_VALUE_HEADER_SIZE + usernameLength + emailLength;
+}
+
+// Fill in the username and email of a row from its value. The caller sets the id
+void deserializeRow(void* source, Row* destination){
+    uint8_t* bytes = source;
+    uint8_t usernameLength = bytes[0];
+    uint8_t emailLength = bytes[1];
+
+    memcpy(destination->username, bytes + LEAF_NODE_VALUE_HEADER_SIZE, usernameLength);
+    destination->username[usernameLength] = '\0';
+    memcpy(destination->email, bytes + LEAF_NODE_VALUE_HEADER_SIZE + usernameLength, emailLength);
+    destination->email[emailLength] = '\0';
+}
+
+/*
+
+Page compression
+
+A compressed database file starts with a one-sector header, and everything after
+it is divided into sectors of PAGER_COMPRESSED_SECTOR bytes. Each page is compressed
+when it's written back and stored in as many whole sectors as it needs. A page that
+doesn't save at least one sector is stored as is. The page map (sector and length of
+every page) lives in memory and is written to the file as one more extent.
+
+Extents are never overwritten in place. A rewritten page goes to a new extent, and
+the old one only becomes free once a new copy of the map has been written and the
+header points at it. So the file on disk always matches the last map written, even
+if a crash cuts off writes that came after it. Free space isn't stored anywhere:
+it's whatever the map doesn't use, worked out again when the file is opened.
+
+Pages are compressed with a small LZ77 compressor that writes the LZ4 block format:
+a run of literals followed by a match (offset and length) into what came before.
+
+*/
+#define COMPRESSED_MAGIC 0x315a504c // "LPZ1"
+#define COMPRESSED_HEADER_SIZE 20
+#define COMPRESSED_SYNC_SECTORS 1024 // Extents waiting on a map write before one is forced (256 KiB)
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 5 // The format ends every block with at least this many literals
+#define LZ_MATCH_LIMIT 12  // and never starts a match this close to the end
+
+uint32_t lzHash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Lengths that don't fit their four bits in the token carry on in bytes of up to 255
+uint8_t* lzWriteLength(uint8_t* output, uint32_t length) {
+    while (length >= 255) {
+        *output++ = 255;
+        length -= 255;
+    }
+    *output++ = (uint8_t) length;
+    return output;
+}
+
+bool lzReadLength(const uint8_t** input, const uint8_t* end, uint32_t* length) {
+    uint8_t byte;
+    do {
+        if (*input >= end) {
+            return false;
+        }
+        byte = *(*input)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Write one sequence: the literals from anchor up to the match, then the match itself.
+// Returns NULL if it wouldn't fit before end
+uint8_t* lzWriteSequence(uint8_t* output, uint8_t* end, const uint8_t* literals, uint32_t numLiterals,
+                         uint32_t offset, uint32_t matchLength) {
+    if (output + 1 + numLiterals / 255 + 1 + numLiterals + 2 + matchLength / 255 + 1 > end) {
+        return NULL;
+    }
+
+    uint8_t* token = output++;
+    *token = (numLiterals < 15 ? numLiterals : 15) << 4;
+    if (numLiterals >= 15) {
+        output = lzWriteLength(output, numLiterals - 15);
+    }
+    memcpy(output, literals, numLiterals);
+    output += numLiterals;
+
+    if (offset == 0) {
+        // The last sequence is literals only
+        return output;
+    }
+
+    *output++ = offset & 0xff;
+    *output++ = offset >> 8;
+    matchLength -= LZ_MIN_MATCH;
+    *token |= matchLength < 15 ? matchLength : 15;
+    if (matchLength >= 15) {
+        output = lzWriteLength(output, matchLength - 15);
+    }
+    return output;
+}
+
+// Compress length bytes of input. Returns the compressed size, or 0 if it comes to more than capacity
+uint32_t lzCompress(const uint8_t* input, uint32_t length, uint8_t* output, uint32_t capacity) {
+    uint16_t table[1 << LZ_HASH_BITS]; // Last position each hash of four bytes was seen at
+    memset(table, 0, sizeof(table));
+    uint8_t* out = output;
+    uint8_t* end = output + capacity;
+    uint32_t anchor = 0;
+    uint32_t position = 1;
+
+    while (length > LZ_MATCH_LIMIT && position < length - LZ_MATCH_LIMIT) {
+        uint32_t sequence;
+        memcpy(&sequence, input + position, sizeof(sequence));
+        uint32_t hash = lzHash(sequence);
+        uint32_t candidate = table[hash];
+        table[hash] = position;
+
+        uint32_t candidateSequence;
+        memcpy(&candidateSequence, input + candidate, sizeof(candidateSequence));
+        if (candidateSequence != sequence) {
+            position++;
+            continue;
+        }
+
+        uint32_t matchEnd = position + LZ_MIN_MATCH;
+        while (matchEnd < length - LZ_LAST_LITERALS && input[matchEnd] == input[candidate + matchEnd - position]) {
+            matchEnd++;
+        }
+        // The match may also reach back into the literals before it
+        while (position > anchor && candidate > 0 && input[position - 1] == input[candidate - 1]) {
+            position--;
+            candidate--;
+        }
+
+        out = lzWriteSequence(out, end, input + anchor, position - anchor, position - candidate, matchEnd - position);
+        if (out == NULL) {
+            return 0;
+        }
+        position = matchEnd;
+        anchor = matchEnd;
+    }
+
+    out = lzWriteSequence(out, end, input + anchor, length - anchor, 0, 0);
+    return out == NULL ? 0 : out - output;
+}
+
+// Decompress into exactly outputLength bytes. Returns false if the input is corrupt
+bool lzDecompress(const uint8_t* input, uint32_t length, uint8_t* output, uint32_t outputLength) {
+    const uint8_t* end = input + length;
+    uint32_t written = 0;
+
+    while (input < end) {
+        uint8_t token = *input++;
+        uint32_t numLiterals = token >> 4;
+        if (numLiterals == 15 && !lzReadLength(&input, end, &numLiterals)) {
+            return false;
+        }
+        if (numLiterals > (uint32_t) (end - input) || numLiterals > outputLength - written) {
+            return false;
+        }
+        memcpy(output + written, input, numLiterals);
+        input += numLiterals;
+        written += numLiterals;
+
+        if (input == end) {
+            break;
+        }
+        if (end - input < 2) {
+            return false;
+        }
+        uint32_t offset = input[0] | (input[1] << 8);
+        input += 2;
+        uint32_t matchLength = token & 15;
+        if (matchLength == 15 && !lzReadLength(&input, end, &matchLength)) {
+            return false;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > written || matchLength > outputLength - written) {
+            return false;
+        }
+
+        // A match can overlap the bytes it's producing, so copy one at a time
+        for (uint32_t i = 0; i < matchLength; i++) {
+            output[written + i] = output[written - offset + i];
+        }
+        written += matchLength;
+    }
+
+    return written == outputLength;
+}
+
+uint32_t compressedSectors(uint32_t length) {
+    return (length + PAGER_COMPRESSED_SECTOR - 1) / PAGER_COMPRESSED_SECTOR;
+}
+
+void sectorListPush(SectorList* list, uint32_t sector) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 64;
+        list->sectors = realloc(list->sectors, list->capacity * sizeof(uint32_t));
+    }
+    list->sectors[list->count++] = sector;
+}
+
+// Hand back an extent of any size, split into pieces no bigger than a page
+void compressedRelease(SectorList* lists, uint32_t sector, uint32_t sectors) {
+    while (sectors > 0) {
+        uint32_t piece = sectors < PAGER_COMPRESSED_MAX_SECTORS ? sectors : PAGER_COMPRESSED_MAX_SECTORS;
+        sectorListPush(&lists[piece], sector);
+        sector += piece;
+        sectors -= piece;
+    }
+}
+
+// Take the smallest free extent that fits, giving back what's left of it,
+// or grow the file. Extents bigger than a page (the map) always go on the end
+uint32_t compressedAllocate(CompressedFile* file, uint32_t sectors) {
+    for (uint32_t size = sectors; size <= PAGER_COMPRESSED_MAX_SECTORS; size++) {
+        if (file->free[size].count > 0) {
+            uint32_t sector = file->free[size].sectors[--file->free[size].count];
+            if (size > sectors) {
+                sectorListPush(&file->free[size - sectors], sector + sectors);
+            }
+            return sector;
+        }
+    }
+
+    uint32_t sector = file->file_sectors;
+    file->file_sectors += sectors;
+    return sector;
+}
+
+void compressedWriteAt(CompressedFile* file, const void* data, uint32_t length, uint32_t sector) {
+    off_t offset = (off_t) sector * PAGER_COMPRESSED_SECTOR;
+    if (pwrite(file->file_descriptor, data, length, offset) != (ssize_t) length) {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void compressedSyncFile(CompressedFile* file) {
+    if (fdatasync(file->file_descriptor) == -1) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void compressedWriteHeader(CompressedFile* file) {
+    uint32_t header[5] = { COMPRESSED_MAGIC, PAGE_SIZE, file->num_pages, file->map_extent.sector, file->map_extent.length };
+    compressedWriteAt(file, header, COMPRESSED_HEADER_SIZE, 0);
+}
+
+// Is this a compressed database file? Plain files start with a node type, which never matches
+bool compressedDetect(int fileDescriptor) {
+    uint32_t magic;
+    return pread(fileDescriptor, &magic, sizeof(magic), 0) == sizeof(magic) && magic == COMPRESSED_MAGIC;
+}
+
+int compareExtents(const void* a, const void* b) {
+    uint32_t left = ((PageExtent*) a)->sector;
+    uint32_t right = ((PageExtent*) b)->sector;
+    return (left > right) - (left < right);
+}
+
+// Work out the free space from scratch: everything that isn't the header, the map or a
+// page. Neighbouring free extents merge back together this way, and free space at the
+// end is cut off the file
+void compressedFindFreeSpace(CompressedFile* file) {
+    PageExtent* used = malloc((file->num_pages + 2) * sizeof(PageExtent));
+    uint32_t numUsed = 0;
+    used[numUsed++] = (PageExtent) { 0, PAGER_COMPRESSED_SECTOR };
+    if (file->map_extent.length > 0) {
+        used[numUsed++] = file->map_extent;
+    }
+    for (uint32_t i = 0; i < file->num_pages; i++) {
+        if (file->map[i].length > 0) {
+            used[numUsed++] = file->map[i];
+        }
+    }
+    qsort(used, numUsed, sizeof(PageExtent), compareExtents);
+
+    for (uint32_t size = 0; size <= PAGER_COMPRESSED_MAX_SECTORS; size++) {
+        file->free[size].count = 0;
+    }
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < numUsed; i++) {
+        if (used[i].sector > next) {
+            compressedRelease(file->free, next, used[i].sector - next);
+        }
+        next = used[i].sector + compressedSectors(used[i].length);
+    }
+    free(used);
+
+    file->file_sectors = next;
+    file->pending_sectors = 0;
+    if (ftruncate(file->file_descriptor, (off_t) next * PAGER_COMPRESSED_SECTOR) == -1) {
+        printf("Error truncating db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Open a compressed file, or set up a new one if it's empty
+CompressedFile* compressedOpen(int fileDescriptor, off_t fileLength) {
+    CompressedFile* file = calloc(1, sizeof(CompressedFile));
+    file->file_descriptor = fileDescriptor;
+    pthread_mutex_init(&file->mutex, NULL);
+
+    if (fileLength == 0) {
+        file->file_sectors = 1; // The header
+        compressedWriteHeader(file);
+        return file;
+    }
+
+    uint32_t header[5];
+    if (pread(fileDescriptor, header, COMPRESSED_HEADER_SIZE, 0) != COMPRESSED_HEADER_SIZE
+        || header[0] != COMPRESSED_MAGIC || header[1] != PAGE_SIZE) {
+        printf("Compressed db file has a bad header. Corrupt file detected\n");
+        exit(EXIT_FAILURE);
+    }
+
+    file->num_pages = header[2];
+    file->map_capacity = file->num_pages;
+    file->map_extent.sector = header[3];
+    file->map_extent.length = header[4];
+    file->map = malloc(file->map_capacity * sizeof(PageExtent));
+    off_t mapOffset = (off_t) file->map_extent.sector * PAGER_COMPRESSED_SECTOR;
+    ssize_t mapLength = (ssize_t) file->num_pages * sizeof(PageExtent);
+    if (file->map_extent.length != mapLength
+        || pread(fileDescriptor, file->map, mapLength, mapOffset) != mapLength) {
+        printf("Compressed db file has a bad page map. Corrupt file detected\n");
+        exit(EXIT_FAILURE);
+    }
+
+    compressedFindFreeSpace(file);
+    return file;
+}
+
+// Read a page, or zero-fill it if it has never been written
+void compressedReadPage(CompressedFile* file, uint32_t pageNum, void* page) {
+    uint8_t buffer[PAGE_SIZE];
+
+    pthread_mutex_lock(&file->mutex);
+    PageExtent extent = pageNum < file->num_pages ? file->map[pageNum] : (PageExtent) { 0, 0 };
+    if (extent.length > 0) {
+        void* destination = extent.length == PAGE_SIZE ? page : buffer;
+        off_t offset = (off_t) extent.sector * PAGER_COMPRESSED_SECTOR;
+        if (pread(file->file_descriptor, destination, extent.length, offset) != (ssize_t) extent.length) {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_unlock(&file->mutex);
+
+    if (extent.length == 0) {
+        memset(page, 0, PAGE_SIZE);
+    } else if (extent.length < PAGE_SIZE && !lzDecompress(buffer, extent.length, page, PAGE_SIZE)) {
+        printf("Page %d doesn't decompress. Corrupt file detected\n", pageNum);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Write the map out and point the header at it, making every page written so far durable
+// The map goes at the given sector, which has to be free. The caller holds the mutex
+void compressedWriteMapAt(CompressedFile* file, uint32_t sector) {
+    uint32_t mapLength = file->num_pages * sizeof(PageExtent);
+    file->map_extent.sector = sector;
+    file->map_extent.length = mapLength;
+    if (sector + compressedSectors(mapLength) > file->file_sectors) {
+        file->file_sectors = sector + compressedSectors(mapLength);
+    }
+    compressedWriteAt(file, file->map, mapLength, file->map_extent.sector);
+
+    // Pages and map have to be on disk before the header can point at them
+    compressedSyncFile(file);
+    compressedWriteHeader(file);
+    compressedSyncFile(file);
+
+    // The old map and the extents given up since it was written are free now
+    compressedFindFreeSpace(file);
+    file->map_dirty = false;
+    file->map_writes++;
+}
+
+void compressedWriteMap(CompressedFile* file) {
+    compressedWriteMapAt(file, file->file_sectors);
+}
+
+// Compress a page and write it to a new extent. The old one is freed once the map is written
+void compressedWritePage(CompressedFile* file, uint32_t pageNum, void* page) {
+    uint8_t buffer[PAGE_SIZE];
+    uint32_t length = lzCompress(page, PAGE_SIZE, buffer, PAGE_SIZE - PAGER_COMPRESSED_SECTOR);
+    void* data = buffer;
+    if (length == 0) {
+        length = PAGE_SIZE;
+        data = page;
+    }
+
+    pthread_mutex_lock(&file->mutex);
+    if (pageNum >= file->num_pages) {
+        if (pageNum >= file->map_capacity) {
+            file->map_capacity = file->map_capacity ? 2 * file->map_capacity : 64;
+            if (file->map_capacity <= pageNum) {
+                file->map_capacity = pageNum + 1;
+            }
+            file->map = realloc(file->map, file->map_capacity * sizeof(PageExtent));
+        }
+        memset(&file->map[file->num_pages], 0, (pageNum + 1 - file->num_pages) * sizeof(PageExtent));
+        file->num_pages = pageNum + 1;
+    }
+
+    PageExtent* extent = &file->map[pageNum];
+    if (extent->length > 0) {
+        // Not free yet, the copy of the map on disk may still point at it
+        file->pending_sectors += compressedSectors(extent->length);
+    }
+    extent->sector = compressedAllocate(file, compressedSectors(length));
+    extent->length = length;
+    compressedWriteAt(file, data, length, extent->sector);
+
+    file->map_dirty = true;
+    file->pages_written++;
+    file->pages_stored_raw += length == PAGE_SIZE;
+
+    // Pages written back between flushes would otherwise leave the file growing by
+    // a page each time, since nothing they give up can be reused until the map is written
+    if (file->pending_sectors >= COMPRESSED_SYNC_SECTORS + file->file_sectors / 16) {
+        compressedWriteMap(file);
+    }
+    pthread_mutex_unlock(&file->mutex);
+}
+
+void compressedSync(CompressedFile* file) {
+    pthread_mutex_lock(&file->mutex);
+    if (file->map_dirty) {
+        compressedWriteMap(file);
+    }
+    pthread_mutex_unlock(&file->mutex);
+}
+
+// Forget every page from numPages on. Their extents are freed once the map is written
+// Returns true if there were any
+bool compressedTruncate(CompressedFile* file, uint32_t numPages) {
+    pthread_mutex_lock(&file->mutex);
+    bool truncated = numPages < file->num_pages;
+    for (uint32_t i = numPages; i < file->num_pages; i++) {
+        file->pending_sectors += compressedSectors(file->map[i].length);
+    }
+    if (truncated) {
+        file->num_pages = numPages;
+        file->map_dirty = true;
+    }
+    pthread_mutex_unlock(&file->mutex);
+    return truncated;
+}
+
+typedef struct {
+    uint32_t sector;
+    uint32_t page_num;
+} PageSector;
+
+int comparePageSectorsDescending(const void* a, const void* b) {
+    uint32_t left = ((PageSector*) a)->sector;
+    uint32_t right = ((PageSector*) b)->sector;
+    return (left < right) - (left > right);
+}
+
+// Move pages from the end of the file into free space nearer the front, then put the
+// map right behind them so the file can be cut short. Pages are copied rather than
+// overwritten, so the map on disk stays good until the header points at the next one
+void compressedCompact(CompressedFile* file) {
+    uint8_t buffer[PAGE_SIZE];
+
+    pthread_mutex_lock(&file->mutex);
+    // Whatever was given up since the last map write only becomes free after one
+    compressedWriteMap(file);
+
+    PageSector* pages = malloc((file->num_pages + 1) * sizeof(PageSector));
+    uint32_t numPages = 0;
+    for (uint32_t i = 0; i < file->num_pages; i++) {
+        if (file->map[i].length > 0) {
+            pages[numPages++] = (PageSector) { file->map[i].sector, i };
+        }
+    }
+    qsort(pages, numPages, sizeof(PageSector), comparePageSectorsDescending);
+
+    // Free lists come out of compressedFindFreeSpace in ascending order, so the lowest
+    // unused extent of each size is the first one past its cursor
+    uint32_t next[PAGER_COMPRESSED_MAX_SECTORS + 1] = { 0 };
+    for (uint32_t i = 0; i < numPages; i++) {
+        PageExtent* extent = &file->map[pages[i].page_num];
+        uint32_t sectors = compressedSectors(extent->length);
+        uint32_t best = 0;
+        for (uint32_t size = sectors; size <= PAGER_COMPRESSED_MAX_SECTORS; size++) {
+            SectorList* list = &file->free[size];
+            if (next[size] < list->count && list->sectors[next[size]] < extent->sector
+                && (best == 0 || list->sectors[next[size]] < file->free[best].sectors[next[best]])) {
+                best = size;
+            }
+        }
+        if (best == 0) {
+            continue;
+        }
+
+        uint32_t sector = file->free[best].sectors[next[best]++];
+        off_t offset = (off_t) extent->sector * PAGER_COMPRESSED_SECTOR;
+        if (pread(file->file_descriptor, buffer, extent->length, offset) != (ssize_t) extent->length) {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        compressedWriteAt(file, buffer, extent->length, sector);
+        file->pending_sectors += sectors;
+        extent->sector = sector;
+        file->map_dirty = true;
+    }
+
+    uint32_t tail = 1; // The header
+    for (uint32_t i = 0; i < file->num_pages; i++) {
+        if (file->map[i].length > 0 && file->map[i].sector + compressedSectors(file->map[i].length) > tail) {
+            tail = file->map[i].sector + compressedSectors(file->map[i].length);
+        }
+    }
+    free(pages);
+
+    // This write frees where the pages were, but lands on the end itself. Once
+    // nothing is pending, the map can move down behind the last page
+    compressedWriteMap(file);
+    if (tail + compressedSectors(file->map_extent.length) <= file->map_extent.sector) {
+        compressedWriteMapAt(file, tail);
+    }
+    pthread_mutex_unlock(&file->mutex);
+}
+
+// Hint that a page will be read soon
+void compressedPrefetch(CompressedFile* file, uint32_t pageNum) {
+    pthread_mutex_lock(&file->mutex);
+    PageExtent extent = pageNum < file->num_pages ? file->map[pageNum] : (PageExtent) { 0, 0 };
+    pthread_mutex_unlock(&file->mutex);
+
+    if (extent.length > 0) {
+        posix_fadvise(file->file_descriptor, (off_t) extent.sector * PAGER_COMPRESSED_SECTOR, extent.length,
+                      POSIX_FADV_WILLNEED);
+    }
+}
+
+void compressedClose(CompressedFile* file) {
+    compressedSync(file);
+    for (uint32_t size = 0; size <= PAGER_COMPRESSED_MAX_SECTORS; size++) {
+        free(file->free[size].sectors);
+    }
+    pthread_mutex_destroy(&file->mutex);
+    free(file->map);
+    free(file);
+}
+
+/*
+
+Write-ahead log
+
+The log starts with a small header followed by frames. Each frame is a copy of one
+page with a header of its own: the page number, the database size in pages if the
+frame ends a commit (0 otherwise), the log's salt and a checksum. After a crash only
+frames up to the last valid commit frame are replayed.
+
+Commits share fdatasync calls: the first committer to arrive syncs everything written
+so far, and anyone who committed in the meantime just waits for it (group commit).
+
+*/
+#define WAL_MAGIC 0x57414c31 // "WAL1"
+#define WAL_HEADER_SIZE 16
+#define WAL_FRAME_HEADER_SIZE 16
+#define WAL_FRAME_SIZE (WAL_FRAME_HEADER_SIZE + PAGE_SIZE)
+#define WAL_MAX_IOV_FRAMES 512 // Two iovecs per frame, stays below IOV_MAX
+
+off_t walFrameOffset(uint32_t frame) {
+    return WAL_HEADER_SIZE + (off_t) (frame - 1) * WAL_FRAME_SIZE;
+}
+
+// Fletcher-style checksum over the first three header words and the page
+uint32_t walChecksum(uint32_t* header, void* page) {
+    uint32_t s1 = 1;
+    uint32_t s2 = 0;
+
+    for (uint32_t i = 0; i < 3; i++) {
+        s1 += header[i];
+        s2 += s1;
+    }
+
+    uint32_t* words = page;
+    for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        s1 += words[i];
+        s2 += s1;
+    }
+
+    return s1 ^ (s2 << 16) ^ (s2 >> 16);
+}
+
+uint32_t walIndexSlot(Wal* wal, uint32_t pageNum) {
+    return (uint32_t) (pageNum * 2654435761u) >> (32 - wal->index_bits);
+}
+
+uint32_t walFindFrame(Wal* wal, uint32_t pageNum) {
+    uint32_t mask = (1u << wal->index_bits) - 1;
+    uint32_t slot = walIndexSlot(wal, pageNum);
+
+    while (wal->index_frames[slot] != 0) {
+        if (wal->index_pages[slot] == pageNum) {
+            return wal->index_frames[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return 0;
+}
+
+void walIndexPut(Wal* wal, uint32_t pageNum, uint32_t frame);
+
+void walIndexGrow(Wal* wal) {
+    uint32_t oldSize = 1u << wal->index_bits;
+    uint32_t* oldPages = wal->index_pages;
+    uint32_t* oldFrames = wal->index_frames;
+
+    wal->index_bits++;
+    wal->index_count = 0;
+    wal->index_pages = calloc(1u << wal->index_bits, sizeof(uint32_t));
+    wal->index_frames = calloc(1u << wal->index_bits, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < oldSize; i++) {
+        if (oldFrames[i] != 0) {
+            walIndexPut(wal, oldPages[i], oldFrames[i]);
+        }
+    }
+
+    free(oldPages);
+    free(oldFrames);
+}
+
+void walIndexPut(Wal* wal, uint32_t pageNum, uint32_t frame) {
+    // Keep the table at most half full
+    if (2 * (wal->index_count + 1) > (1u << wal->index_bits)) {
+        walIndexGrow(wal);
+    }
+
+    uint32_t mask = (1u << wal->index_bits) - 1;
+    uint32_t slot = walIndexSlot(wal, pageNum);
+
+    while (wal->index_frames[slot] != 0 && wal->index_pages[slot] != pageNum) {
+        slot = (slot + 1) & mask;
+    }
+
+    if (wal->index_frames[slot] == 0) {
+        wal->index_count++;
+    }
+    wal->index_pages[slot] = pageNum;
+    wal->index_frames[slot] = frame;
+}
+
+void walReadPage(Wal* wal, uint32_t frame, void* page) {
+    ssize_t bytesRead = pread(wal->file_descriptor, page, PAGE_SIZE, walFrameOffset(frame) + WAL_FRAME_HEADER_SIZE);
+    if (bytesRead != PAGE_SIZE) {
+        printf("Error reading log: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void walWriteHeader(Wal* wal) {
+    uint32_t header[4] = { WAL_MAGIC, PAGE_SIZE, wal->salt, 0 };
+    if (pwrite(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE) {
+        printf("Error writing log header: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Once the checkpointer has copied every frame back, new frames can start over at the
+// front of the log. Returns true if the log was restarted.
+bool walRestart(Wal* wal) {
+    pthread_mutex_lock(&wal->mutex);
+    bool restart = wal->max_frame > 0 && wal->backfilled == wal->max_frame && !wal->checkpoint_running;
+    if (restart) {
+        wal->max_frame = 0;
+        wal->committed_frame = 0;
+        wal->synced_frame = 0;
+        wal->backfilled = 0;
+    }
+    pthread_mutex_unlock(&wal->mutex);
+
+    if (!restart) {
+        return false;
+    }
+
+    wal->salt++;
+    walWriteHeader(wal);
+    memset(wal->index_frames, 0, (1u << wal->index_bits) * sizeof(uint32_t));
+    wal->index_count = 0;
+    return true;
+}
+
+// Append pages to the log. A non-zero commitPages marks the last frame as a commit
+// holding the database size. Returns the number of the last frame written.
+uint32_t walAppend(Wal* wal, Frame** frames, uint32_t count, uint32_t commitPages) {
+    uint32_t firstFrame = wal->max_frame + 1;
+    uint32_t headers[WAL_MAX_IOV_FRAMES][4];
+    struct iovec iov[2 * WAL_MAX_IOV_FRAMES];
+
+    for (uint32_t start = 0; start < count; start += WAL_MAX_IOV_FRAMES) {
+        uint32_t batch = count - start < WAL_MAX_IOV_FRAMES ? count - start : WAL_MAX_IOV_FRAMES;
+
+        for (uint32_t i = 0; i < batch; i++) {
+            Frame* frame = frames[start + i];
+            uint32_t* header = headers[i];
+            header[0] = frame->page_num;
+            header[1] = (start + i == count - 1) ? commitPages : 0;
+            header[2] = wal->salt;
+            header[3] = walChecksum(header, frame->data);
+
+            iov[2 * i].iov_base = header;
+            iov[2 * i].iov_len = WAL_FRAME_HEADER_SIZE;
+            iov[2 * i + 1].iov_base = frame->data;
+            iov[2 * i + 1].iov_len = PAGE_SIZE;
+        }
+
+        ssize_t expected = (ssize_t) batch * WAL_FRAME_SIZE;
+        if (pwritev(wal->file_descriptor, iov, 2 * batch, walFrameOffset(firstFrame + start)) != expected) {
+            printf("Error writing log: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_mutex_lock(&wal->mutex);
+    uint32_t needed = wal->max_frame + count;
+    if (needed > wal->frame_pages_capacity) {
+        while (needed > wal->frame_pages_capacity) {
+            wal->frame_pages_capacity *= 2;
+        }
+        wal->frame_pages = realloc(wal->frame_pages, wal->frame_pages_capacity * sizeof(uint32_t));
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        wal->frame_pages[wal->max_frame + i] = frames[i]->page_num;
+    }
+    wal->max_frame += count;
+    if (commitPages != 0) {
+        wal->committed_frame = wal->max_frame;
+        wal->committed_pages = commitPages;
+        wal->stats.commits++;
+    }
+    wal->stats.frames_written += count;
+    pthread_mutex_unlock(&wal->mutex);
+
+    for (uint32_t i = 0; i < count; i++) {
+        walIndexPut(wal, frames[i]->page_num, firstFrame + i);
+    }
+
+    return firstFrame + count - 1;
+}
+
+// Wait until everything up to the given frame is on disk (group commit)
+void walSync(Wal* wal, uint32_t frame) {
+    pthread_mutex_lock(&wal->mutex);
+
+    while (wal->synced_frame < frame) {
+        if (wal->syncing) {
+            // Someone else is already syncing. Their fdatasync may or may not cover us
+            pthread_cond_wait(&wal->cond, &wal->mutex);
+            continue;
+        }
+
+        // Become the leader and sync every commit written so far in one go
+        wal->syncing = true;
+        uint32_t upTo = wal->committed_frame;
+        uint32_t pages = wal->committed_pages;
+        pthread_mutex_unlock(&wal->mutex);
+
+        if (fdatasync(wal->file_descriptor) == -1) {
+            printf("Error syncing log: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_lock(&wal->mutex);
+        wal->syncing = false;
+        if (upTo > wal->synced_frame) {
+            wal->synced_frame = upTo;
+            wal->synced_pages = pages;
+        }
+        wal->stats.syncs++;
+        pthread_cond_broadcast(&wal->cond);
+    }
+
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+int compareWalPageFrames(const void* a, const void* b) {
+    const WalPageFrame* left = a;
+    const WalPageFrame* right = b;
+
+    if (left->page_num != right->page_num) {
+        return left->page_num < right->page_num ? -1 : 1;
+    }
+    // Newest frame first
+    return left->frame > right->frame ? -1 : (left->frame < right->frame);
+}
+
+// Copy the latest synced version of every logged page back into the database file
+// Only the database file is written, so this can run alongside the writer. Pages past
+// the size recorded by the last synced commit were vacuumed away, so they're skipped
+// and the file is cut down to that size
+void walCheckpoint(Wal* wal) {
+    pthread_mutex_lock(&wal->mutex);
+    uint32_t start = wal->backfilled;
+    uint32_t target = wal->synced_frame;
+    uint32_t numPages = wal->synced_pages;
+    if (target <= start) {
+        pthread_mutex_unlock(&wal->mutex);
+        return;
+    }
+
+    // Checkpoints never overlap, so they share scratch space kept in the log
+    uint32_t count = target - start;
+    if (count > wal->checkpoint_capacity) {
+        wal->checkpoint_capacity = count;
+        wal->checkpoint_entries = realloc(wal->checkpoint_entries, count * sizeof(WalPageFrame));
+    }
+    WalPageFrame* entries = wal->checkpoint_entries;
+    for (uint32_t i = 0; i < count; i++) {
+        entries[i].page_num = wal->frame_pages[start + i];
+        entries[i].frame = start + i + 1;
+    }
+    pthread_mutex_unlock(&wal->mutex);
+
+    // Sorting by page number turns the copy into one sequential pass over the database file
+    qsort(entries, count, sizeof(WalPageFrame), compareWalPageFrames);
+
+    void* page = wal->checkpoint_page;
+    uint64_t copied = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if ((i > 0 && entries[i].page_num == entries[i - 1].page_num) || entries[i].page_num >= numPages) {
+            continue;
+        }
+
+        walReadPage(wal, entries[i].frame, page);
+        if (wal->compressed != NULL) {
+            compressedWritePage(wal->compressed, entries[i].page_num, page);
+            copied++;
+            continue;
+        }
+        off_t offset = (off_t) entries[i].page_num * PAGE_SIZE;
+        if (pwrite(wal->db_file_descriptor, page, PAGE_SIZE, offset) != PAGE_SIZE) {
+            printf("Error checkpointing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        copied++;
+    }
+
+    if (wal->compressed != NULL && compressedTruncate(wal->compressed, numPages)) {
+        // A vacuum shrank the database, so pack what's left to the front of the file
+        compressedCompact(wal->compressed);
+    } else if (wal->compressed != NULL) {
+        // Writing the map syncs the file
+        compressedSync(wal->compressed);
+    } else {
+        struct stat fileStat;
+        if (fstat(wal->db_file_descriptor, &fileStat) == 0 && fileStat.st_size > (off_t) numPages * PAGE_SIZE
+            && ftruncate(wal->db_file_descriptor, (off_t) numPages * PAGE_SIZE) == -1) {
+            printf("Error truncating db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        if (fdatasync(wal->db_file_descriptor) == -1) {
+            printf("Error syncing db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_mutex_lock(&wal->mutex);
+    wal->backfilled = target;
+    wal->stats.checkpoints++;
+    wal->stats.pages_checkpointed += copied;
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+void* walCheckpointThread(void* arg) {
+    Wal* wal = arg;
+
+    pthread_mutex_lock(&wal->mutex);
+    while (true) {
+        while (!wal->checkpoint_requested && !wal->closing) {
+            pthread_cond_wait(&wal->cond, &wal->mutex);
+        }
+        if (wal->closing) {
+            break;
+        }
+
+        wal->checkpoint_requested = false;
+        wal->checkpoint_running = true;
+        pthread_mutex_unlock(&wal->mutex);
+
+        walCheckpoint(wal);
+
+        pthread_mutex_lock(&wal->mutex);
+        wal->checkpoint_running = false;
+        pthread_cond_broadcast(&wal->cond);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+
+    return NULL;
+}
+
+// Called after each commit. Normally the background thread does the work,
+// but if the log keeps growing past WAL_MAX_FRAMES the writer checkpoints itself
+void walMaybeCheckpoint(Wal* wal) {
+    pthread_mutex_lock(&wal->mutex);
+
+    if (wal->max_frame >= WAL_MAX_FRAMES) {
+        while (wal->checkpoint_running) {
+            pthread_cond_wait(&wal->cond, &wal->mutex);
+        }
+        wal->checkpoint_running = true;
+        pthread_mutex_unlock(&wal->mutex);
+
+        walCheckpoint(wal);
+
+        pthread_mutex_lock(&wal->mutex);
+        wal->checkpoint_running = false;
+        pthread_cond_broadcast(&wal->cond);
+    } else if (wal->synced_frame - wal->backfilled >= WAL_AUTOCHECKPOINT_FRAMES && !wal->checkpoint_running) {
+        wal->checkpoint_requested = true;
+        pthread_cond_broadcast(&wal->cond);
+    }
+
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+// Rebuild the frame index from an existing log, dropping anything after the last commit
+void walRecover(Wal* wal) {
+    off_t length = lseek(wal->file_descriptor, 0, SEEK_END);
+    uint32_t header[4];
+
+    if (length < WAL_HEADER_SIZE
+        || pread(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE
+        || header[0] != WAL_MAGIC || header[1] != PAGE_SIZE) {
+        wal->salt = (uint32_t) time(NULL) ^ ((uint32_t) getpid() << 16);
+        walWriteHeader(wal);
+        return;
+    }
+
+    wal->salt = header[2];
+    void* page = malloc(PAGE_SIZE);
+    uint32_t frame = 1;
+    uint32_t frameHeader[4];
+
+    while (walFrameOffset(frame) + WAL_FRAME_SIZE <= length) {
+        off_t offset = walFrameOffset(frame);
+        if (pread(wal->file_descriptor, frameHeader, WAL_FRAME_HEADER_SIZE, offset) != WAL_FRAME_HEADER_SIZE
+            || pread(wal->file_descriptor, page, PAGE_SIZE, offset + WAL_FRAME_HEADER_SIZE) != PAGE_SIZE
+            || frameHeader[2] != wal->salt
+            || frameHeader[3] != walChecksum(frameHeader, page)) {
+            break;
+        }
+
+        if (frame > wal->frame_pages_capacity) {
+            wal->frame_pages_capacity *= 2;
+            wal->frame_pages = realloc(wal->frame_pages, wal->frame_pages_capacity * sizeof(uint32_t));
+        }
+        wal->frame_pages[frame - 1] = frameHeader[0];
+
+        if (frameHeader[1] != 0) {
+            wal->committed_frame = frame;
+            wal->committed_pages = frameHeader[1];
+        }
+        frame++;
+    }
+    free(page);
+
+    for (uint32_t i = 1; i <= wal->committed_frame; i++) {
+        walIndexPut(wal, wal->frame_pages[i - 1], i);
+    }
+    wal->max_frame = wal->committed_frame;
+    wal->synced_frame = wal->committed_frame;
+    wal->synced_pages = wal->committed_pages;
+}
+
+Wal* walOpen(const char* filename, int dbFileDescriptor, CompressedFile* compressed) {
+    Wal* wal = calloc(1, sizeof(Wal));
+    wal->path = malloc(strlen(filename) + 5);
+    sprintf(wal->path, "%s-wal", filename);
+
+    wal->file_descriptor = open(wal->path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (wal->file_descriptor == -1) {
+        printf("Unable to open log file\n");
+        exit(EXIT_FAILURE);
+    }
+    wal->db_file_descriptor = dbFileDescriptor;
+    wal->compressed = compressed;
+
+    wal->frame_pages_capacity = 1024;
+    wal->frame_pages = malloc(wal->frame_pages_capacity * sizeof(uint32_t));
+    wal->index_bits = 10;
+    wal->index_pages = calloc(1u << wal->index_bits, sizeof(uint32_t));
+    wal->index_frames = calloc(1u << wal->index_bits, sizeof(uint32_t));
+    wal->checkpoint_page = malloc(PAGE_SIZE);
+
+    walRecover(wal);
+
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->cond, NULL);
+    pthread_create(&wal->checkpointer, NULL, walCheckpointThread, wal);
+
+    return wal;
+}
+
+// Stop the checkpointer, copy everything back and remove the log
+void walClose(Wal* wal) {
+    pthread_mutex_lock(&wal->mutex);
+    wal->closing = true;
+    pthread_cond_broadcast(&wal->cond);
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_join(wal->checkpointer, NULL);
+
+    walSync(wal, wal->committed_frame);
+    walCheckpoint(wal);
+
+    if (wal->backfilled == wal->max_frame) {
+        unlink(wal->path);
+    }
+    close(wal->file_descriptor);
+
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_cond_destroy(&wal->cond);
+    free(wal->frame_pages);
+    free(wal->index_pages);
+    free(wal->index_frames);
+    free(wal->checkpoint_entries);
+    free(wal->checkpoint_page);
+    free(wal->path);
+    free(wal);
+}
+
+/*
+
+Buffer pool
+
+Pages live in a fixed number of frames. A hash table maps page numbers to frames,
+and once every frame is taken the CLOCK hand picks a victim: unpinned frames whose
+reference bit is clear get reused, and dirty ones are written back to disk first.
+
+*/
+uint32_t frameTableSlot(Pager* pager, uint32_t pageNum) {
+    // Fibonacci hashing, the high bits of the product are the well mixed ones
+    return (uint32_t) (pageNum * 2654435761u) >> (32 - pager->frame_table_bits);
+}
+
+int32_t pagerLookupFrame(Pager* pager, uint32_t pageNum) {
+    uint32_t mask = (1u << pager->frame_table_bits) - 1;
+    uint32_t slot = frameTableSlot(pager, pageNum);
+
+    while (pager->frame_table[slot] != -1) {
+        int32_t frameIndex = pager->frame_table[slot];
+        if (pager->frames[frameIndex].page_num == pageNum) {
+            return frameIndex;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return -1;
+}
+
+void pagerMapFrame(Pager* pager, uint32_t pageNum, int32_t frameIndex) {
+    uint32_t mask = (1u << pager->frame_table_bits) - 1;
+    uint32_t slot = frameTableSlot(pager, pageNum);
+
+    while (pager->frame_table[slot] != -1) {
+        slot = (slot + 1) & mask;
+    }
+    pager->frame_table[slot] = frameIndex;
+}
+
+void pagerUnmapFrame(Pager* pager, uint32_t pageNum) {
+    uint32_t mask = (1u << pager->frame_table_bits) - 1;
+    uint32_t slot = frameTableSlot(pager, pageNum);
+
+    while (pager->frames[pager->frame_table[slot]].page_num != pageNum) {
+        slot = (slot + 1) & mask;
+    }
+
+    // Backward-shift deletion keeps probe chains intact without tombstones
+    uint32_t hole = slot;
+    uint32_t next = (hole + 1) & mask;
+    while (pager->frame_table[next] != -1) {
+        uint32_t home = frameTableSlot(pager, pager->frames[pager->frame_table[next]].page_num);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            pager->frame_table[hole] = pager->frame_table[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    pager->frame_table[hole] = -1;
+}
+
+// Append frames to the write-ahead log, restarting it first if it's been fully checkpointed
+uint32_t pagerWalAppend(Pager* pager, Frame** frames, uint32_t count, uint32_t commitPages) {
+    Wal* wal = pager->wal;
+    uint32_t checkpointedPages = wal->committed_pages;
+
+    if (walRestart(wal)) {
+        // Everything the old log held is in the database file now, cut down to its size
+        pager->file_length = (off_t) checkpointedPages * PAGE_SIZE;
+    }
+
+    return walAppend(wal, frames, count, commitPages);
+}
+
+void pagerFlush(Pager* pager, uint32_t pageNum) {
+    int32_t frameIndex = pagerLookupFrame(pager, pageNum);
+    if (frameIndex == -1) {
+        printf("Tried to flush a page that isn't cached\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Frame* frame = &pager->frames[frameIndex];
+
+    if (pager->wal != NULL) {
+        // With a log the database file is only written by checkpoints. Pages written
+        // here aren't part of a commit yet, so recovery ignores them until one follows
+        pagerWalAppend(pager, &frame, 1, 0);
+        frame->dirty = false;
+        return;
+    }
+
+    if (pager->compressed != NULL) {
+        // Durable once the map is written, by the next pagerFlushAll
+        compressedWritePage(pager->compressed, pageNum, frame->data);
+        frame->dirty = false;
+        return;
+    }
+
+    ssize_t bytesWritten = pwrite(pager->file_descriptor, frame->data, PAGE_SIZE, (off_t) pageNum * PAGE_SIZE);
+
+    if (bytesWritten != PAGE_SIZE) {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((off_t) (pageNum + 1) * PAGE_SIZE > pager->file_length) {
+        pager->file_length = (off_t) (pageNum + 1) * PAGE_SIZE;
+    }
+    frame->dirty = false;
+}
+
+// Pick a frame to reuse with the CLOCK algorithm, or return -1 if every frame is pinned
+int32_t pagerEvictFrame(Pager* pager) {
+    // Two sweeps are enough: the first one clears every reference bit it passes
+    for (uint32_t scanned = 0; scanned < 2 * pager->num_frames; scanned++) {
+        uint32_t frameIndex = pager->clock_hand;
+        Frame* frame = &pager->frames[frameIndex];
+        pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+        if (frame->pin_count > 0) {
+            continue;
+        }
+
+        if (frame->referenced) {
+            frame->referenced = false;
+            continue;
+        }
+
+        if (frame->dirty) {
+            pagerFlush(pager, frame->page_num);
+            pager->stats.writebacks++;
+        }
+
+        pagerUnmapFrame(pager, frame->page_num);
+        pager->stats.evictions++;
+        return frameIndex;
+    }
+
+    return -1;
+}
+
+/*
+
+Latches
+
+Every page handed out by getPage is pinned and latched by the calling thread until
+it releases the page: shared for readers, exclusive between pagerBeginWrite and
+pagerEndWrite. Pins live on a thread-local stack, and fetching a page the thread
+already holds reuses the latch it has instead of taking it again.
+
+pager->mutex only covers pool bookkeeping and is never held while waiting for a
+latch. Latches are taken parent before child, and a scan lets go of a leaf before
+it latches the next one, so readers and the writer can't deadlock.
+
+*/
+typedef enum {
+    LATCH_NONE,
+    LATCH_SHARED,
+    LATCH_EXCLUSIVE
+} LatchMode;
+
+typedef struct {
+    Pager* pager;
+    uint32_t page_num;
+    int32_t frame_index; // -1 in mmap mode
+    LatchMode latch;     // LATCH_NONE when an earlier entry for the same page holds the latch
+} PinnedPage;
+
+typedef struct {
+    PinnedPage* pages;
+    uint32_t count;
+    uint32_t capacity;
+    bool writing;        // Inside pagerBeginWrite, so pages are latched exclusively
+    int32_t scans;       // Scans this thread has open. Can dip below zero if a statement moves thread
+} PinStack;
+
+__thread PinStack pinStack;
+pthread_key_t pinStackKey;
+pthread_once_t pinStackOnce = PTHREAD_ONCE_INIT;
+
+void freePinStack(void* pages) {
+    free(pages);
+}
+
+void createPinStackKey() {
+    pthread_key_create(&pinStackKey, freePinStack);
+}
+
+void pinStackPush(PinnedPage page) {
+    if (pinStack.count == pinStack.capacity) {
+        pinStack.capacity = pinStack.capacity ? pinStack.capacity * 2 : 64;
+        pinStack.pages = realloc(pinStack.pages, pinStack.capacity * sizeof(PinnedPage));
+
+        // Hand the stack to a thread-exit destructor so threads that used the engine don't leak it
+        pthread_once(&pinStackOnce, createPinStackKey);
+        pthread_setspecific(pinStackKey, pinStack.pages);
+    }
+    pinStack.pages[pinStack.count++] = page;
+}
+
+PinnedPage* pinStackFind(Pager* pager, uint32_t pageNum) {
+    for (uint32_t i = pinStack.count; i > 0; i--) {
+        PinnedPage* entry = &pinStack.pages[i - 1];
+        if (entry->pager == pager && entry->page_num == pageNum) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Frames pinned by the calling thread. Waiting for a frame can't help once these are all of them
+uint32_t pagerThreadPins(Pager* pager) {
+    uint32_t pins = 0;
+    for (uint32_t i = 0; i < pinStack.count; i++) {
+        pins += pinStack.pages[i].pager == pager && pinStack.pages[i].frame_index != -1;
+    }
+    return pins;
+}
+
+pthread_rwlock_t* pagerLatch(Pager* pager, uint32_t pageNum, int32_t frameIndex) {
+    if (frameIndex != -1) {
+        return &pager->frames[frameIndex].latch;
+    }
+
+    // mmap mode has no frames, so latches are kept per page and allocated a chunk at a time
+    pthread_rwlock_t** slot = &pager->page_latches[pageNum >> PAGER_LATCH_CHUNK_BITS];
+    pthread_rwlock_t* chunk = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (chunk == NULL) {
+        pthread_mutex_lock(&pager->mutex);
+        chunk = *slot;
+        if (chunk == NULL) {
+            chunk = malloc(sizeof(pthread_rwlock_t) << PAGER_LATCH_CHUNK_BITS);
+            for (uint32_t i = 0; i < (1u << PAGER_LATCH_CHUNK_BITS); i++) {
+                pthread_rwlock_init(&chunk[i], NULL);
+            }
+            __atomic_store_n(slot, chunk, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&pager->mutex);
+    }
+    return &chunk[pageNum & ((1u << PAGER_LATCH_CHUNK_BITS) - 1)];
+}
+
+/*
+
+In mmap mode the file is mapped once over a large reserved range. Growing the
+file with ftruncate makes more of the mapping usable without remapping it, so
+page pointers never move (mremap could relocate the mapping under them).
+
+*/
+void* pagerMapPage(Pager* pager, uint32_t pageNum) {
+    if ((size_t) (pageNum + 1) * PAGE_SIZE > PAGER_MMAP_RESERVE) {
+        printf("Page number out of bounds of the mapping. %d\n", pageNum);
+        exit(EXIT_FAILURE);
+    }
+
+    // Only the writer asks for pages past the end, so readers never take the lock
+    if (pageNum >= __atomic_load_n(&pager->num_pages, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&pager->mutex);
+        if ((off_t) (pageNum + 1) * PAGE_SIZE > pager->file_length) {
+            off_t newLength = (off_t) (pageNum + PAGER_MMAP_GROW_PAGES) * PAGE_SIZE;
+            if (ftruncate(pager->file_descriptor, newLength) == -1) {
+                printf("Error growing file: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            __atomic_store_n(&pager->file_length, newLength, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&pager->num_pages, pageNum + 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&pager->mutex);
+    }
+
+    __atomic_fetch_add(&pager->stats.hits, 1, __ATOMIC_RELAXED);
+    return pager->map + (size_t) pageNum * PAGE_SIZE;
+}
+
+void pagerReadFilePage(Pager* pager, uint32_t pageNum, void* data) {
+    ssize_t bytesRead = pread(pager->file_descriptor, data, PAGE_SIZE, (off_t) pageNum * PAGE_SIZE);
+    if (bytesRead == -1) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    // A checkpoint may have cut the file short since its length was last looked at
+    memset((uint8_t*) data + bytesRead, 0, PAGE_SIZE - bytesRead);
+}
+
+/* 
+
+The method below handles the logic for missing any cached files.
+Assumes pages are saved on after another with their own corresponding offset value.
+If the page lies outside the bounds of the file, it'll be zero-filled.
+From there, we can add the page to the file when its frame is written back later on.
+
+*/
+void pagerLoadFrame(Pager* pager, int32_t frameIndex, uint32_t pageNum) {
+    Frame* frame = &pager->frames[frameIndex];
+    off_t numPages = pager->file_length / PAGE_SIZE;
+    uint32_t walFrame = pager->wal != NULL ? walFindFrame(pager->wal, pageNum) : 0;
+
+    if (pageNum >= pager->num_pages) {
+        // A new page. Anything the log or the file still has for it was vacuumed away
+        memset(frame->data, 0, PAGE_SIZE);
+    } else if (walFrame != 0) {
+        // The log holds a newer copy than the database file
+        walReadPage(pager->wal, walFrame, frame->data);
+    } else if (pager->compressed != NULL) {
+        compressedReadPage(pager->compressed, pageNum, frame->data);
+    } else if (pageNum < numPages) {
+        pagerReadFilePage(pager, pageNum, frame->data);
+    } else {
+        memset(frame->data, 0, PAGE_SIZE);
+    }
+
+    frame->page_num = pageNum;
+    frame->pin_count = 0;
+    frame->dirty = false;
+    pagerMapFrame(pager, pageNum, frameIndex);
+}
+
+// Find or load the frame holding a page, and pin it
+// Misses are read in under the pool mutex, so a frame is never seen half loaded
+int32_t pagerFetchFrame(Pager* pager, uint32_t pageNum) {
+    pthread_mutex_lock(&pager->mutex);
+    int32_t frameIndex;
+
+    while (true) {
+        frameIndex = pagerLookupFrame(pager, pageNum);
+        if (frameIndex != -1 && pager->frames[frameIndex].loading) {
+            // A read-ahead thread got to it first and is still reading it in
+            pthread_cond_wait(&pager->frame_loaded, &pager->mutex);
+            continue;
+        }
+        if (frameIndex != -1) {
+            pager->stats.hits++;
+            break;
+        }
+
+        // Cache miss. Grab a free frame (or evict one) and load from file.
+        if (pager->frames_in_use < pager->num_frames) {
+            frameIndex = pager->frames_in_use++;
+        } else {
+            frameIndex = pagerEvictFrame(pager);
+        }
+
+        if (frameIndex != -1) {
+            pager->stats.misses++;
+            pagerLoadFrame(pager, frameIndex, pageNum);
+            break;
+        }
+
+        // Every frame is pinned. Other threads will let theirs go, this one won't
+        if (pager->pins == pagerThreadPins(pager)) {
+            printf("Buffer pool exhausted: all %d frames are pinned\n", pager->num_frames);
+            exit(EXIT_FAILURE);
+        }
+        // Someone else may load the page while this thread waits, so look it up again
+        pthread_cond_wait(&pager->frame_unpinned, &pager->mutex);
+    }
+
+    Frame* frame = &pager->frames[frameIndex];
+    frame->referenced = true;
+    frame->pin_count++;
+    pager->pins++;
+
+    // A frame left over from a truncated page can be hit too, so the size grows here
+    if (pageNum >= pager->num_pages) {
+        pager->num_pages = pageNum + 1;
+    }
+
+    pthread_mutex_unlock(&pager->mutex);
+    return frameIndex;
+}
+
+// Every page handed out is pinned and latched until the caller releases it with
+// pagerUnpinTo, so pointers returned by earlier calls stay valid while more pages are fetched
+void* getPage(Pager* pager, uint32_t pageNum) {
+    PinnedPage entry = { pager, pageNum, -1, LATCH_NONE };
+    void* data;
+
+    if (pager->map != NULL) {
+        data = pagerMapPage(pager, pageNum);
+    } else {
+        entry.frame_index = pagerFetchFrame(pager, pageNum);
+        data = pager->frames[entry.frame_index].data;
+    }
+
+    if (pinStackFind(pager, pageNum) == NULL) {
+        pthread_rwlock_t* latch = pagerLatch(pager, pageNum, entry.frame_index);
+        if (pinStack.writing) {
+            pthread_rwlock_wrlock(latch);
+            entry.latch = LATCH_EXCLUSIVE;
+        } else {
+            pthread_rwlock_rdlock(latch);
+            entry.latch = LATCH_SHARED;
+        }
+    }
+
+    pinStackPush(entry);
+    return data;
+}
+
+// Anything that changes a page in place has to call this, or the change is lost on eviction
+// The page must still be pinned from the getPage call that fetched it
+void pagerMarkDirty(Pager* pager, uint32_t pageNum) {
+    if (pager->map != NULL) {
+        // There's no frame to flag, just widen the range the next commit syncs
+        if (pageNum < pager->sync_low) {
+            pager->sync_low = pageNum;
+        }
+        if (pageNum + 1 > pager->sync_high) {
+            pager->sync_high = pageNum + 1;
+        }
+        return;
+    }
+
+    PinnedPage* entry = pinStackFind(pager, pageNum);
+    if (entry == NULL) {
+        printf("Tried to change page %d without pinning it\n", pageNum);
+        exit(EXIT_FAILURE);
+    }
+    // Evictions only look at the flag once the pin is gone, and unpinning takes the pool mutex
+    pager->frames[entry->frame_index].dirty = true;
+}
+
+int compareFramesByPageNum(const void* a, const void* b) {
+    uint32_t left = (*(Frame**) a)->page_num;
+    uint32_t right = (*(Frame**) b)->page_num;
+    return (left > right) - (left < right);
+}
+
+// Collect the dirty frames sorted by page number, in the pager's scratch array. The caller
+// holds the pool mutex, so none of them can be evicted and nobody else uses the array meanwhile
+Frame** pagerDirtyFrames(Pager* pager, uint32_t* count) {
+    Frame** dirty = pager->dirty_frames;
+    *count = 0;
+
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        if (pager->frames[i].dirty) {
+            dirty[(*count)++] = &pager->frames[i];
+        }
+    }
+
+    qsort(dirty, *count, sizeof(Frame*), compareFramesByPageNum);
+    return dirty;
+}
+
+// Write every dirty page back to the database file. Runs of adjacent pages are
+// coalesced into a single pwritev, so clean pages cost nothing and dirty ones
+// go out in as few sequential writes as possible
+void pagerFlushAll(Pager* pager) {
+    pthread_mutex_lock(&pager->mutex);
+    uint32_t count;
+    Frame** dirty = pagerDirtyFrames(pager, &count);
+
+    if (pager->wal != NULL) {
+        // The database file belongs to the checkpointer, so pages go to the log
+        // uncommitted, the same way evicted pages do
+        if (count > 0) {
+            pagerWalAppend(pager, dirty, count, 0);
+            for (uint32_t i = 0; i < count; i++) {
+                dirty[i]->dirty = false;
+            }
+        }
+        pthread_mutex_unlock(&pager->mutex);
+        return;
+    }
+
+    if (pager->compressed != NULL) {
+        // Every page gets an extent of its own, so there are no runs to coalesce
+        for (uint32_t i = 0; i < count; i++) {
+            compressedWritePage(pager->compressed, dirty[i]->page_num, dirty[i]->data);
+            dirty[i]->dirty = false;
+        }
+        pager->stats.flushed_pages += count;
+        pager->stats.flush_writes += count;
+        compressedSync(pager->compressed);
+        pthread_mutex_unlock(&pager->mutex);
+        return;
+    }
+    struct iovec iov[PAGER_MAX_WRITE_RUN];
+
+    uint32_t start = 0;
+    while (start < count) {
+        uint32_t end = start + 1;
+        while (end < count && end - start < PAGER_MAX_WRITE_RUN
+               && dirty[end]->page_num == dirty[end - 1]->page_num + 1) {
+            end++;
+        }
+
+        for (uint32_t i = start; i < end; i++) {
+            iov[i - start].iov_base = dirty[i]->data;
+            iov[i - start].iov_len = PAGE_SIZE;
+        }
+
+        off_t offset = (off_t) dirty[start]->page_num * PAGE_SIZE;
+        ssize_t expected = (ssize_t) (end - start) * PAGE_SIZE;
+        if (pwritev(pager->file_descriptor, iov, end - start, offset) != expected) {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+
+        for (uint32_t i = start; i < end; i++) {
+            dirty[i]->dirty = false;
+        }
+        if (offset + expected > pager->file_length) {
+            pager->file_length = offset + expected;
+        }
+        pager->stats.flushed_pages += end - start;
+        pager->stats.flush_writes++;
+
+        start = end;
+    }
+
+    pthread_mutex_unlock(&pager->mutex);
+}
+
+/*
+
+Read-ahead
+
+Prefetched pages are queued for a small pool of threads that read them into frames.
+A thread claims a frame and maps it under the pool mutex, marked as loading and pinned
+so it can't be evicted, then reads the page with the mutex let go. Anyone who looks the
+page up in the meantime waits for it instead of reading it again. So a scan can keep
+several leaves in flight at once instead of stalling on each one as it gets there.
+
+*/
+bool pagerReadAheadQueued(Pager* pager, uint32_t pageNum) {
+    for (uint32_t i = 0; i < pager->readahead_count; i++) {
+        if (pager->readahead_queue[(pager->readahead_head + i) % PAGER_READAHEAD_QUEUE] == pageNum) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Read one queued page into a frame. Called and returns with the pool mutex held
+void pagerReadAhead(Pager* pager, uint32_t pageNum) {
+    // It may have been needed, or dropped by a truncate, while it waited
+    if (pagerLookupFrame(pager, pageNum) != -1 || pageNum >= pager->num_pages) {
+        return;
+    }
+
+    int32_t frameIndex;
+    if (pager->frames_in_use < pager->num_frames) {
+        frameIndex = pager->frames_in_use++;
+    } else {
+        frameIndex = pagerEvictFrame(pager);
+    }
+    if (frameIndex == -1) {
+        // Every frame is pinned. The page gets read when it's needed
+        return;
+    }
+
+    Frame* frame = &pager->frames[frameIndex];
+    if (pager->wal != NULL) {
+        // Log frames are rewritten once the log restarts, which only happens under the mutex
+        pagerLoadFrame(pager, frameIndex, pageNum);
+    } else {
+        frame->page_num = pageNum;
+        frame->pin_count = 1;
+        frame->dirty = false;
+        frame->loading = true;
+        pager->pins++;
+        pager->readahead_loading++;
+        pagerMapFrame(pager, pageNum, frameIndex);
+        pthread_mutex_unlock(&pager->mutex);
+
+        // Only a cached page is ever written, so nothing changes this one while it's read
+        if (pager->compressed != NULL) {
+            compressedReadPage(pager->compressed, pageNum, frame->data);
+        } else {
+            pagerReadFilePage(pager, pageNum, frame->data);
+        }
+
+        pthread_mutex_lock(&pager->mutex);
+        frame->loading = false;
+        frame->pin_count = 0;
+        pager->pins--;
+        pager->readahead_loading--;
+        pthread_cond_broadcast(&pager->frame_loaded);
+        pthread_cond_broadcast(&pager->frame_unpinned);
+    }
+
+    // Give it a pass of the clock to be used before it can be evicted
+    frame->referenced = true;
+    pager->stats.readaheads++;
+}
+
+void* pagerReadAheadThread(void* arg) {
+    Pager* pager = arg;
+    pthread_mutex_lock(&pager->mutex);
+
+    while (true) {
+        while (pager->readahead_count == 0 && !pager->readahead_closing) {
+            pthread_cond_wait(&pager->readahead_wanted, &pager->mutex);
+        }
+        if (pager->readahead_closing) {
+            break;
+        }
+
+        uint32_t pageNum = pager->readahead_queue[pager->readahead_head];
+        pager->readahead_head = (pager->readahead_head + 1) % PAGER_READAHEAD_QUEUE;
+        pager->readahead_count--;
+        pagerReadAhead(pager, pageNum);
+    }
+
+    pthread_mutex_unlock(&pager->mutex);
+    return NULL;
+}
+
+void pagerStartReadAhead(Pager* pager) {
+    pager->readahead_head = 0;
+    pager->readahead_count = 0;
+    pager->readahead_loading = 0;
+    pager->readahead_closing = false;
+    pthread_cond_init(&pager->readahead_wanted, NULL);
+    pthread_cond_init(&pager->frame_loaded, NULL);
+
+    for (uint32_t i = 0; i < PAGER_READAHEAD_THREADS; i++) {
+        if (pthread_create(&pager->readahead_threads[i], NULL, pagerReadAheadThread, pager) != 0) {
+            printf("Unable to start read-ahead thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Pages still queued are dropped. One being read is finished first
+void pagerStopReadAhead(Pager* pager) {
+    pthread_mutex_lock(&pager->mutex);
+    pager->readahead_closing = true;
+    pthread_cond_broadcast(&pager->readahead_wanted);
+    pthread_mutex_unlock(&pager->mutex);
+
+    for (uint32_t i = 0; i < PAGER_READAHEAD_THREADS; i++) {
+        pthread_join(pager->readahead_threads[i], NULL);
+    }
+    pthread_cond_destroy(&pager->readahead_wanted);
+    pthread_cond_destroy(&pager->frame_loaded);
+}
+
+// Hint that a page will be needed soon so it can be read in the background. Returns
+// true if it wasn't cached or asked for already. In mmap mode that can't be told, so never
+bool pagerPrefetch(Pager* pager, uint32_t pageNum) {
+    if (pager->map != NULL) {
+        if ((off_t) pageNum * PAGE_SIZE < __atomic_load_n(&pager->file_length, __ATOMIC_RELAXED)) {
+            madvise(pager->map + (size_t) pageNum * PAGE_SIZE, PAGE_SIZE, MADV_WILLNEED);
+            __atomic_fetch_add(&pager->stats.prefetches, 1, __ATOMIC_RELAXED);
+        }
+        return false;
+    }
+
+    pthread_mutex_lock(&pager->mutex);
+    bool wanted = pageNum < pager->num_pages && pagerLookupFrame(pager, pageNum) == -1
+                  && !pagerReadAheadQueued(pager, pageNum);
+    bool queued = wanted && pager->readahead_count < PAGER_READAHEAD_QUEUE;
+    if (wanted) {
+        pager->stats.prefetches++;
+    }
+    if (queued) {
+        pager->readahead_queue[(pager->readahead_head + pager->readahead_count) % PAGER_READAHEAD_QUEUE] = pageNum;
+        pager->readahead_count++;
+        pthread_cond_signal(&pager->readahead_wanted);
+    }
+    pthread_mutex_unlock(&pager->mutex);
+
+    // The threads are behind already, so at least get the kernel started on it
+    if (wanted && !queued && pager->compressed != NULL) {
+        compressedPrefetch(pager->compressed, pageNum);
+    } else if (wanted && !queued) {
+        posix_fadvise(pager->file_descriptor, (off_t) pageNum * PAGE_SIZE, PAGE_SIZE, POSIX_FADV_WILLNEED);
+    }
+    return wanted;
+}
+
+// Let go of pin stack entries [from, to). Latches go first, so a frame is never
+// reused while a latch on it is still held. A later entry for the same page takes
+// the latch over instead of it being released
+void pinStackRelease(uint32_t from, uint32_t to) {
+    for (uint32_t i = to; i > from; i--) {
+        PinnedPage* entry = &pinStack.pages[i - 1];
+        if (entry->latch == LATCH_NONE) {
+            continue;
+        }
+
+        PinnedPage* heir = NULL;
+        for (uint32_t j = to; j < pinStack.count && heir == NULL; j++) {
+            if (pinStack.pages[j].pager == entry->pager && pinStack.pages[j].page_num == entry->page_num) {
+                heir = &pinStack.pages[j];
+            }
+        }
+
+        if (heir != NULL) {
+            heir->latch = entry->latch;
+        } else {
+            pthread_rwlock_unlock(pagerLatch(entry->pager, entry->page_num, entry->frame_index));
+        }
+    }
+
+    Pager* locked = NULL;
+    for (uint32_t i = from; i < to; i++) {
+        PinnedPage* entry = &pinStack.pages[i];
+        if (entry->frame_index == -1) {
+            continue;
+        }
+        if (entry->pager != locked) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->mutex);
+            }
+            locked = entry->pager;
+            pthread_mutex_lock(&locked->mutex);
+        }
+
+        Frame* frame = &locked->frames[entry->frame_index];
+        locked->pins--;
+        if (--frame->pin_count == 0) {
+            pthread_cond_broadcast(&locked->frame_unpinned);
+        }
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->mutex);
+    }
+
+    memmove(&pinStack.pages[from], &pinStack.pages[to], (pinStack.count - to) * sizeof(PinnedPage));
+    pinStack.count -= to - from;
+}
+
+// Pins are released in stack order. Take a mark before fetching pages that
+// are only needed briefly, then drop them again with pagerUnpinTo(mark)
+// The stack belongs to the thread, so a mark covers pins on every pager it has touched
+uint32_t pagerPinMark() {
+    return pinStack.count;
+}
+
+void pagerUnpinTo(uint32_t mark) {
+    if (pinStack.count > mark) {
+        pinStackRelease(mark, pinStack.count);
+    }
+}
+
+// Release everything pinned since mark except the page fetched last
+// This is how a descent lets go of the nodes above the one it just reached
+void pagerUnpinBelowTop(uint32_t mark) {
+    if (pinStack.count > mark + 1) {
+        pinStackRelease(mark, pinStack.count - 1);
+    }
+}
+
+void pagerUnpinAll(Pager* pager) {
+    uint32_t end = pinStack.count;
+    while (end > 0) {
+        uint32_t start = end;
+        while (start > 0 && pinStack.pages[start - 1].pager == pager) {
+            start--;
+        }
+        if (start < end) {
+            pinStackRelease(start, end);
+            end = start;
+        } else {
+            end--;
+        }
+    }
+}
+
+// Statements that change the tree run one at a time, latching pages exclusively
+void pagerBeginWrite(Pager* pager) {
+    pthread_mutex_lock(&pager->writer_mutex);
+    pinStack.writing = true;
+}
+
+void pagerEndWrite(Pager* pager) {
+    pinStack.writing = false;
+    pthread_mutex_unlock(&pager->writer_mutex);
+}
+
+// A scan's cursor keeps the next leaf's page number in its snapshot between steps,
+// which a vacuum moving pages would leave pointing at the wrong page. Scans bracket
+// themselves with these, and a vacuum only starts once none are open. New scans wait
+// while one is pending, so a steady stream of overlapping selects can't starve it,
+// but a thread that already has a scan open goes ahead rather than wait on itself
+void pagerBeginScan(Pager* pager) {
+    pthread_mutex_lock(&pager->mutex);
+    while (pager->vacuuming && (pager->scans == 0 || pinStack.scans <= 0)) {
+        pthread_cond_wait(&pager->scans_changed, &pager->mutex);
+    }
+    pager->scans++;
+    pinStack.scans++;
+    pthread_mutex_unlock(&pager->mutex);
+}
+
+void pagerEndScan(Pager* pager) {
+    pthread_mutex_lock(&pager->mutex);
+    pinStack.scans--;
+    if (--pager->scans == 0) {
+        pthread_cond_broadcast(&pager->scans_changed);
+    }
+    pthread_mutex_unlock(&pager->mutex);
+}
+
+// Whether any thread has a scan open, this one included
+bool pagerScansOpen(Pager* pager) {
+    pthread_mutex_lock(&pager->mutex);
+    bool open = pager->scans > 0;
+    pthread_mutex_unlock(&pager->mutex);
+    return open;
+}
+
+// Hold new scans back and wait out the open ones. Taken before the writer lock,
+// so a thread with a scan open can still finish an insert it started
+void pagerBeginVacuum(Pager* pager) {
+    pthread_mutex_lock(&pager->mutex);
+    while (pager->vacuuming) {
+        pthread_cond_wait(&pager->scans_changed, &pager->mutex);
+    }
+    pager->vacuuming = true;
+    while (pager->scans > 0) {
+        pthread_cond_wait(&pager->scans_changed, &pager->mutex);
+    }
+    pthread_mutex_unlock(&pager->mutex);
+}
+
+void pagerEndVacuum(Pager* pager) {
+    pthread_mutex_lock(&pager->mutex);
+    pager->vacuuming = false;
+    pthread_cond_broadcast(&pager->scans_changed);
+    pthread_mutex_unlock(&pager->mutex);
+}
+
+// Drop every page from numPages on. The writer calls this once nothing in use is left
+// past that point. Cached copies stay behind as blank pages, which is what reading them
+// past the end would give anyway
+void pagerTruncate(Pager* pager, uint32_t numPages) {
+    pthread_mutex_lock(&pager->mutex);
+    // A page being read ahead would land on top of the blanked copy
+    while (pager->readahead_loading > 0) {
+        pthread_cond_wait(&pager->frame_loaded, &pager->mutex);
+    }
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        if (pager->frames[i].page_num >= numPages) {
+            memset(pager->frames[i].data, 0, PAGE_SIZE);
+            pager->frames[i].dirty = false;
+        }
+    }
+    __atomic_store_n(&pager->num_pages, numPages, __ATOMIC_RELEASE);
+
+    if (pager->map != NULL && pager->sync_high > numPages) {
+        pager->sync_high = numPages;
+    }
+
+    // With a log the next commit records the new size, and checkpoints cut the file down to it
+    bool compact = pager->wal == NULL && pager->compressed != NULL && compressedTruncate(pager->compressed, numPages);
+    if (pager->wal == NULL && pager->compressed == NULL && (off_t) numPages * PAGE_SIZE < pager->file_length) {
+        if (ftruncate(pager->file_descriptor, (off_t) numPages * PAGE_SIZE) == -1) {
+            printf("Error truncating db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        __atomic_store_n(&pager->file_length, (off_t) numPages * PAGE_SIZE, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pager->mutex);
+
+    if (compact) {
+        // Dirty pages get new extents when they're written, so they go out before the file is packed
+        pagerFlushAll(pager);
+        compressedCompact(pager->compressed);
+    }
+}
+
+// Commit pages that already went to the log uncommitted, through evictions or
+// pagerFlushAll, when none are left dirty. A commit needs a frame to carry it, so the
+// newest of them is logged again. Returns the commit frame, or 0 if there was nothing to commit
+uint32_t pagerWalCommitLogged(Pager* pager) {
+    Wal* wal = pager->wal;
+    pthread_mutex_lock(&wal->mutex);
+    uint32_t last = wal->max_frame > wal->committed_frame ? wal->max_frame : 0;
+    Frame frame = { .page_num = last != 0 ? wal->frame_pages[last - 1] : 0 };
+    pthread_mutex_unlock(&wal->mutex);
+
+    if (last == 0) {
+        return 0;
+    }
+
+    Frame* frames = &frame;
+    frame.data = malloc(PAGE_SIZE);
+    walReadPage(wal, last, frame.data);
+    uint32_t commitFrame = pagerWalAppend(pager, &frames, 1, pager->num_pages);
+    free(frame.data);
+    return commitFrame;
+}
+
+// Commit point after a statement that changed pages
+// With a write-ahead log the dirty pages are appended to it and synced
+// In mmap mode the pages touched since the last commit are synced to disk
+void pagerCommit(Pager* pager) {
+    if (pager->wal != NULL) {
+        pthread_mutex_lock(&pager->mutex);
+        uint32_t count;
+        Frame** dirty = pagerDirtyFrames(pager, &count);
+        uint32_t lastFrame = 0;
+
+        if (count > 0) {
+            lastFrame = pagerWalAppend(pager, dirty, count, pager->num_pages);
+            for (uint32_t i = 0; i < count; i++) {
+                dirty[i]->dirty = false;
+            }
+        } else {
+            lastFrame = pagerWalCommitLogged(pager);
+            count = lastFrame != 0;
+        }
+        pthread_mutex_unlock(&pager->mutex);
+
+        // Readers can keep missing into the pool while the log syncs
+        if (count > 0) {
+            walSync(pager->wal, lastFrame);
+            walMaybeCheckpoint(pager->wal);
+        }
+        return;
+    }
+
+    if (pager->map == NULL || pager->sync_low >= pager->sync_high) {
+        return;
+    }
+
+    size_t offset = (size_t) pager->sync_low * PAGE_SIZE;
+    size_t length = (size_t) (pager->sync_high - pager->sync_low) * PAGE_SIZE;
+    if (msync(pager->map + offset, length, MS_SYNC) == -1) {
+        printf("Error syncing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    pager->sync_low = UINT32_MAX;
+    pager->sync_high = 0;
+}
+
+// When user exits the program, close the db connection
+void dbClose(Table* table) {
+    Pager* pager = table->pager;
+
+    if (pager->map == NULL) {
+        pagerStopReadAhead(pager);
+    }
+
+    if (pager->map != NULL) {
+        pagerCommit(pager);
+        munmap(pager->map, PAGER_MMAP_RESERVE);
+
+        // Drop the unused tail left over from growing the file in chunks
+        if (ftruncate(pager->file_descriptor, (off_t) pager->num_pages * PAGE_SIZE) == -1) {
+            printf("Error truncating db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (pager->wal != NULL) {
+        pagerCommit(pager);
+        walClose(pager->wal);
+        pager->wal = NULL;
+    }
+
+    pagerFlushAll(pager);
+    if (pager->compressed != NULL) {
+        compressedClose(pager->compressed);
+    }
+    if (pager->frame_slab != NULL) {
+        munmap(pager->frame_slab, (size_t) pager->num_frames * PAGE_SIZE);
+    }
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+        pthread_rwlock_destroy(&pager->frames[i].latch);
+    }
+    for (uint32_t i = 0; i < pager->num_latch_chunks; i++) {
+        if (pager->page_latches[i] != NULL) {
+            for (uint32_t j = 0; j < (1u << PAGER_LATCH_CHUNK_BITS); j++) {
+                pthread_rwlock_destroy(&pager->page_latches[i][j]);
+            }
+            free(pager->page_latches[i]);
+        }
+    }
+
+    int res = close(pager->file_descriptor);
+    if (res == -1) {
+        printf("Error closing db file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < STATEMENT_CACHE_SIZE; i++) {
+        if (table->statement_cache[i].statement != NULL) {
+            destroyPreparedStatement(table->statement_cache[i].statement);
+        }
+    }
+
+    free(pager->frames);
+    free(pager->dirty_frames);
+    free(pager->frame_table);
+    free(pager->page_latches);
+    pthread_mutex_destroy(&pager->mutex);
+    pthread_cond_destroy(&pager->frame_unpinned);
+    pthread_mutex_destroy(&pager->writer_mutex);
+    pthread_cond_destroy(&pager->scans_changed);
+    free(pager);
+    for (uint32_t i = 0; i < TEXT_COLUMNS; i++) {
+        free(table->indexes[i]);
+    }
+    pthread_mutex_destroy(&table->statement_cache_mutex);
+    free(table);
+}
+
+void printStatementCacheStats(Table* table) {
+    uint32_t cached = 0;
+    for (uint32_t i = 0; i < STATEMENT_CACHE_SIZE; i++) {
+        cached += table->statement_cache[i].statement != NULL;
+    }
+
+    uint64_t lookups = table->statement_cache_hits + table->statement_cache_misses;
+    printf("cached: %d/%d\n", cached, STATEMENT_CACHE_SIZE);
+    printf("hits: %lu\n", table->statement_cache_hits);
+    printf("misses: %lu\n", table->statement_cache_misses);
+    printf("hit ratio: %.4f\n", lookups ? (double) table->statement_cache_hits / lookups : 0.0);
+}
+
+void printStats(Pager* pager) {
+    PagerStats* stats = &pager->stats;
+    uint64_t lookups = stats->hits + stats->misses;
+
+    if (pager->map != NULL) {
+        printf("mode: mmap\n");
+        printf("mapped: %ld bytes\n", (long) pager->file_length);
+        printf("page lookups: %lu\n", stats->hits);
+        printf("prefetches: %lu\n", stats->prefetches);
+        return;
+    }
+
+    printf("frames: %d/%d (%d bytes each)\n", pager->frames_in_use, pager->num_frames, PAGE_SIZE);
+    printf("hits: %lu\n", stats->hits);
+    printf("misses: %lu\n", stats->misses);
+    printf("evictions: %lu\n", stats->evictions);
+    printf("writebacks: %lu\n", stats->writebacks);
+    printf("prefetches: %lu\n", stats->prefetches);
+    printf("read ahead: %lu\n", stats->readaheads);
+    printf("flushed: %lu pages in %lu writes\n", stats->flushed_pages, stats->flush_writes);
+    printf("hit ratio: %.4f\n", lookups ? (double) stats->hits / lookups : 0.0);
+
+    if (pager->compressed != NULL) {
+        CompressedFile* file = pager->compressed;
+        uint64_t stored = 0;
+        uint32_t pages = 0;
+        pthread_mutex_lock(&file->mutex);
+        for (uint32_t i = 0; i < file->num_pages; i++) {
+            stored += compressedSectors(file->map[i].length) * PAGER_COMPRESSED_SECTOR;
+            pages += file->map[i].length > 0;
+        }
+        printf("compressed: %d pages in %lu bytes (%.2fx)\n", pages, stored,
+               stored ? (double) pages * PAGE_SIZE / stored : 0.0);
+        printf("compressed writes: %lu (%lu stored as is)\n", file->pages_written, file->pages_stored_raw);
+        printf("page map writes: %lu\n", file->map_writes);
+        pthread_mutex_unlock(&file->mutex);
+    }
+
+    if (pager->wal != NULL) {
+        Wal* wal = pager->wal;
+        pthread_mutex_lock(&wal->mutex);
+        printf("wal frames: %d (%d backfilled)\n", wal->max_frame, wal->backfilled);
+        printf("wal commits: %lu\n", wal->stats.commits);
+        printf("wal syncs: %lu\n", wal->stats.syncs);
+        printf("wal frames written: %lu\n", wal->stats.frames_written);
+        printf("checkpoints: %lu (%lu pages)\n", wal->stats.checkpoints, wal->stats.pages_checkpointed);
+        pthread_mutex_unlock(&wal->mutex);
+    }
+}
+
+// Position a cursor on the first row of the leftmost leaf
+// Scans then follow the leaf sibling chain, so the tree is only descended once
+Cursor* tableStart(Table* table) {
+    return tableSeek(table, 0);
+}
+
+// Return a pointer to the position which the cursor is located
+void* cursorValue(Cursor* cursor) {
+    if (cursor->snapshot != NULL) {
+        return leafNodeValue(cursor->snapshot, cursor->cell_num);
+    }
+    void* page = getPage(cursor->table->pager, cursor->page_num);
+    return leafNodeValue(page, cursor->cell_num);
+}
+
+// Copy out the row the cursor is positioned on
+void cursorRow(Cursor* cursor, Row* row) {
+    row->id = cursorKey(cursor);
+    deserializeRow(cursorValue(cursor), row);
+}
+
+uint32_t cursorKey(Cursor* cursor) {
+    if (cursor->snapshot != NULL) {
+        return *leafNodeKey(cursor->snapshot, cursor->cell_num);
+    }
+    void* page = getPage(cursor->table->pager, cursor->page_num);
+    return *leafNodeKey(page, cursor->cell_num);
+}
+
+// Index of the first cell whose key is >= key
+// An index repeats keys, so the search always runs on to the first of them
+uint32_t leafNodeFindCell(void* node, uint32_t key) {
+    // Search for leaf node using binary search
+    uint32_t minIndex = 0;
+    uint32_t onePastMaxIndex = *leafNodeNumCells(node);
+
+    while (onePastMaxIndex != minIndex) {
+        uint32_t index = (minIndex + onePastMaxIndex) / 2;
+        uint32_t keyAtIndex = *leafNodeKey(node, index);
+
+        if (key <= keyAtIndex) {
+            onePastMaxIndex = index;
+        } else {
+            minIndex = index + 1;
+        }
+    }
+
+    return minIndex;
+}
+
+void findLeafNode(Table* table, uint32_t pageNum, uint32_t key, Cursor* cursor) {
+    void* node = getPage(table->pager, pageNum);
+
+    cursor->table = table;
+    cursor->page_num = pageNum;
+    cursor->cell_num = leafNodeFindCell(node, key);
+    cursor->end_of_table = false;
+    cursor->snapshot = NULL;
+    cursor->scan_end = 0;
+}
+
+// Point the caller's cursor, usually one on its stack, at where the key is or would go
+// The leaf stays pinned and latched until the caller releases it
+void tableFind(Table* table, uint32_t key, Cursor* cursor) {
+    uint32_t pageNum;
+    descendToLeaf(table, key, &pageNum, NULL, 0);
+    findLeafNode(table, pageNum, key, cursor);
+}
+
+// Position a scan cursor on the first row whose key is >= key
+// The cursor reads a copy of its leaf, so nothing stays latched between rows
+// and a scan never holds up the writer for longer than it takes to copy a page
+Cursor* tableSeek(Table* table, uint32_t key) {
+    return tableSeekRange(table, key, (uint64_t) UINT32_MAX + 1);
+}
+
+// Seek for a scan that stops before the key end, so leaves past it aren't read ahead
+Cursor* tableSeekRange(Table* table, uint32_t key, uint64_t end) {
+    // The snapshot shares the cursor's allocation, so free(cursor) releases both
+    Cursor* cursor = malloc(sizeof(Cursor) + PAGE_SIZE);
+    tableSeekInto(table, key, end, cursor, cursor + 1);
+    return cursor;
+}
+
+// Seek with a cursor and a page-sized snapshot buffer the caller owns, so a statement
+// run over and over can keep reusing the same ones
+void tableSeekInto(Table* table, uint32_t key, uint64_t end, Cursor* cursor, void* snapshot) {
+    Pager* pager = table->pager;
+    uint32_t mark = pagerPinMark();
+    uint32_t pageNum;
+    void* node = descendToLeaf(table, key, &pageNum, NULL, end);
+
+    cursor->table = table;
+    cursor->page_num = pageNum;
+    cursor->cell_num = leafNodeFindCell(node, key);
+    cursor->end_of_table = false;
+    cursor->snapshot = snapshot;
+    cursor->scan_end = end;
+    memcpy(cursor->snapshot, node, PAGE_SIZE);
+    pagerUnpinTo(mark);
+
+    // The key may sort after the whole leaf, so step off it
+    cursorSkipExhaustedLeaves(cursor);
+    if (!cursor->end_of_table && *leafNodeNextLeaf(cursor->snapshot) != 0) {
+        pagerPrefetch(pager, *leafNodeNextLeaf(cursor->snapshot));
+    }
+}
+
+void incrementCursor (Cursor* cursor) {
+    cursor->cell_num += 1;
+    cursorSkipExhaustedLeaves(cursor);
+}
+
+// Follow sibling links until the cursor points at a cell, or the table ends
+// Each sibling is copied under its latch, after the previous leaf has been let go.
+// Splits only ever move keys to the right, and deletes don't move any while a scan is open,
+// so every row is still seen at most once and in order
+void cursorSkipExhaustedLeaves(Cursor* cursor) {
+    Pager* pager = cursor->table->pager;
+    void* node = cursor->snapshot;
+
+    while (cursor->cell_num >= (*leafNodeNumCells(node))) {
+        // Move on to the right sibling. Page 0 is always the root, so it marks the last leaf
+        uint32_t nextPageNum = *leafNodeNextLeaf(node);
+        if (nextPageNum == 0) {
+            cursor->end_of_table = true;
+            return;
+        }
+
+        cursor->page_num = nextPageNum;
+        cursor->cell_num = 0;
+        uint32_t mark = pagerPinMark();
+        memcpy(node, getPage(pager, nextPageNum), PAGE_SIZE);
+        pagerUnpinTo(mark);
+
+        // Start reading the leaf after this one while the current one is consumed
+        uint32_t numCells = *leafNodeNumCells(node);
+        if (*leafNodeNextLeaf(node) != 0 && numCells > 0) {
+            tableReadAhead(cursor->table, *leafNodeNextLeaf(node), *leafNodeKey(node, numCells - 1), cursor->scan_end);
+        }
+    }
+}
+
+// Hint a scan's next leaf. If it hadn't been asked for yet, the scan has run past the leaves
+// read ahead so far, so queue up the ones after it as well. No latches may be held, the
+// descent takes them from the root down
+void tableReadAhead(Table* table, uint32_t nextPageNum, uint32_t lastKey, uint64_t end) {
+    Pager* pager = table->pager;
+    if (!pagerPrefetch(pager, nextPageNum) || (uint64_t) lastKey + 1 >= end) {
+        return;
+    }
+
+    uint32_t mark = pagerPinMark();
+    uint32_t pageNum;
+    descendToLeaf(table, lastKey + 1, &pageNum, NULL, end);
+    pagerUnpinTo(mark);
+}
+
+// Makeshift "virtual machine"
+int compareRows(const void* a, const void* b) {
+    uint32_t left = ((Row*) a)->id;
+    uint32_t right = ((Row*) b)->id;
+    return (left > right) - (left < right);
+}
+
+// Find where the run of sorted rows starting at rows[0] stops belonging to this leaf
+// Keys above a leaf's max key are routed to a later leaf, unless it's the last one
+uint32_t leafRunLength(void* node, Row* rows, uint32_t numRows) {
+    if (*leafNodeNextLeaf(node) == 0) {
+        return numRows;
+    }
+    // A leaf emptied by deletes has no max key, but the first row was routed to it
+    if (*leafNodeNumCells(node) == 0) {
+        return 1;
+    }
+
+    uint32_t maxKey = *leafNodeKey(node, *leafNodeNumCells(node) - 1);
+    uint32_t length = 0;
+    while (length < numRows && rows[length].id <= maxKey) {
+        length++;
+    }
+    return length;
+}
+
+// Insert many rows with one descent per leaf instead of one per row
+// Rows are sorted by key, then every run that lands in the same leaf is merged
+// into it in a single pass that moves each existing cell at most once
+ExecuteResult executeInsertBatch(Statement* statement, Table* table) {
+    // Sort a copy, since parameters are bound into the statement's rows by position
+    uint32_t numRows = statement->num_rows;
+    Row* rows = malloc(numRows * sizeof(Row));
+    memcpy(rows, statement->rows, numRows * sizeof(Row));
+    qsort(rows, numRows, sizeof(Row), compareRows);
+
+    ExecuteResult result = insertSortedRows(table, rows, numRows);
+    free(rows);
+    return result;
+}
+
+ExecuteResult insertSortedRows(Table* table, Row* rows, uint32_t numRows) {
+    Pager* pager = table->pager;
+
+    for (uint32_t i = 1; i < numRows; i++) {
+        if (rows[i].id == rows[i - 1].id) {
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    // Check every key before changing anything, so a duplicate rejects the whole batch
+    for (uint32_t i = 0; i < numRows;) {
+        uint32_t mark = pagerPinMark();
+        Cursor cursor;
+        tableFind(table, rows[i].id, &cursor);
+        void* node = getPage(pager, cursor.page_num);
+        uint32_t runLength = leafRunLength(node, &rows[i], numRows - i);
+
+        for (uint32_t j = i; j < i + runLength; j++) {
+            uint32_t cell = leafNodeFindCell(node, rows[j].id);
+            bool duplicate = cell < *leafNodeNumCells(node) && *leafNodeKey(node, cell) == rows[j].id;
+            if (duplicate) {
+                return EXECUTE_DUPLICATE_KEY;
+            }
+        }
+
+        pagerUnpinTo(mark);
+        i += runLength;
+    }
+
+    for (uint32_t i = 0; i < numRows;) {
+        uint32_t mark = pagerPinMark();
+        Cursor cursor;
+        tableFind(table, rows[i].id, &cursor);
+        uint32_t pageNum = cursor.page_num;
+        void* node = getPage(pager, pageNum);
+        uint32_t numCells = *leafNodeNumCells(node);
+        uint32_t runLength = leafRunLength(node, &rows[i], numRows - i);
+
+        // Take as much of the run as the free space holds
+        uint32_t freeSpace = leafNodeFreeSpace(node);
+        uint32_t count = 0;
+        while (count < runLength && LEAF_NODE_SLOT_SIZE + rowValueSize(&rows[i + count]) <= freeSpace) {
+            freeSpace -= LEAF_NODE_SLOT_SIZE + rowValueSize(&rows[i + count]);
+            count++;
+        }
+
+        if (count == 0) {
+            // Leaf is full. Let a normal insert split it, then carry on with the halves
+            insertLeafNode(&cursor, rows[i].id, &rows[i]);
+            pagerUnpinTo(mark);
+            i++;
+            continue;
+        }
+
+        // Merge slots from the back so every existing one is shifted only once.
+        // New values are added to the content area, existing ones don't move
+        int32_t existing = (int32_t) numCells - 1;
+        int32_t incoming = (int32_t) count - 1;
+        uint32_t destination = numCells + count - 1;
+        while (incoming >= 0) {
+            if (existing >= 0 && *leafNodeKey(node, existing) > rows[i + incoming].id) {
+                memcpy(leafNodeSlot(node, destination), leafNodeSlot(node, existing), LEAF_NODE_SLOT_SIZE);
+                existing--;
+            } else {
+                uint32_t valueSize = rowValueSize(&rows[i + incoming]);
+                *leafNodeContentStart(node) -= valueSize;
+                serializeRow(&rows[i + incoming], (uint8_t*) node + *leafNodeContentStart(node));
+                *leafNodeKey(node, destination) = rows[i + incoming].id;
+                *leafNodeValueOffset(node, destination) = *leafNodeContentStart(node);
+                *leafNodeValueSize(node, destination) = valueSize;
+                incoming--;
+            }
+            destination--;
+        }
+
+        *leafNodeNumCells(node) = numCells + count;
+        pagerMarkDirty(pager, pageNum);
+        pagerUnpinTo(mark);
+        i += count;
+    }
+
+    for (uint32_t i = 0; i < numRows; i++) {
+        uint32_t mark = pagerPinMark();
+        indexRow(table, &rows[i]);
+        pagerUnpinTo(mark);
+    }
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult executeInsert(Statement* statement, Table* table) {
+    if (statement->rows != NULL) {
+        return executeInsertBatch(statement, table);
+    }
+
+    Row* rowToInsert = &(statement->row_to_insert);
+    uint32_t keyToInsert = rowToInsert->id;
+    Cursor cursor;
+    tableFind(table, keyToInsert, &cursor);
+
+    void* node = getPage(table->pager, cursor.page_num);
+    uint32_t numCells = *leafNodeNumCells(node);
+
+    if (cursor.cell_num < numCells) {
+        uint32_t keyAtIndex = *leafNodeKey(node, cursor.cell_num);
+        if (keyAtIndex == keyToInsert) {
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    // serializeRow(rowToInsert, rowSlot(table, table->num_rows));
+    insertLeafNode(&cursor, rowToInsert->id, rowToInsert);
+    indexRow(table, rowToInsert);
+    
+    return EXECUTE_SUCCESS;
+}
+
+/*
+
+Secondary indexes
+
+An index is a second B-tree in the same file, built from the same nodes as the
+table. Its keys are 32-bit hashes of the column value and its values are ids, so
+a lookup seeks to the hash and reads the run of equal keys. Hashes can collide,
+which is why every row found that way is still compared against the value.
+
+*/
+
+uint32_t indexKey(const char* value) {
+    uint64_t hash = hashText(value);
+    return (uint32_t) (hash ^ (hash >> 32));
+}
+
+Table* openIndex(Table* table, uint32_t rootPageNum) {
+    Table* index = calloc(1, sizeof(Table));
+    index->pager = table->pager;
+    index->root_page_num = rootPageNum;
+    return index;
+}
+
+// Add an entry ahead of any others with the same key. Pages are left pinned for the caller
+void indexInsert(Table* index, uint32_t key, uint32_t id) {
+    Cursor cursor;
+    tableFind(index, key, &cursor);
+    leafNodeInsertCell(&cursor, key, &id, sizeof(id));
+}
+
+// Add a newly inserted row to every index on the table
+void indexRow(Table* table, Row* row) {
+    for (uint32_t column = 0; column < TEXT_COLUMNS; column++) {
+        if (table->indexes[column] != NULL) {
+            indexInsert(table->indexes[column], indexKey(rowColumn(row, column)), row->id);
+        }
+    }
+}
+
+int compareIndexEntries(const void* a, const void* b) {
+    uint64_t left = *(uint64_t*) a;
+    uint64_t right = *(uint64_t*) b;
+    return (left > right) - (left < right);
+}
+
+// Add every row in the table to a new index. Entries are sorted first, so
+// the inserts work their way through the index from left to right
+void indexPopulate(Table* table, Table* index, TextColumn column) {
+    uint64_t* entries = NULL;
+    uint32_t numEntries = 0;
+    uint32_t capacity = 0;
+
+    Cursor* cursor = tableStart(table);
+    Row row;
+    while (!(cursor->end_of_table)) {
+        if (numEntries == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            entries = realloc(entries, capacity * sizeof(uint64_t));
+        }
+        cursorRow(cursor, &row);
+        entries[numEntries++] = (uint64_t) indexKey(rowColumn(&row, column)) << 32 | row.id;
+        incrementCursor(cursor);
+    }
+    free(cursor);
+
+    qsort(entries, numEntries, sizeof(uint64_t), compareIndexEntries);
+    for (uint32_t i = numEntries; i > 0; i--) {
+        // Each insert goes in front of its equal keys, so ids come out ascending
+        uint32_t mark = pagerPinMark();
+        indexInsert(index, (uint32_t) (entries[i - 1] >> 32), (uint32_t) entries[i - 1]);
+        pagerUnpinTo(mark);
+    }
+    free(entries);
+}
+
+// Give the index a root page, record it in the header page and fill it in
+ExecuteResult executeCreateIndex(Statement* statement, Table* table) {
+    Pager* pager = table->pager;
+    TextColumn column = statement->index_column;
+    if (table->indexes[column] != NULL) {
+        return EXECUTE_INDEX_EXISTS;
+    }
+
+    uint32_t mark = pagerPinMark();
+    uint32_t rootPageNum = getUnusedPageNum(pager);
+    void* root = getPage(pager, rootPageNum);
+    initializeLeafNode(root);
+    setNodeRoot(root, true);
+    pagerMarkDirty(pager, rootPageNum);
+
+    void* header = getPage(pager, HEADER_PAGE_NUM);
+    *headerIndexRoot(header, column) = rootPageNum;
+    pagerMarkDirty(pager, HEADER_PAGE_NUM);
+    pagerUnpinTo(mark);
+
+    Table* index = openIndex(table, rootPageNum);
+    indexPopulate(table, index, column);
+    // Selects on other threads pick the index up once it's complete
+    __atomic_store_n(&table->indexes[column], index, __ATOMIC_RELEASE);
+    return EXECUTE_SUCCESS;
+}
+
+// Point lookup of a single row by id
+bool tableGetRow(Table* table, uint32_t id, Row* row) {
+    uint32_t mark = pagerPinMark();
+    uint32_t pageNum;
+    void* node = descendToLeaf(table, id, &pageNum, NULL, 0);
+
+    uint32_t cell = leafNodeFindCell(node, id);
+    bool found = cell < *leafNodeNumCells(node) && *leafNodeKey(node, cell) == id;
+    if (found) {
+        row->id = id;
+        deserializeRow(leafNodeValue(node, cell), row);
+    }
+    pagerUnpinTo(mark);
+    return found;
+}
+
+bool rowMatches(Statement* statement, Row* row) {
+    for (uint32_t column = 0; column < TEXT_COLUMNS; column++) {
+        if (statement->match_columns[column]
+            && strcmp(rowColumn(row, column), rowColumn(&statement->match, column)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Open the cursor a select reads rows through. A value to match on an indexed
+// column is looked up in its index, anything else scans the range of ids
+void selectOpen(PreparedStatement* prepared) {
+    Statement* statement = &prepared->statement;
+    Table* table = prepared->table;
+
+    pagerBeginScan(table->pager);
+    if (prepared->snapshot == NULL) {
+        prepared->snapshot = malloc(PAGE_SIZE);
+    }
+    prepared->index = NULL;
+    for (uint32_t column = 0; column < TEXT_COLUMNS; column++) {
+        Table* index = __atomic_load_n(&table->indexes[column], __ATOMIC_ACQUIRE);
+        if (statement->match_columns[column] && index != NULL) {
+            prepared->index = index;
+            prepared->index_key = indexKey(rowColumn(&statement->match, column));
+            prepared->cursor = &prepared->scan_cursor;
+            tableSeekInto(index, prepared->index_key, (uint64_t) prepared->index_key + 1, prepared->cursor, prepared->snapshot);
+            return;
+        }
+    }
+
+    // Leaves are only read ahead as far as the range goes
+    prepared->cursor = &prepared->scan_cursor;
+    tableSeekInto(table, (uint32_t) statement->range_low, statement->range_high, prepared->cursor, prepared->snapshot);
+}
+
+void selectClose(PreparedStatement* prepared) {
+    if (prepared->cursor != NULL) {
+        prepared->cursor = NULL;
+        pagerEndScan(prepared->table->pager);
+    }
+}
+
+// Move the open cursor on to the next row the select returns and copy it out
+bool selectNextRow(PreparedStatement* prepared, Row* row) {
+    Statement* statement = &prepared->statement;
+    Cursor* cursor = prepared->cursor;
+
+    while (!(cursor->end_of_table)) {
+        if (prepared->index != NULL) {
+            if (cursorKey(cursor) != prepared->index_key) {
+                return false;
+            }
+            uint32_t id;
+            memcpy(&id, cursorValue(cursor), sizeof(id));
+            incrementCursor(cursor);
+            // The row may have gone since the index was read
+            if (id < statement->range_low || id >= statement->range_high
+                || !tableGetRow(prepared->table, id, row)) {
+                continue;
+            }
+        } else {
+            if (cursorKey(cursor) >= statement->range_high) {
+                return false;
+            }
+            cursorRow(cursor, row);
+            incrementCursor(cursor);
+        }
+
+        if (rowMatches(statement, row)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+
+Delete
+
+A delete walks its range one leaf at a time. It keeps the whole path from the root
+to the leaf latched, since taking cells out can ripple all the way back up: a leaf
+left less than a third full is merged into its neighbour under the same parent when
+the two fit in one page, or evens its cells out with it when they don't. A merge
+takes a child away from the parent, which may leave that underfull in turn, and a
+root left with a single child takes over that child's contents so the tree gets a
+level shorter. Merged away pages go on the freelist.
+
+Open scans read copies of leaves and follow the next leaf pointers in them, so cells
+moving between leaves could show them a row twice or not at all, and a freed page
+could be handed out again under them. While any scan is open a delete only takes
+cells out. Leaves it leaves underfull are evened out by a later delete that reaches them.
+
+*/
+#define TREE_MAX_DEPTH 32
+
+// Nodes from the root down to a leaf, each pinned and latched exclusively by the writer
+typedef struct {
+    uint32_t depth;
+    uint32_t pages[TREE_MAX_DEPTH];
+    void* nodes[TREE_MAX_DEPTH];
+    uint32_t positions[TREE_MAX_DEPTH]; // Index of each node among its parent's children
+    uint32_t marks[TREE_MAX_DEPTH];     // Pin mark taken just before each node was fetched
+} TreePath;
+
+void* treePathPush(Table* table, TreePath* path, uint32_t pageNum, uint32_t position) {
+    if (path->depth == TREE_MAX_DEPTH) {
+        printf("Tree is deeper than %d levels. Corrupt file detected\n", TREE_MAX_DEPTH);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t level = path->depth++;
+    path->marks[level] = pagerPinMark();
+    path->pages[level] = pageNum;
+    path->positions[level] = position;
+    path->nodes[level] = getPage(table->pager, pageNum);
+    return path->nodes[level];
+}
+
+// Let go of the nodes from level down, along with anything pinned after them
+void treePathPop(TreePath* path, uint32_t level) {
+    pagerUnpinTo(path->marks[level]);
+    path->depth = level;
+}
+
+// Extend the path from its last node down to the leaf that should hold key
+void* treePathDescend(Table* table, TreePath* path, uint32_t key) {
+    void* node = path->nodes[path->depth - 1];
+    while (getNodeType(node) == NODE_INTERNAL) {
+        uint32_t position = internalNodeFindChild(node, key);
+        node = treePathPush(table, path, *internalNodeChild(node, position), position);
+    }
+    return node;
+}
+
+void* treePathOpen(Table* table, TreePath* path, uint32_t key) {
+    path->depth = 0;
+    treePathPush(table, path, table->root_page_num, 0);
+    return treePathDescend(table, path, key);
+}
+
+// Move the path on to the next leaf. Returns false if it's on the last one
+bool treePathNextLeaf(Table* table, TreePath* path) {
+    for (uint32_t level = path->depth - 1; level > 0; level--) {
+        void* parent = path->nodes[level - 1];
+        if (path->positions[level] < *internalNodeNumKeys(parent)) {
+            uint32_t position = path->positions[level] + 1;
+            treePathPop(path, level);
+            treePathPush(table, path, *internalNodeChild(parent, position), position);
+            // Key 0 takes the first child all the way down
+            treePathDescend(table, path, 0);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Every key in the path's leaf is at or below the key of the nearest ancestor it's not
+// the right child of. Returns false when the leaf is the last one, which has no bound
+bool treePathUpperBound(TreePath* path, uint32_t* bound) {
+    for (uint32_t level = path->depth - 1; level > 0; level--) {
+        void* parent = path->nodes[level - 1];
+        if (path->positions[level] < *internalNodeNumKeys(parent)) {
+            *bound = *internalNodeKey(parent, path->positions[level]);
+            return true;
+        }
+    }
+    return false;
+}
+
+// A leaf is underfull below a third of its space, an internal node below a third of its children
+bool nodeIsUnderfull(void* node) {
+    if (getNodeType(node) == NODE_LEAF) {
+        return 3 * (LEAF_NODE_SPACE_FOR_CELLS - leafNodeFreeSpace(node)) < LEAF_NODE_SPACE_FOR_CELLS;
+    }
+    return 3 * (*internalNodeNumKeys(node) + 1) < INTERNAL_NODE_MAX_CELLS + 1;
+}
+
+// Take the flagged cells out of a leaf. It's rebuilt from a copy, so the values
+// that are left end up packed against the end of the page again
+void leafNodeRemoveCells(void* node, bool* removed) {
+    uint8_t cells[PAGE_SIZE];
+    memcpy(cells, node, PAGE_SIZE);
+
+    *leafNodeNumCells(node) = 0;
+    *leafNodeContentStart(node) = PAGE_SIZE;
+    memset(leafNodeSlot(node, 0), 0, LEAF_NODE_SPACE_FOR_CELLS);
+    for (uint32_t i = 0; i < *leafNodeNumCells(cells); i++) {
+        if (!removed[i]) {
+            leafNodeAppendCell(node, *leafNodeKey(cells, i), leafNodeValue(cells, i), *leafNodeValueSize(cells, i));
+        }
+    }
+}
+
+// Merge two neighbouring leaves into the left one if all their cells fit, otherwise deal
+// the cells back out so each gets about half of the bytes. Returns true on a merge,
+// otherwise separator receives the left leaf's new max key
+bool leafNodesRebalance(void* left, void* right, uint32_t* separator) {
+    uint8_t* cells = malloc(2 * PAGE_SIZE);
+    memcpy(cells, left, PAGE_SIZE);
+    memcpy(cells + PAGE_SIZE, right, PAGE_SIZE);
+
+    uint32_t totalBytes = 2 * LEAF_NODE_SPACE_FOR_CELLS - leafNodeFreeSpace(left) - leafNodeFreeSpace(right);
+    bool merge = totalBytes <= LEAF_NODE_SPACE_FOR_CELLS;
+
+    for (uint32_t half = 0; half < 2; half++) {
+        void* node = half == 0 ? left : right;
+        *leafNodeNumCells(node) = 0;
+        *leafNodeContentStart(node) = PAGE_SIZE;
+        memset(leafNodeSlot(node, 0), 0, LEAF_NODE_SPACE_FOR_CELLS);
+    }
+
+    uint32_t leftBytes = 0;
+    void* destination = left;
+    for (uint32_t half = 0; half < 2; half++) {
+        void* source = cells + half * PAGE_SIZE;
+        for (uint32_t i = 0; i < *leafNodeNumCells(source); i++) {
+            uint32_t cellBytes = LEAF_NODE_SLOT_SIZE + *leafNodeValueSize(source, i);
+            if (!merge && destination == left && *leafNodeNumCells(left) > 0
+                && 2 * (leftBytes + cellBytes) > totalBytes) {
+                destination = right;
+            }
+            leftBytes += destination == left ? cellBytes : 0;
+            leafNodeAppendCell(destination, *leafNodeKey(source, i), leafNodeValue(source, i),
+                               *leafNodeValueSize(source, i));
+        }
+    }
+    free(cells);
+
+    if (merge) {
+        *leafNodeNextLeaf(left) = *leafNodeNextLeaf(right);
+    } else {
+        *separator = *leafNodeKey(left, *leafNodeNumCells(left) - 1);
+    }
+    return merge;
+}
+
+// Same for two neighbouring internal nodes, counting children instead of bytes
+// separator is the left node's key in the parent going in, and its new one coming out
+bool internalNodesRebalance(Table* table, uint32_t leftPageNum, void* left, uint32_t rightPageNum, void* right,
+                            uint32_t* separator) {
+    Pager* pager = table->pager;
+    uint32_t children[2 * INTERNAL_NODE_MAX_CELLS + 2];
+    uint32_t keys[2 * INTERNAL_NODE_MAX_CELLS + 2];
+    uint32_t count = 0;
+
+    // The left node's right child has no key of its own, its bound is the separator
+    uint32_t leftKeys = *internalNodeNumKeys(left);
+    for (uint32_t i = 0; i <= leftKeys; i++) {
+        children[count] = *internalNodeChild(left, i);
+        keys[count++] = i < leftKeys ? *internalNodeKey(left, i) : *separator;
+    }
+    uint32_t rightKeys = *internalNodeNumKeys(right);
+    for (uint32_t i = 0; i <= rightKeys; i++) {
+        children[count] = *internalNodeChild(right, i);
+        keys[count++] = i < rightKeys ? *internalNodeKey(right, i) : 0;
+    }
+
+    bool merge = count <= INTERNAL_NODE_MAX_CELLS + 1;
+    uint32_t leftCount = merge ? count : count / 2;
+
+    *internalNodeNumKeys(left) = leftCount - 1;
+    for (uint32_t i = 0; i < leftCount - 1; i++) {
+        *internalNodeCell(left, i) = children[i];
+        *internalNodeKey(left, i) = keys[i];
+    }
+    *internalNodeRightChild(left) = children[leftCount - 1];
+
+    if (!merge) {
+        *internalNodeNumKeys(right) = count - leftCount - 1;
+        for (uint32_t i = 0; i < count - leftCount - 1; i++) {
+            *internalNodeCell(right, i) = children[leftCount + i];
+            *internalNodeKey(right, i) = keys[leftCount + i];
+        }
+        *internalNodeRightChild(right) = children[count - 1];
+        *separator = keys[leftCount - 1];
+    }
+
+    // Children that changed sides need their parent pointers fixed up
+    for (uint32_t i = 0; i < count; i++) {
+        bool wasLeft = i <= leftKeys;
+        bool isLeft = i < leftCount;
+        if (wasLeft != isLeft) {
+            uint32_t mark = pagerPinMark();
+            *nodeParent(getPage(pager, children[i])) = isLeft ? leftPageNum : rightPageNum;
+            pagerMarkDirty(pager, children[i]);
+            pagerUnpinTo(mark);
+        }
+    }
+    return merge;
+}
+
+// Drop the child at position after it was merged into the one before it,
+// which takes over its key
+void internalNodeRemoveMergedChild(void* node, uint32_t position) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    *internalNodeChild(node, position) = *internalNodeChild(node, position - 1);
+    memmove(internalNodeCell(node, position - 1), internalNodeCell(node, position),
+            (numKeys - position) * INTERNAL_NODE_CELL_SIZE);
+    *internalNodeNumKeys(node) = numKeys - 1;
+}
+
+// A root left with a single child takes over its contents, since the root has to
+// keep its page number, and the tree is a level shorter
+void collapseRoot(Table* table, void* root) {
+    Pager* pager = table->pager;
+
+    while (getNodeType(root) == NODE_INTERNAL && *internalNodeNumKeys(root) == 0) {
+        uint32_t mark = pagerPinMark();
+        uint32_t childPageNum = *internalNodeRightChild(root);
+        memcpy(root, getPage(pager, childPageNum), PAGE_SIZE);
+        setNodeRoot(root, true);
+        pagerMarkDirty(pager, table->root_page_num);
+
+        if (getNodeType(root) == NODE_INTERNAL) {
+            for (uint32_t i = 0; i <= *internalNodeNumKeys(root); i++) {
+                uint32_t childMark = pagerPinMark();
+                uint32_t grandchildPageNum = *internalNodeChild(root, i);
+                *nodeParent(getPage(pager, grandchildPageNum)) = table->root_page_num;
+                pagerMarkDirty(pager, grandchildPageNum);
+                pagerUnpinTo(childMark);
+            }
+        }
+        freePage(pager, childPageNum);
+        pagerUnpinTo(mark);
+    }
+}
+
+// Work back up the path from a leaf that just lost cells, merging or evening out
+// every node left underfull with its neighbour
+void treePathRebalance(Table* table, TreePath* path) {
+    Pager* pager = table->pager;
+
+    for (uint32_t level = path->depth - 1; level > 0; level--) {
+        void* parent = path->nodes[level - 1];
+        uint32_t parentPageNum = path->pages[level - 1];
+        if (!nodeIsUnderfull(path->nodes[level]) || *internalNodeNumKeys(parent) == 0) {
+            break;
+        }
+
+        // Pair the node with the one before it, or the one after it if it's the first child
+        uint32_t position = path->positions[level] > 0 ? path->positions[level] - 1 : 0;
+        uint32_t leftPageNum = *internalNodeChild(parent, position);
+        uint32_t rightPageNum = *internalNodeChild(parent, position + 1);
+        void* left = getPage(pager, leftPageNum);
+        void* right = getPage(pager, rightPageNum);
+        pagerMarkDirty(pager, leftPageNum);
+        pagerMarkDirty(pager, rightPageNum);
+        pagerMarkDirty(pager, parentPageNum);
+
+        uint32_t separator = *internalNodeKey(parent, position);
+        bool merged = getNodeType(left) == NODE_LEAF
+                      ? leafNodesRebalance(left, right, &separator)
+                      : internalNodesRebalance(table, leftPageNum, left, rightPageNum, right, &separator);
+        if (!merged) {
+            // Nothing was taken away from the parent, so nothing above changes either
+            *internalNodeKey(parent, position) = separator;
+            break;
+        }
+        internalNodeRemoveMergedChild(parent, position + 1);
+        freePage(pager, rightPageNum);
+    }
+
+    collapseRoot(table, path->nodes[0]);
+}
+
+// Take one entry out of an index. Its key may run on over several leaves, so they're
+// searched from the first for the id
+void indexDelete(Table* index, uint32_t key, uint32_t id) {
+    TreePath path;
+    void* node = treePathOpen(index, &path, key);
+    bool rebalance = !pagerScansOpen(index->pager);
+    uint32_t cell = leafNodeFindCell(node, key);
+
+    while (true) {
+        if (cell == *leafNodeNumCells(node)) {
+            if (!treePathNextLeaf(index, &path)) {
+                break;
+            }
+            node = path.nodes[path.depth - 1];
+            cell = 0;
+            continue;
+        }
+        if (*leafNodeKey(node, cell) != key) {
+            break;
+        }
+
+        uint32_t entry;
+        memcpy(&entry, leafNodeValue(node, cell), sizeof(entry));
+        if (entry == id) {
+            bool removed[LEAF_NODE_MAX_CELLS];
+            memset(removed, 0, sizeof(removed));
+            removed[cell] = true;
+            leafNodeRemoveCells(node, removed);
+            pagerMarkDirty(index->pager, path.pages[path.depth - 1]);
+            if (rebalance) {
+                treePathRebalance(index, &path);
+            }
+            break;
+        }
+        cell++;
+    }
+    treePathPop(&path, 0);
+}
+
+// Index entries a statement adds or removes once it's done with the table, as key << 32 | id
+typedef struct {
+    uint64_t* entries;
+    uint32_t count;
+    uint32_t capacity;
+} IndexEntries;
+
+void indexEntriesPush(IndexEntries* list, uint32_t key, uint32_t id) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 1024 : list->capacity * 2;
+        list->entries = realloc(list->entries, list->capacity * sizeof(uint64_t));
+    }
+    list->entries[list->count++] = (uint64_t) key << 32 | id;
+}
+
+// Sorted first, like when an index is populated, so the index is worked through from left
+// to right. The list is freed
+void indexRemoveEntries(Table* index, IndexEntries* list) {
+    if (list->count > 0) {
+        qsort(list->entries, list->count, sizeof(uint64_t), compareIndexEntries);
+    }
+    for (uint32_t i = 0; i < list->count; i++) {
+        indexDelete(index, (uint32_t) (list->entries[i] >> 32), (uint32_t) list->entries[i]);
+    }
+    free(list->entries);
+}
+
+// Remove every row in the key range that matches the statement's column values,
+// then their index entries
+ExecuteResult executeDelete(Statement* statement, Table* table) {
+    IndexEntries removedEntries[TEXT_COLUMNS];
+    memset(removedEntries, 0, sizeof(removedEntries));
+
+    resolveKeyRange(statement);
+    uint64_t key = statement->range_low;
+    while (key < statement->range_high) {
+        TreePath path;
+        void* node = treePathOpen(table, &path, (uint32_t) key);
+        // Scans that start from here on wait behind the root latch, so none can slip in
+        bool rebalance = !pagerScansOpen(table->pager);
+
+        bool removed[LEAF_NODE_MAX_CELLS];
+        memset(removed, 0, sizeof(removed));
+        bool changed = false;
+        uint32_t numCells = *leafNodeNumCells(node);
+        uint32_t cell = leafNodeFindCell(node, (uint32_t) key);
+        for (; cell < numCells && *leafNodeKey(node, cell) < statement->range_high; cell++) {
+            Row row;
+            row.id = *leafNodeKey(node, cell);
+            deserializeRow(leafNodeValue(node, cell), &row);
+            if (!rowMatches(statement, &row)) {
+                continue;
+            }
+            removed[cell] = true;
+            changed = true;
+
+            for (uint32_t column = 0; column < TEXT_COLUMNS; column++) {
+                if (table->indexes[column] != NULL) {
+                    indexEntriesPush(&removedEntries[column], indexKey(rowColumn(&row, column)), row.id);
+                }
+            }
+        }
+
+        // Carry on past this leaf, unless the range ended inside it or it's the last one
+        uint32_t bound;
+        if (cell < numCells || !treePathUpperBound(&path, &bound)) {
+            key = statement->range_high;
+        } else {
+            key = (uint64_t) bound + 1;
+        }
+
+        if (changed) {
+            leafNodeRemoveCells(node, removed);
+            pagerMarkDirty(table->pager, path.pages[path.depth - 1]);
+            if (rebalance) {
+                treePathRebalance(table, &path);
+            }
+        }
+        treePathPop(&path, 0);
+    }
+
+    for (uint32_t column = 0; column < TEXT_COLUMNS; column++) {
+        if (table->indexes[column] != NULL) {
+            indexRemoveEntries(table->indexes[column], &removedEntries[column]);
+        }
+    }
+    return EXECUTE_SUCCESS;
+}
+
+/*
+
+Update
+
+An update rewrites values where they lie. Ids can't change, so a row never moves to
+another leaf: a value of the same size is written over the old one, and one of a
+different size is put back in the same leaf's content area as long as it has room.
+Only a value that outgrows its leaf falls back on a split.
+
+*/
+
+// Give a cell a new value. Values below the old one move up to close the gap it leaves,
+// so free space stays in one piece. Returns false if the leaf doesn't have room for it
+bool leafNodeReplaceValue(void* node, uint32_t cellNum, void* value, uint32_t valueSize) {
+    uint32_t oldSize = *leafNodeValueSize(node, cellNum);
+    if (valueSize == oldSize) {
+        memcpy(leafNodeValue(node, cellNum), value, valueSize);
+        return true;
+    }
+    if (leafNodeFreeSpace(node) + oldSize < valueSize) {
+        return false;
+    }
+
+    uint8_t* bytes = node;
+    uint16_t oldOffset = *leafNodeValueOffset(node, cellNum);
+    uint16_t oldStart = *leafNodeContentStart(node);
+    memmove(bytes + oldStart + oldSize, bytes + oldStart, oldOffset - oldStart);
+    for (uint32_t i = 0; i < *leafNodeNumCells(node); i++) {
+        if (*leafNodeValueOffset(node, i) < oldOffset) {
+            *leafNodeValueOffset(node, i) += oldSize;
+        }
+    }
+
+    uint16_t contentStart = oldStart + oldSize - valueSize;
+    memcpy(bytes + contentStart, value, valueSize);
+    *leafNodeValueOffset(node, cellNum) = contentStart;
+    *leafNodeValueSize(node, cellNum) = valueSize;
+    *leafNodeContentStart(node) = contentStart;
+    // A smaller value leaves stale bytes behind
+    if (contentStart > oldStart) {
+        memset(bytes + oldStart, 0, contentStart - oldStart);
+    }
+    return true;
+}
+
+// Add the listed entries to the index. The list is freed
+void indexAddEntries(Table* index, IndexEntries* list) {
+    if (list->count > 0) {
+        qsort(list->entries, list->count, sizeof(uint64_t), compareIndexEntries);
+    }
+    for (uint32_t i = 0; i < list->count; i++) {
+        uint32_t mark = pagerPinMark();
+        indexInsert(index, (uint32_t) (list->entries[i] >> 32), (uint32_t) list->entries[i]);
+        pagerUnpinTo(mark);
+    }
+    free(list->entries);
+}
+
+// Set the statement's columns in every row in the key range that matches its where clause
+// The leaves are walked through their sibling links. Only the writer changes the tree,
+// so there's no need to go back through the parent for the next one
+ExecuteResult executeUpdate(Statement* statement, Table* table) {
+    Pager* pager = table->pager;
+    IndexEntries removedEntries[TEXT_COLUMNS];
+    IndexEntries addedEntries[TEXT_COLUMNS];
+    memset(removedEntries, 0, sizeof(removedEntries));
+    memset(addedEntries, 0, sizeof(addedEntries));
+
+    resolveKeyRange(statement);
+    uint64_t key = statement->range_low;
+    while (key < statement->range_high) {
+        uint32_t mark = pagerPinMark();
+        uint32_t pageNum;
+        void* node = descendToLeaf(table, (uint32_t) key, &pageNum, NULL, 0);
+        uint32_t cell = leafNodeFindCell(node, (uint32_t) key);
+        key = statement->range_high;
+
+        while (true) {
+            if (cell == *leafNodeNumCells(node)) {
+                uint32_t nextPageNum = *leafNodeNextLeaf(node);
+                if (nextPageNum == 0) {
+                    break;
+                }
+                pagerUnpinTo(mark);
+                pageNum = nextPageNum;
+                node = getPage(pager, pageNum);
+                cell = 0;
+                continue;
+            }
+
+            Row row;
+            row.id = *leafNodeKey(node, cell);
+            if (row.id >= statement->range_high) {
+                break;
+            }
+            deserializeRow(leafNodeValue(node, cell), &row);
+            if (!rowMatches(statement, &row)) {
+                cell++;
+                continue;
+            }
+
+            Row updated = row;
+            for (uint32_t column = 0; column < TEXT_COLUMNS; column++) {
+                if (!statement->update_columns[column]) {
+                    continue;
+                }
+                char* value = rowColumn(&statement->row_to_insert, column);
+                if (table->indexes[column] != NULL && strcmp(rowColumn(&row, column), value) != 0) {
+                    indexEntriesPush(&removedEntries[column], indexKey(rowColumn(&row, column)), row.id);
+                    indexEntriesPush(&addedEntries[column], indexKey(value), row.id);
+                }
+                strcpy(rowColumn(&updated, column), value);
+            }
+
+            uint8_t serialized[LEAF_NODE_MAX_VALUE_SIZE];
+            uint32_t valueSize = serializeRow(&updated, serialized);
+            if (leafNodeReplaceValue(node, cell, serialized, valueSize)) {
+                pagerMarkDirty(pager, pageNum);
+                cell++;
+                continue;
+            }
+
+            // The leaf is too full for the bigger value. Go down to it again, so the split
+            // has the nodes above it latched, and carry on with the next key afterwards
+            pagerUnpinTo(mark);
+            Cursor cursor;
+            tableFind(table, row.id, &cursor);
+            void* leaf = getPage(pager, cursor.page_num);
+            bool removed[LEAF_NODE_MAX_CELLS];
+            memset(removed, 0, sizeof(removed));
+            removed[cursor.cell_num] = true;
+            leafNodeRemoveCells(leaf, removed);
+            pagerMarkDirty(pager, cursor.page_num);
+            leafNodeInsertCell(&cursor, row.id, serialized, valueSize);
+            key = (uint64_t) row.id + 1;
+            break;
+        }
+        pagerUnpinTo(mark);
+    }
+
+    for (uint32_t column = 0; column < TEXT_COLUMNS; column++) {
+        if (table->indexes[column] != NULL) {
+            indexRemoveEntries(table->indexes[column], &removedEntries[column]);
+            indexAddEntries(table->indexes[column], &addedEntries[column]);
+        }
+    }
+    return EXECUTE_SUCCESS;
+}
+
+/*
+
+Aggregates
+
+count(*) and sum(id) read the keys of one leaf at a time, straight out of the page
+under its latch, and fold them in with a vector kernel. Rows are never decoded.
+min(id) and max(id) don't scan at all: they descend to the edges of the range.
+
+*/
+typedef uint32_t KeyLanes __attribute__((vector_size(16)));
+typedef uint64_t WideLanes __attribute__((vector_size(32)));
+#define KEY_LANES (sizeof(KeyLanes) / sizeof(uint32_t))
+
+// Count and sum the keys in [low, last], KEY_LANES at a time without branching on them
+// keys is padded to a whole number of vectors. Lanes past numKeys are masked off
+void leafKeyTotals(const uint32_t* keys, uint32_t numKeys, uint32_t low, uint32_t last,
+                   uint64_t* count, uint64_t* sum) {
+    const KeyLanes laneIndex = { 0, 1, 2, 3 };
+    KeyLanes counts = { 0 };
+    WideLanes sums = { 0 };
+
+    for (uint32_t i = 0; i < numKeys; i += KEY_LANES) {
+        KeyLanes lanes;
+        memcpy(&lanes, &keys[i], sizeof(lanes));
+        // Comparisons give -1 in every lane that passes
+        KeyLanes mask = (KeyLanes) ((lanes >= low) & (lanes <= last) & (laneIndex + i < numKeys));
+        counts -= mask;
+        sums += __builtin_convertvector(lanes & mask, WideLanes);
+    }
+
+    for (uint32_t lane = 0; lane < KEY_LANES; lane++) {
+        *count += counts[lane];
+        *sum += sums[lane];
+    }
+}
+
+// Count and sum every key in [low, high). The caller makes sure the range isn't empty
+void aggregateKeys(Table* table, uint64_t low, uint64_t high, uint64_t* count, uint64_t* sum) {
+    Pager* pager = table->pager;
+    uint32_t last = (uint32_t) (high - 1);
+    uint32_t keys[(LEAF_NODE_MAX_CELLS + KEY_LANES - 1) / KEY_LANES * KEY_LANES];
+
+    uint32_t mark = pagerPinMark();
+    uint32_t pageNum;
+    void* node = descendToLeaf(table, (uint32_t) low, &pageNum, NULL, high);
+
+    while (true) {
+        uint32_t numCells = *leafNodeNumCells(node);
+        for (uint32_t i = 0; i < numCells; i++) {
+            keys[i] = *leafNodeKey(node, i);
+        }
+        uint32_t nextPageNum = *leafNodeNextLeaf(node);
+        pagerUnpinTo(mark);
+
+        leafKeyTotals(keys, numCells, (uint32_t) low, last, count, sum);
+
+        // Keys only grow to the right. Page 0 is always the root, so it marks the last leaf
+        if ((numCells > 0 && keys[numCells - 1] >= last) || nextPageNum == 0) {
+            return;
+        }
+        if (numCells > 0) {
+            tableReadAhead(table, nextPageNum, keys[numCells - 1], high);
+        }
+        node = getPage(pager, nextPageNum);
+    }
+}
+
+// Smallest key in [low, high)
+bool tableMinKey(Table* table, uint64_t low, uint64_t high, uint32_t* key) {
+    Cursor* cursor = tableSeekRange(table, (uint32_t) low, high);
+    bool found = !(cursor->end_of_table) && cursorKey(cursor) < high;
+    if (found) {
+        *key = cursorKey(cursor);
+    }
+    free(cursor);
+    return found;
+}
+
+// Largest key in [low, high). Descend towards high - 1, down the right edge of the tree
+// when the range is unbounded. If nothing in that leaf is small enough, every candidate
+// sits at or below the leaf's fence, so go again from there
+bool tableMaxKey(Table* table, uint64_t low, uint64_t high, uint32_t* key) {
+    uint64_t bound = high;
+
+    while (bound > low) {
+        uint32_t mark = pagerPinMark();
+        uint32_t pageNum;
+        int64_t fence;
+        void* node = descendToLeaf(table, (uint32_t) (bound - 1), &pageNum, &fence, 0);
+
+        uint32_t numCells = *leafNodeNumCells(node);
+        uint32_t cell = bound > UINT32_MAX ? numCells : leafNodeFindCell(node, (uint32_t) bound);
+        uint32_t candidate = cell > 0 ? *leafNodeKey(node, cell - 1) : 0;
+        pagerUnpinTo(mark);
+
+        if (cell > 0) {
+            *key = candidate;
+            return candidate >= low;
+        }
+        if (fence < 0) {
+            return false;
+        }
+        bound = (uint64_t) fence + 1;
+    }
+    return false;
+}
+
+// Aggregates of a select that also matches column values. The keys alone can't
+// answer those, so the rows are read like a plain select would
+void executeAggregateRows(PreparedStatement* prepared) {
+    Statement* statement = &prepared->statement;
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+
+    if (statement->range_low < statement->range_high) {
+        Row row;
+        selectOpen(prepared);
+        while (selectNextRow(prepared, &row)) {
+            count++;
+            sum += row.id;
+            min = row.id < min ? row.id : min;
+            max = row.id > max ? row.id : max;
+        }
+        selectClose(prepared);
+    }
+
+    for (uint32_t i = 0; i < statement->num_aggregates; i++) {
+        uint64_t values[] = { count, sum, min, max };
+        statement->aggregate_values[i] = count > 0 ? values[statement->aggregates[i]] : 0;
+        statement->aggregate_null[i] = count == 0 && statement->aggregates[i] != AGGREGATE_COUNT;
+    }
+}
+
+void executeAggregates(Statement* statement, Table* table) {
+    uint64_t low = statement->range_low;
+    uint64_t high = statement->range_high;
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    bool totaled = false;
+
+    for (uint32_t i = 0; i < statement->num_aggregates; i++) {
+        AggregateFunction function = statement->aggregates[i];
+        uint64_t* value = &statement->aggregate_values[i];
+        bool* null = &statement->aggregate_null[i];
+        *value = 0;
+        *null = false;
+
+        if (low >= high) {
+            *null = function != AGGREGATE_COUNT;
+            continue;
+        }
+
+        if (function == AGGREGATE_COUNT || function == AGGREGATE_SUM) {
+            // Both come out of the same pass
+            if (!totaled) {
+                aggregateKeys(table, low, high, &count, &sum);
+                totaled = true;
+            }
+            *value = function == AGGREGATE_COUNT ? count : sum;
+            *null = function == AGGREGATE_SUM && count == 0;
+        } else {
+            uint32_t key;
+            bool found = function == AGGREGATE_MIN ? tableMinKey(table, low, high, &key)
+                                                   : tableMaxKey(table, low, high, &key);
+            *value = found ? key : 0;
+            *null = !found;
+        }
+    }
+}
+
+/*
+
+Library API
+
+*/
+
+// FNV-1a, only used to skip string compares in the statement cache
+uint64_t hashText(const char* text) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const uint8_t* byte = (const uint8_t*) text; *byte != 0; byte++) {
+        hash = (hash ^ *byte) * 1099511628211ull;
+    }
+    return hash;
+}
+
+void destroyPreparedStatement(PreparedStatement* prepared) {
+    selectClose(prepared);
+    closeStatement(&prepared->statement);
+    free(prepared->snapshot);
+    free(prepared->sql);
+    free(prepared);
+}
+
+// Take an idle statement with exactly this text out of the cache, or return NULL
+// The cache is small enough that a scan comparing hashes beats maintaining an index
+PreparedStatement* statementCacheTake(Table* table, const char* sql, uint64_t hash) {
+    for (uint32_t i = 0; i < STATEMENT_CACHE_SIZE; i++) {
+        CachedStatement* entry = &table->statement_cache[i];
+        if (entry->statement == NULL || entry->hash != hash || strcmp(entry->statement->sql, sql) != 0) {
+            continue;
+        }
+
+        PreparedStatement* prepared = entry->statement;
+        entry->statement = NULL;
+        for (uint32_t j = 0; j < prepared->statement.num_params; j++) {
+            prepared->statement.params[j].bound = false;
+        }
+        table->statement_cache_hits++;
+        return prepared;
+    }
+
+    table->statement_cache_misses++;
+    return NULL;
+}
+
+// Park a finalized statement in an empty slot, or in place of the least recently used one
+void statementCachePut(Table* table, PreparedStatement* prepared) {
+    CachedStatement* victim = &table->statement_cache[0];
+    for (uint32_t i = 0; i < STATEMENT_CACHE_SIZE; i++) {
+        CachedStatement* entry = &table->statement_cache[i];
+        if (entry->statement == NULL) {
+            victim = entry;
+            break;
+        }
+        if (entry->last_used < victim->last_used) {
+            victim = entry;
+        }
+    }
+
+    if (victim->statement != NULL) {
+        destroyPreparedStatement(victim->statement);
+    }
+    victim->statement = prepared;
+    victim->hash = prepared->hash;
+    victim->last_used = ++table->statement_clock;
+}
+
+PrepareResult dbPrepare(Table* table, const char* sql, PreparedStatement** prepared) {
+    uint64_t hash = hashText(sql);
+    pthread_mutex_lock(&table->statement_cache_mutex);
+    PreparedStatement* statement = statementCacheTake(table, sql, hash);
+    pthread_mutex_unlock(&table->statement_cache_mutex);
+    if (statement != NULL) {
+        *prepared = statement;
+        return PREPARE_SUCCESS;
+    }
+
+    statement = malloc(sizeof(PreparedStatement));
+    statement->table = table;
+    statement->sql = strdup(sql);
+    statement->hash = hash;
+    statement->cursor = NULL;
+    statement->snapshot = NULL;
+    statement->index = NULL;
+    statement->done = false;
+
+    // Parsing tokenizes the text in place, so it works on a scratch copy
+    // Everything it keeps is copied out into the Statement
+    char* scratch = strdup(sql);
+    PrepareResult result = prepareStatement(scratch, &statement->statement);
+    free(scratch);
+
+    if (result != PREPARE_SUCCESS) {
+        destroyPreparedStatement(statement);
+        *prepared = NULL;
+        return result;
+    }
+
+    *prepared = statement;
+    return PREPARE_SUCCESS;
+}
+
+// Parameters are numbered from 1
+Param* preparedParam(PreparedStatement* prepared, uint32_t index) {
+    if (index == 0 || index > prepared->statement.num_params) {
+        return NULL;
+    }
+    return &prepared->statement.params[index - 1];
+}
+
+Row* paramRow(Statement* statement, Param* param) {
+    if (param->target == PARAM_SET_USERNAME || param->target == PARAM_SET_EMAIL) {
+        return &statement->row_to_insert;
+    }
+    if (statement->type != STATEMENT_INSERT) {
+        return &statement->match;
+    }
+    if (statement->rows != NULL) {
+        return &statement->rows[param->index];
+    }
+    return &statement->row_to_insert;
+}
+
+// Bound values stay in place across dbReset. A select picks them up the next time it starts
+PrepareResult dbBindInt(PreparedStatement* prepared, uint32_t index, int64_t value) {
+    Param* param = preparedParam(prepared, index);
+    if (param == NULL || (param->target != PARAM_ID && param->target != PARAM_KEY)) {
+        return PREPARE_BAD_PARAMETER;
+    }
+    if (value < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    if (value > UINT32_MAX) {
+        return PREPARE_BAD_PARAMETER;
+    }
+
+    if (param->target == PARAM_ID) {
+        paramRow(&prepared->statement, param)->id = value;
+    } else {
+        prepared->statement.conditions[param->index].key = value;
+    }
+    param->bound = true;
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult dbBindText(PreparedStatement* prepared, uint32_t index, const char* value) {
+    Param* param = preparedParam(prepared, index);
+    if (param == NULL || value == NULL) {
+        return PREPARE_BAD_PARAMETER;
+    }
+
+    Row* row = paramRow(&prepared->statement, param);
+    size_t length = strlen(value);
+    if (param->target == PARAM_USERNAME || param->target == PARAM_SET_USERNAME) {
+        if (length > COLUMN_USERNAME_SIZE) {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        memcpy(row->username, value, length + 1);
+    } else if (param->target == PARAM_EMAIL || param->target == PARAM_SET_EMAIL) {
+        if (length > COLUMN_EMAIL_SIZE) {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        memcpy(row->email, value, length + 1);
+    } else {
+        return PREPARE_BAD_PARAMETER;
+    }
+
+    param->bound = true;
+    return PREPARE_SUCCESS;
+}
+
+// Run an insert, update or delete, or fetch the next row of a select into the caller's buffer
+// A select's cursor reads a copy of its leaf, so nothing stays pinned or latched between steps
+ExecuteResult dbStep(PreparedStatement* prepared, Row* row) {
+    Statement* statement = &prepared->statement;
+    Table* table = prepared->table;
+    Pager* pager = table->pager;
+
+    if (prepared->done) {
+        return EXECUTE_SUCCESS;
+    }
+
+    if (prepared->cursor == NULL) {
+        for (uint32_t i = 0; i < statement->num_params; i++) {
+            if (!statement->params[i].bound) {
+                return EXECUTE_UNBOUND_PARAMETER;
+            }
+        }
+    }
+
+    uint32_t mark = pagerPinMark();
+
+    if (statement->type != STATEMENT_SELECT) {
+        // Latches are held through the commit, so readers never see pages the log doesn't have yet
+        pagerBeginWrite(pager);
+        ExecuteResult result;
+        if (statement->type == STATEMENT_INSERT) {
+            result = executeInsert(statement, table);
+        } else if (statement->type == STATEMENT_DELETE) {
+            result = executeDelete(statement, table);
+        } else if (statement->type == STATEMENT_UPDATE) {
+            result = executeUpdate(statement, table);
+        } else {
+            result = executeCreateIndex(statement, table);
+        }
+        pagerCommit(pager);
+        pagerUnpinTo(mark);
+        pagerEndWrite(pager);
+        prepared->done = true;
+        return result;
+    }
+
+    if (statement->num_aggregates > 0) {
+        resolveKeyRange(statement);
+        if (statement->match_columns[COLUMN_USERNAME] || statement->match_columns[COLUMN_EMAIL]) {
+            executeAggregateRows(prepared);
+        } else {
+            pagerBeginScan(pager);
+            executeAggregates(statement, table);
+            pagerEndScan(pager);
+        }
+        pagerUnpinTo(mark);
+        prepared->done = true;
+        return EXECUTE_ROW;
+    }
+
+    if (prepared->cursor == NULL) {
+        resolveKeyRange(statement);
+        if (statement->range_low >= statement->range_high) {
+            prepared->done = true;
+            return EXECUTE_SUCCESS;
+        }
+        selectOpen(prepared);
+    }
+
+    ExecuteResult result = selectNextRow(prepared, row) ? EXECUTE_ROW : EXECUTE_SUCCESS;
+    pagerUnpinTo(mark);
+
+    if (result != EXECUTE_ROW) {
+        selectClose(prepared);
+        prepared->done = true;
+    }
+    return result;
+}
+
+// Make the statement runnable again, keeping its bound values
+void dbReset(PreparedStatement* prepared) {
+    selectClose(prepared);
+    prepared->done = false;
+}
+
+uint32_t dbAggregateCount(PreparedStatement* prepared) {
+    return prepared->statement.num_aggregates;
+}
+
+// Aggregates are numbered from 0, in the order the select lists them
+// Returns false if the value is NULL, or there's no such aggregate
+bool dbAggregateValue(PreparedStatement* prepared, uint32_t index, uint64_t* value) {
+    Statement* statement = &prepared->statement;
+    if (index >= statement->num_aggregates || statement->aggregate_null[index]) {
+        return false;
+    }
+    *value = statement->aggregate_values[index];
+    return true;
+}
+
+// The statement goes back into the table's cache rather than being freed
+void dbFinalize(PreparedStatement* prepared) {
+    Table* table = prepared->table;
+    dbReset(prepared);
+
+    pthread_mutex_lock(&table->statement_cache_mutex);
+    statementCachePut(table, prepared);
+    pthread_mutex_unlock(&table->statement_cache_mutex);
+}
+
+/*
+
+Parallel scan
+
+The key range is cut into partitions at separator keys taken from the top of the
+tree, deep enough that there are several partitions per worker. Every worker owns
+a queue of neighbouring partitions and works through it from the low end. Once
+its own queue is empty it steals from the high end of someone else's, so a worker
+stuck on a dense range doesn't hold up the rest.
+
+Each partition is an ordinary range scan with its own snapshot cursor, so workers
+never share a latch for longer than a page copy. Ordered scans keep each partition's
+rows until the calling thread, which hands them on in partition order, gets to them.
+
+*/
+typedef struct {
+    pthread_mutex_t mutex;
+    uint32_t head; // Next partition for the owner
+    uint32_t tail; // One past the next partition for a thief
+} ScanQueue;
+
+typedef struct {
+    Row* rows;
+    uint32_t count;
+    uint32_t capacity;
+    bool done;
+} ScanOutput;
+
+typedef struct {
+    Table* table;
+    ParallelScan* scan;
+    uint64_t* bounds;        // Partition i covers bounds[i] <= id < bounds[i + 1]
+    uint32_t num_partitions;
+    ScanQueue* queues;       // One per worker
+    uint32_t num_workers;
+
+    // Ordered scans only
+    ScanOutput* outputs;     // One per partition
+    pthread_mutex_t output_mutex;
+    pthread_cond_t output_done;
+} ScanState;
+
+typedef struct {
+    ScanState* state;
+    uint32_t index;
+} ScanWorker;
+
+int compareKeys(const void* a, const void* b) {
+    uint32_t left = *(uint32_t*) a;
+    uint32_t right = *(uint32_t*) b;
+    return (left > right) - (left < right);
+}
+
+// Collect the keys of the first internal level whose nodes have at least target
+// children between them, along with every level above it, sorted. Each key is the
+// max key of a subtree, so they cut the key space into ranges of similar size
+uint32_t scanSeparators(Table* table, uint32_t target, uint32_t** separators) {
+    Pager* pager = table->pager;
+    uint32_t* level = malloc(sizeof(uint32_t));
+    uint32_t levelCount = 1;
+    level[0] = table->root_page_num;
+
+    uint32_t* keys = NULL;
+    uint32_t numKeys = 0;
+
+    while (levelCount > 0) {
+        uint32_t* children = NULL;
+        uint32_t numChildren = 0;
+
+        for (uint32_t i = 0; i < levelCount; i++) {
+            uint32_t mark = pagerPinMark();
+            void* node = getPage(pager, level[i]);
+            if (getNodeType(node) == NODE_INTERNAL) {
+                uint32_t nodeKeys = *internalNodeNumKeys(node);
+                keys = realloc(keys, (numKeys + nodeKeys) * sizeof(uint32_t));
+                children = realloc(children, (numChildren + nodeKeys + 1) * sizeof(uint32_t));
+                for (uint32_t j = 0; j < nodeKeys; j++) {
+                    keys[numKeys++] = *internalNodeKey(node, j);
+                    children[numChildren++] = *internalNodeChild(node, j);
+                }
+                children[numChildren++] = *internalNodeRightChild(node);
+            }
+            pagerUnpinTo(mark);
+        }
+
+        free(level);
+        level = children;
+        levelCount = numChildren;
+        if (numChildren >= target) {
+            break;
+        }
+    }
+    free(level);
+
+    // A split racing with this walk can repeat a key, and partitions only need to be roughly even
+    qsort(keys, numKeys, sizeof(uint32_t), compareKeys);
+    uint32_t unique = 0;
+    for (uint32_t i = 0; i < numKeys; i++) {
+        if (unique == 0 || keys[i] != keys[unique - 1]) {
+            keys[unique++] = keys[i];
+        }
+    }
+
+    *separators = keys;
+    return unique;
+}
+
+// Partition [low, high) into at most target ranges. Returns the number of partitions
+uint32_t scanPartitions(Table* table, uint64_t low, uint64_t high, uint32_t target, uint64_t** bounds) {
+    uint32_t* separators;
+    uint32_t numSeparators = scanSeparators(table, target, &separators);
+
+    *bounds = malloc((target + 1) * sizeof(uint64_t));
+    uint32_t count = 0;
+    (*bounds)[count++] = low;
+
+    // Spread target - 1 cuts evenly over the separators. A separator is the last key of
+    // its range, so the cut goes just after it
+    for (uint32_t i = 1; i < target && numSeparators > 0; i++) {
+        uint64_t index = (uint64_t) i * (numSeparators + 1) / target;
+        if (index == 0) {
+            continue;
+        }
+        uint64_t cut = (uint64_t) separators[index - 1] + 1;
+        if (cut > (*bounds)[count - 1] && cut < high) {
+            (*bounds)[count++] = cut;
+        }
+    }
+
+    (*bounds)[count] = high;
+    free(separators);
+    return count;
+}
+
+// Own queue first, lowest partition first. Then steal the highest one someone else has left
+int64_t scanNextPartition(ScanState* state, uint32_t worker) {
+    for (uint32_t i = 0; i < state->num_workers; i++) {
+        ScanQueue* queue = &state->queues[(worker + i) % state->num_workers];
+        int64_t partition = -1;
+
+        pthread_mutex_lock(&queue->mutex);
+        if (queue->head < queue->tail) {
+            partition = i == 0 ? queue->head++ : --queue->tail;
+        }
+        pthread_mutex_unlock(&queue->mutex);
+
+        if (partition != -1) {
+            return partition;
+        }
+    }
+    return -1;
+}
+
+void scanEmit(ScanState* state, uint32_t worker, ScanOutput* output, Row* rows, uint32_t count) {
+    if (output == NULL) {
+        state->scan->visit(state->scan->context, worker, rows, count);
+        return;
+    }
+
+    if (output->count + count > output->capacity) {
+        output->capacity = output->capacity ? output->capacity * 2 : SCAN_BATCH_ROWS;
+        output->rows = realloc(output->rows, output->capacity * sizeof(Row));
+    }
+    memcpy(&output->rows[output->count], rows, count * sizeof(Row));
+    output->count += count;
+}
+
+void scanPartition(ScanState* state, uint32_t worker, uint32_t partition, Row* batch) {
+    uint64_t low = state->bounds[partition];
+    uint64_t high = state->bounds[partition + 1];
+    ScanOutput* output = state->scan->ordered ? &state->outputs[partition] : NULL;
+
+    if (low < high && low <= UINT32_MAX) {
+        Cursor* cursor = tableSeekRange(state->table, (uint32_t) low, high);
+        uint32_t count = 0;
+
+        while (!(cursor->end_of_table) && cursorKey(cursor) < high) {
+            cursorRow(cursor, &batch[count++]);
+            incrementCursor(cursor);
+            if (count == SCAN_BATCH_ROWS) {
+                scanEmit(state, worker, output, batch, count);
+                count = 0;
+            }
+        }
+        if (count > 0) {
+            scanEmit(state, worker, output, batch, count);
+        }
+        free(cursor);
+    }
+
+    if (output != NULL) {
+        pthread_mutex_lock(&state->output_mutex);
+        output->done = true;
+        pthread_cond_broadcast(&state->output_done);
+        pthread_mutex_unlock(&state->output_mutex);
+    }
+}
+
+void* scanWorker(void* argument) {
+    ScanWorker* worker = argument;
+    Row* batch = malloc(SCAN_BATCH_ROWS * sizeof(Row));
+
+    int64_t partition;
+    while ((partition = scanNextPartition(worker->state, worker->index)) != -1) {
+        scanPartition(worker->state, worker->index, partition, batch);
+    }
+
+    free(batch);
+    return NULL;
+}
+
+void parallelScan(Table* table, ParallelScan* scan) {
+    uint64_t high = scan->high < SELECT_KEY_LIMIT ? scan->high : SELECT_KEY_LIMIT;
+    if (scan->low >= high) {
+        return;
+    }
+
+    uint32_t threads = scan->threads;
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+    if (threads > SCAN_MAX_THREADS) {
+        threads = SCAN_MAX_THREADS;
+    }
+
+    pagerBeginScan(table->pager);
+    ScanState state;
+    state.table = table;
+    state.scan = scan;
+    state.num_partitions = scanPartitions(table, scan->low, high, threads * SCAN_PARTITIONS_PER_THREAD, &state.bounds);
+    state.num_workers = threads < state.num_partitions ? threads : state.num_partitions;
+    state.outputs = scan->ordered ? calloc(state.num_partitions, sizeof(ScanOutput)) : NULL;
+    pthread_mutex_init(&state.output_mutex, NULL);
+    pthread_cond_init(&state.output_done, NULL);
+
+    // Neighbouring partitions go to the same worker, so its leaves are read in order
+    state.queues = malloc(state.num_workers * sizeof(ScanQueue));
+    for (uint32_t i = 0; i < state.num_workers; i++) {
+        pthread_mutex_init(&state.queues[i].mutex, NULL);
+        state.queues[i].head = (uint64_t) i * state.num_partitions / state.num_workers;
+        state.queues[i].tail = (uint64_t) (i + 1) * state.num_partitions / state.num_workers;
+    }
+
+    pthread_t workerThreads[SCAN_MAX_THREADS];
+    ScanWorker workers[SCAN_MAX_THREADS];
+    for (uint32_t i = 0; i < state.num_workers; i++) {
+        workers[i].state = &state;
+        workers[i].index = i;
+        if (pthread_create(&workerThreads[i], NULL, scanWorker, &workers[i]) != 0) {
+            printf("Unable to start scan worker: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Hand over each partition as soon as it and everything before it is finished
+    for (uint32_t i = 0; scan->ordered && i < state.num_partitions; i++) {
+        ScanOutput* output = &state.outputs[i];
+        pthread_mutex_lock(&state.output_mutex);
+        while (!output->done) {
+            pthread_cond_wait(&state.output_done, &state.output_mutex);
+        }
+        pthread_mutex_unlock(&state.output_mutex);
+
+        for (uint32_t first = 0; first < output->count; first += SCAN_BATCH_ROWS) {
+            uint32_t count = output->count - first < SCAN_BATCH_ROWS ? output->count - first : SCAN_BATCH_ROWS;
+            scan->visit(scan->context, 0, &output->rows[first], count);
+        }
+        free(output->rows);
+    }
+
+    // Any worker may still be stealing from any queue until they have all finished
+    for (uint32_t i = 0; i < state.num_workers; i++) {
+        pthread_join(workerThreads[i], NULL);
+    }
+    for (uint32_t i = 0; i < state.num_workers; i++) {
+        pthread_mutex_destroy(&state.queues[i].mutex);
+    }
+
+    pthread_mutex_destroy(&state.output_mutex);
+    pthread_cond_destroy(&state.output_done);
+    free(state.queues);
+    free(state.outputs);
+    free(state.bounds);
+    pagerEndScan(table->pager);
+}
+
+/*
+
+Bulk loading
+
+.load reads "id username email" lines and builds the tree bottom-up instead of
+inserting rows one at a time. Input is sorted in memory when it fits, otherwise
+sorted runs are spilled to temporary files and merged. Duplicate keys keep their
+first occurrence.
+
+Once sorting is done, a first pass over the rows packs them into leaves by size,
+so every page number can be worked out up front: leaves come first, then each internal level, and the top
+node goes into page 0 so the root stays where it always is. Pages are written
+in ascending order and parent pointers are filled in as each page is built.
+
+*/
+typedef struct {
+    Row* rows;            // In-memory input, used when there was a single run
+    Row** order;
+    uint32_t position;
+    FILE* file;           // Otherwise the merged, deduplicated runs
+    uint32_t num_rows;
+    uint32_t duplicates;
+} RowSource;
+
+int compareRowPointers(const void* a, const void* b) {
+    Row* left = *(Row**) a;
+    Row* right = *(Row**) b;
+
+    if (left->id != right->id) {
+        return left->id < right->id ? -1 : 1;
+    }
+    // Earlier input wins ties, so a duplicate key keeps its first row
+    return (left > right) - (left < right);
+}
+
+bool rowSourceNext(RowSource* source, Row* row) {
+    if (source->file != NULL) {
+        return fread(row, sizeof(Row), 1, source->file) == 1;
+    }
+
+    if (source->position == source->num_rows) {
+        return false;
+    }
+    *row = *source->order[source->position++];
+    return true;
+}
+
+// Start again from the first row
+void rowSourceRewind(RowSource* source) {
+    if (source->file != NULL) {
+        rewind(source->file);
+    } else {
+        source->position = 0;
+    }
+}
+
+// Order runs by their current key, then by run number so earlier input wins ties
+bool runHeapLess(Row* heads, uint32_t left, uint32_t right) {
+    if (heads[left].id != heads[right].id) {
+        return heads[left].id < heads[right].id;
+    }
+    return left < right;
+}
+
+// Move the run at parent down the heap until neither child sorts before it
+void runHeapSiftDown(uint32_t* heap, uint32_t heapSize, Row* heads, uint32_t parent) {
+    while (true) {
+        uint32_t smallest = parent;
+        uint32_t left = 2 * parent + 1;
+        uint32_t right = left + 1;
+        if (left < heapSize && runHeapLess(heads, heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < heapSize && runHeapLess(heads, heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == parent) {
+            return;
+        }
+
+        uint32_t swap = heap[parent];
+        heap[parent] = heap[smallest];
+        heap[smallest] = swap;
+        parent = smallest;
+    }
+}
+
+// Write rows to a new temporary file. Returns NULL if it can't be created or written,
+// which a full or unwritable TMPDIR leads to
+FILE* writeRun(Row** order, uint32_t count) {
+    FILE* run = tmpfile();
+    if (run == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (fwrite(order[i], sizeof(Row), 1, run) != 1) {
+            fclose(run);
+            return NULL;
+        }
+    }
+    // Rows still in the stdio buffer can fail to go out too
+    if (fflush(run) != 0) {
+        fclose(run);
+        return NULL;
+    }
+    return run;
+}
+
+// Merge sorted run files into one file, dropping duplicate keys along the way
+// A binary heap of run indexes picks the smallest current row. Returns NULL if
+// the merged file can't be written
+FILE* mergeSortRuns(FILE** runs, uint32_t numRuns, RowSource* source) {
+    Row* heads = malloc(numRuns * sizeof(Row));
+    uint32_t* heap = malloc(numRuns * sizeof(uint32_t));
+    uint32_t heapSize = 0;
+
+    for (uint32_t i = 0; i < numRuns; i++) {
+        rewind(runs[i]);
+        if (fread(&heads[i], sizeof(Row), 1, runs[i]) == 1) {
+            heap[heapSize++] = i;
+        }
+    }
+
+    for (uint32_t i = heapSize / 2; i > 0; i--) {
+        runHeapSiftDown(heap, heapSize, heads, i - 1);
+    }
+
+    FILE* merged = tmpfile();
+    bool first = true;
+    uint32_t lastKey = 0;
+
+    while (merged != NULL && heapSize > 0) {
+        uint32_t run = heap[0];
+        if (first || heads[run].id != lastKey) {
+            if (fwrite(&heads[run], sizeof(Row), 1, merged) != 1) {
+                fclose(merged);
+                merged = NULL;
+                break;
+            }
+            lastKey = heads[run].id;
+            first = false;
+            source->num_rows++;
+        } else {
+            source->duplicates++;
+        }
+
+        if (fread(&heads[run], sizeof(Row), 1, runs[run]) != 1) {
+            heap[0] = heap[--heapSize];
+        }
+        runHeapSiftDown(heap, heapSize, heads, 0);
+    }
+
+    free(heads);
+    free(heap);
+    if (merged != NULL && fflush(merged) != 0) {
+        fclose(merged);
+        merged = NULL;
+    }
+    if (merged != NULL) {
+        rewind(merged);
+    }
+    return merged;
+}
+
+// Sort the buffered rows, then either keep them as the source or spill them as a run
+void sortRowBuffer(Row* rows, Row** order, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        order[i] = &rows[i];
+    }
+    qsort(order, count, sizeof(Row*), compareRowPointers);
+}
+
+// Read and sort the input file. Returns false if it couldn't be opened or parsed,
+// with the reason left in result
+bool bulkLoadSortInput(const char* path, RowSource* source, BulkLoadResult* result) {
+    memset(source, 0, sizeof(RowSource));
+    FILE* input = fopen(path, "r");
+    if (input == NULL) {
+        result->status = BULK_LOAD_OPEN_ERROR;
+        return false;
+    }
+
+    source->rows = malloc(BULK_LOAD_SORT_ROWS * sizeof(Row));
+    source->order = malloc(BULK_LOAD_SORT_ROWS * sizeof(Row*));
+
+    FILE** runs = NULL;
+    uint32_t numRuns = 0;
+    uint32_t buffered = 0;
+    uint32_t lineNumber = 0;
+    char* line = NULL;
+    size_t lineLength = 0;
+    bool ok = true;
+
+    while (getline(&line, &lineLength, input) != -1) {
+        lineNumber++;
+        char* idString = strtok(line, " \t\r\n");
+        if (idString == NULL) {
+            continue; // Blank line
+        }
+        char* username = strtok(NULL, " \t\r\n");
+        char* email = strtok(NULL, " \t\r\n");
+
+        if (parseRow(idString, username, email, &source->rows[buffered]) != PREPARE_SUCCESS) {
+            result->status = BULK_LOAD_PARSE_ERROR;
+            result->error_line = lineNumber;
+            ok = false;
+            break;
+        }
+
+        if (++buffered == BULK_LOAD_SORT_ROWS) {
+            // Buffer is full. Spill it as a sorted run
+            sortRowBuffer(source->rows, source->order, buffered);
+            runs = realloc(runs, (numRuns + 1) * sizeof(FILE*));
+            runs[numRuns] = writeRun(source->order, buffered);
+            if (runs[numRuns] == NULL) {
+                result->status = BULK_LOAD_TEMP_FILE_ERROR;
+                ok = false;
+                break;
+            }
+            numRuns++;
+            buffered = 0;
+        }
+    }
+    free(line);
+    fclose(input);
+
+    if (ok) {
+        sortRowBuffer(source->rows, source->order, buffered);
+
+        if (numRuns == 0) {
+            // Everything fit in memory. Squeeze out duplicates in place
+            for (uint32_t i = 0; i < buffered; i++) {
+                if (source->num_rows > 0 && source->order[i]->id == source->order[source->num_rows - 1]->id) {
+                    source->duplicates++;
+                } else {
+                    source->order[source->num_rows++] = source->order[i];
+                }
+            }
+        } else {
+            runs = realloc(runs, (numRuns + 1) * sizeof(FILE*));
+            runs[numRuns] = writeRun(source->order, buffered);
+            if (runs[numRuns] != NULL) {
+                numRuns++;
+                source->file = mergeSortRuns(runs, numRuns, source);
+            }
+            if (source->file == NULL) {
+                result->status = BULK_LOAD_TEMP_FILE_ERROR;
+                ok = false;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < numRuns; i++) {
+        fclose(runs[i]);
+    }
+    free(runs);
+    return ok;
+}
+
+// Index of the node that child j lands in when count children are spread evenly over nodes
+uint32_t bulkLoadParentIndex(uint32_t j, uint32_t count, uint32_t nodes) {
+    return (uint32_t) (((uint64_t) (j + 1) * nodes - 1) / count);
+}
+
+// First child (or row) of node i when count items are spread evenly over nodes
+uint32_t bulkLoadFirstChild(uint32_t i, uint32_t count, uint32_t nodes) {
+    return (uint32_t) ((uint64_t) i * count / nodes);
+}
+
+// Read through the sorted rows once and work out how many go in each leaf, filling
+// each one up to fillFactor of its space. Returns the number of leaves
+uint32_t bulkLoadPackLeaves(RowSource* source, double fillFactor, uint32_t** leafRows) {
+    uint32_t budget = (uint32_t) (LEAF_NODE_SPACE_FOR_CELLS * fillFactor);
+    uint32_t capacity = 1024;
+    uint32_t numLeaves = 0;
+    uint32_t used = 0;
+    *leafRows = malloc(capacity * sizeof(uint32_t));
+
+    Row row;
+    while (rowSourceNext(source, &row)) {
+        uint32_t cellSize = LEAF_NODE_SLOT_SIZE + rowValueSize(&row);
+        // A new leaf takes its first row however low the fill factor
+        if (numLeaves == 0 || used + cellSize > budget) {
+            if (numLeaves == capacity) {
+                capacity *= 2;
+                *leafRows = realloc(*leafRows, capacity * sizeof(uint32_t));
+            }
+            (*leafRows)[numLeaves++] = 0;
+            used = 0;
+        }
+        (*leafRows)[numLeaves - 1]++;
+        used += cellSize;
+    }
+
+    rowSourceRewind(source);
+    return numLeaves;
+}
+
+void bulkLoadBuild(Table* table, RowSource* source, double fillFactor) {
+    Pager* pager = table->pager;
+
+    uint32_t* leafRows;
+    uint32_t internalCapacity = (uint32_t) (INTERNAL_NODE_MAX_CELLS * fillFactor) + 1; // Children, not keys
+    if (internalCapacity < 2) {
+        internalCapacity = 2;
+    }
+
+    // Work out how many nodes each level needs and where its pages start
+    uint32_t counts[BULK_LOAD_MAX_LEVELS];
+    uint32_t bases[BULK_LOAD_MAX_LEVELS];
+    uint32_t height = 0;
+    counts[0] = bulkLoadPackLeaves(source, fillFactor, &leafRows);
+    while (counts[height] > 1) {
+        counts[height + 1] = (counts[height] + internalCapacity - 1) / internalCapacity;
+        height++;
+    }
+
+    // Levels take runs of new pages at the end of the file. Free pages stay on the freelist
+    uint32_t nextPageNum = pager->num_pages;
+    for (uint32_t level = 0; level < height; level++) {
+        bases[level] = nextPageNum;
+        nextPageNum += counts[level];
+    }
+    bases[height] = table->root_page_num;
+
+    uint32_t flushEvery = pager->num_frames > 0 ? pager->num_frames / 2 : UINT32_MAX;
+    uint32_t pagesBuilt = 0;
+
+    // Leaves, each one linked to the next
+    uint32_t* maxKeys = malloc(counts[0] * sizeof(uint32_t));
+    for (uint32_t i = 0; i < counts[0]; i++) {
+        uint32_t pageNum = bases[0] + i;
+        uint32_t numCells = leafRows[i];
+
+        uint32_t mark = pagerPinMark();
+        void* node = getPage(pager, pageNum);
+        initializeLeafNode(node);
+        setNodeRoot(node, height == 0);
+        *leafNodeNextLeaf(node) = (i + 1 < counts[0]) ? pageNum + 1 : 0;
+        if (height > 0) {
+            *nodeParent(node) = bases[1] + bulkLoadParentIndex(i, counts[0], counts[1]);
+        }
+
+        Row row;
+        uint8_t value[LEAF_NODE_MAX_VALUE_SIZE];
+        for (uint32_t cell = 0; cell < numCells; cell++) {
+            rowSourceNext(source, &row);
+            leafNodeAppendCell(node, row.id, value, serializeRow(&row, value));
+        }
+        maxKeys[i] = row.id;
+
+        pagerMarkDirty(pager, pageNum);
+        pagerUnpinTo(mark);
+
+        // Write finished pages back in big sequential runs rather than one eviction at a time
+        if (++pagesBuilt % flushEvery == 0) {
+            pagerFlushAll(pager);
+        }
+    }
+
+    // Internal levels, bottom-up
+    for (uint32_t level = 1; level <= height; level++) {
+        uint32_t numChildren = counts[level - 1];
+        uint32_t* levelMaxKeys = malloc(counts[level] * sizeof(uint32_t));
+
+        for (uint32_t i = 0; i < counts[level]; i++) {
+            uint32_t pageNum = bases[level] + i;
+            uint32_t first = bulkLoadFirstChild(i, numChildren, counts[level]);
+            uint32_t last = bulkLoadFirstChild(i + 1, numChildren, counts[level]) - 1;
+
+            uint32_t mark = pagerPinMark();
+            void* node = getPage(pager, pageNum);
+            initializeInternalNode(node);
+            setNodeRoot(node, level == height);
+            if (level < height) {
+                *nodeParent(node) = bases[level + 1] + bulkLoadParentIndex(i, counts[level], counts[level + 1]);
+            }
+
+            *internalNodeNumKeys(node) = last - first;
+            for (uint32_t child = first; child < last; child++) {
+                *internalNodeCell(node, child - first) = bases[level - 1] + child;
+                *internalNodeKey(node, child - first) = maxKeys[child];
+            }
+            *internalNodeRightChild(node) = bases[level - 1] + last;
+            levelMaxKeys[i] = maxKeys[last];
+
+            pagerMarkDirty(pager, pageNum);
+            pagerUnpinTo(mark);
+
+            if (++pagesBuilt % flushEvery == 0) {
+                pagerFlushAll(pager);
+            }
+        }
+
+        free(maxKeys);
+        maxKeys = levelMaxKeys;
+    }
+    free(maxKeys);
+    free(leafRows);
+}
+
+BulkLoadResult bulkLoad(Table* table, const char* path, double fillFactor) {
+    BulkLoadResult result = { .status = BULK_LOAD_SUCCESS };
+    RowSource source;
+    if (!bulkLoadSortInput(path, &source, &result)) {
+        free(source.rows);
+        free(source.order);
+        return result;
+    }
+
+    pagerBeginWrite(table->pager);
+    void* root = getPage(table->pager, table->root_page_num);
+    bool emptyTable = getNodeType(root) == NODE_LEAF && *leafNodeNumCells(root) == 0;
+    pagerUnpinAll(table->pager);
+
+    uint32_t loaded = 0;
+    if (emptyTable) {
+        if (source.num_rows > 0) {
+            bulkLoadBuild(table, &source, fillFactor);
+            // The build doesn't go through executeInsert, so any indexes are filled in afterwards
+            for (uint32_t column = 0; column < TEXT_COLUMNS; column++) {
+                if (table->indexes[column] != NULL) {
+                    indexPopulate(table, table->indexes[column], column);
+                }
+            }
+        }
+        loaded = source.num_rows;
+    } else {
+        // The tree already has rows, so fall back to inserting them. Sorted input
+        // still keeps each descent on the same path as the previous one
+        Statement statement;
+        statement.type = STATEMENT_INSERT;
+        while (rowSourceNext(&source, &statement.row_to_insert)) {
+            if (executeInsert(&statement, table) == EXECUTE_SUCCESS) {
+                loaded++;
+            } else {
+                source.duplicates++;
+            }
+            pagerUnpinAll(table->pager);
+        }
+    }
+
+    pagerCommit(table->pager);
+    pagerUnpinAll(table->pager);
+    pagerEndWrite(table->pager);
+
+    if (source.file != NULL) {
+        fclose(source.file);
+    }
+    free(source.rows);
+    free(source.order);
+
+    result.loaded = loaded;
+    result.duplicates = source.duplicates;
+    return result;
+}
+
+/*
+
+Result writer
+
+Rows are formatted straight into one large buffer, which goes to the file in a
+single fwrite whenever it fills up. That keeps printf's format parsing and
+per-call locking out of selects and exports that return many rows
+
+*/
+
+void resultWriterInit(ResultWriter* writer, FILE* file) {
+    writer->file = file;
+    writer->used = 0;
+}
+
+void resultWriterFlush(ResultWriter* writer) {
+    if (writer->used > 0) {
+        fwrite(writer->buffer, 1, writer->used, writer->file);
+        writer->used = 0;
+    }
+}
+
+void resultWriterBytes(ResultWriter* writer, const char* bytes, uint32_t length) {
+    if (writer->used + length > RESULT_WRITER_BUFFER_SIZE) {
+        resultWriterFlush(writer);
+        // Anything bigger than the buffer goes straight through
+        if (length > RESULT_WRITER_BUFFER_SIZE) {
+            fwrite(bytes, 1, length, writer->file);
+            return;
+        }
+    }
+    memcpy(writer->buffer + writer->used, bytes, length);
+    writer->used += length;
+}
+
+void resultWriterUint(ResultWriter* writer, uint64_t value) {
+    // Digits come out lowest first, so fill the scratch buffer from its end
+    char digits[20];
+    uint32_t start = sizeof(digits);
+    do {
+        digits[--start] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    resultWriterBytes(writer, digits + start, sizeof(digits) - start);
+}
+
+// Same text as printf("(%d, %s, %s)\n")
+void resultWriterRow(ResultWriter* writer, Row* row) {
+    resultWriterBytes(writer, "(", 1);
+    resultWriterUint(writer, row->id);
+    resultWriterBytes(writer, ", ", 2);
+    resultWriterBytes(writer, row->username, strlen(row->username));
+    resultWriterBytes(writer, ", ", 2);
+    resultWriterBytes(writer, row->email, strlen(row->email));
+    resultWriterBytes(writer, ")\n", 2);
+}
+
+/*
+
+Export
+
+Leaves are walked in key order through a snapshot cursor, like a select's, and each
+cell is written from its raw value without being decoded into a Row. The binary
+format is the cell as the leaf stores it: the key, the value's size, then the value
+
+*/
+
+// A CSV field only needs quoting when it holds a separator, a quote or a line break
+void exportCsvField(ResultWriter* writer, const uint8_t* bytes, uint32_t length) {
+    bool quote = false;
+    for (uint32_t i = 0; i < length && !quote; i++) {
+        quote = bytes[i] == ',' || bytes[i] == '"' || bytes[i] == '\n' || bytes[i] == '\r';
+    }
+    if (!quote) {
+        resultWriterBytes(writer, (const char*) bytes, length);
+        return;
+    }
+
+    resultWriterBytes(writer, "\"", 1);
+    uint32_t start = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        if (bytes[i] == '"') {
+            // Write up to and including the quote, then double it
+            resultWriterBytes(writer, (const char*) bytes + start, i + 1 - start);
+            resultWriterBytes(writer, "\"", 1);
+            start = i + 1;
+        }
+    }
+    resultWriterBytes(writer, (const char*) bytes + start, length - start);
+    resultWriterBytes(writer, "\"", 1);
+}
+
+void exportCell(ResultWriter* writer, void* node, uint32_t cellNum, ExportFormat format) {
+    uint32_t key = *leafNodeKey(node, cellNum);
+    uint16_t valueSize = *leafNodeValueSize(node, cellNum);
+    const uint8_t* value = leafNodeValue(node, cellNum);
+
+    if (format == EXPORT_BINARY) {
+        resultWriterBytes(writer, (const char*) &key, sizeof(key));
+        resultWriterBytes(writer, (const char*) &valueSize, sizeof(valueSize));
+        resultWriterBytes(writer, (const char*) value, valueSize);
+        return;
+    }
+
+    uint8_t usernameLength = value[0];
+    uint8_t emailLength = value[1];
+    resultWriterUint(writer, key);
+    resultWriterBytes(writer, ",", 1);
+    exportCsvField(writer, value + LEAF_NODE_VALUE_HEADER_SIZE, usernameLength);
+    resultWriterBytes(writer, ",", 1);
+    exportCsvField(writer, value + LEAF_NODE_VALUE_HEADER_SIZE + usernameLength, emailLength);
+    resultWriterBytes(writer, "\n", 1);
+}
+
+// Returns the number of rows written, or -1 with errno set if the file couldn't be
+// opened or written
+int64_t exportTable(Table* table, const char* path, ExportFormat format) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    // The writer's buffer is too big to keep on the stack
+    ResultWriter* writer = malloc(sizeof(ResultWriter));
+    void* snapshot = malloc(PAGE_SIZE);
+    resultWriterInit(writer, file);
+    if (format == EXPORT_CSV) {
+        resultWriterBytes(writer, "id,username,email\n", 18);
+    }
+
+    pagerBeginScan(table->pager);
+    Cursor cursor;
+    tableSeekInto(table, 0, SELECT_KEY_LIMIT, &cursor, snapshot);
+
+    // Write out the rest of each snapshot leaf in one go, then step to its sibling
+    int64_t exported = 0;
+    while (!cursor.end_of_table) {
+        uint32_t numCells = *leafNodeNumCells(cursor.snapshot);
+        for (uint32_t i = cursor.cell_num; i < numCells; i++) {
+            exportCell(writer, cursor.snapshot, i, format);
+        }
+        exported += numCells - cursor.cell_num;
+        cursor.cell_num = numCells;
+        cursorSkipExhaustedLeaves(&cursor);
+    }
+    pagerEndScan(table->pager);
+
+    resultWriterFlush(writer);
+    bool failed = ferror(file) != 0;
+    // A full disk may only show up once the last buffered bytes are written
+    failed |= fclose(file) != 0;
+    free(snapshot);
+    free(writer);
+
+    return failed ? -1 : exported;
+}
+
+/*
+
+Vacuum
+
+.vacuum hands free pages back to the file system. It walks every tree to find the
+pages in use, then moves each one that lies past the end of the compacted file into
+a free page below it and repoints whatever referred to it: the parent's child
+pointer (or the header, for an index root), the children's parent pointers and the
+next leaf pointer of the leaf before it. The freelist is empty once it's done, and
+the file is cut short.
+
+*/
+#define VACUUM_NO_PARENT UINT32_MAX
+
+typedef struct {
+    bool* used;             // Nodes of every tree, and the header page
+    uint32_t* parents;      // Parent of each node, VACUUM_NO_PARENT for roots
+    uint32_t* prev_leaves;  // Leaf before each leaf of the same tree, 0 for the first one
+    uint32_t last_leaf;
+} VacuumState;
+
+void vacuumVisit(Pager* pager, VacuumState* state, uint32_t pageNum, uint32_t parentPageNum) {
+    if (pageNum >= pager->num_pages || state->used[pageNum]) {
+        printf("Page %d is reached twice or lies past the end. Corrupt file detected\n", pageNum);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t mark = pagerPinMark();
+    void* node = getPage(pager, pageNum);
+    state->used[pageNum] = true;
+    state->parents[pageNum] = parentPageNum;
+
+    if (getNodeType(node) == NODE_LEAF) {
+        state->prev_leaves[pageNum] = state->last_leaf;
+        state->last_leaf = pageNum;
+        pagerUnpinTo(mark);
+        return;
+    }
+
+    // Copy the children out rather than keep every node on the way down pinned
+    uint32_t numChildren = *internalNodeNumKeys(node) + 1;
+    uint32_t* children = malloc(numChildren * sizeof(uint32_t));
+    for (uint32_t i = 0; i < numChildren; i++) {
+        children[i] = *internalNodeChild(node, i);
+    }
+    pagerUnpinTo(mark);
+
+    for (uint32_t i = 0; i < numChildren; i++) {
+        vacuumVisit(pager, state, children[i], pageNum);
+    }
+    free(children);
+}
+
+// Copy a node into a free page and repoint everything that referred to it
+void vacuumMovePage(Table* table, VacuumState* state, uint32_t from, uint32_t to) {
+    Pager* pager = table->pager;
+    uint32_t parentPageNum = state->parents[from];
+    uint32_t mark = pagerPinMark();
+
+    // The parent is latched first, the same order readers take them in
+    if (parentPageNum != VACUUM_NO_PARENT) {
+        void* parent = getPage(pager, parentPageNum);
+        *internalNodeChild(parent, internalNodeChildIndex(parent, from)) = to;
+        pagerMarkDirty(pager, parentPageNum);
+    } else {
+        // The table's root is page 0, so only an index root can be this far along the file
+        void* header = getPage(pager, HEADER_PAGE_NUM);
+        for (uint32_t column = 0; column < TEXT_COLUMNS; column++) {
+            if (table->indexes[column] != NULL && table->indexes[column]->root_page_num == from) {
+                *headerIndexRoot(header, column) = to;
+                table->indexes[column]->root_page_num = to;
+            }
+        }
+        pagerMarkDirty(pager, HEADER_PAGE_NUM);
+    }
+
+    void* source = getPage(pager, from);
+    void* node = getPage(pager, to);
+    memcpy(node, source, PAGE_SIZE);
+    pagerMarkDirty(pager, to);
+
+    bool leaf = getNodeType(node) == NODE_LEAF;
+    uint32_t nextLeaf = leaf ? *leafNodeNextLeaf(node) : 0;
+    uint32_t numChildren = leaf ? 0 : *internalNodeNumKeys(node) + 1;
+    uint32_t* children = malloc((numChildren + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < numChildren; i++) {
+        children[i] = *internalNodeChild(node, i);
+    }
+    pagerUnpinTo(mark);
+    state->parents[to] = parentPageNum;
+
+    if (leaf) {
+        uint32_t prevLeaf = state->prev_leaves[from];
+        state->prev_leaves[to] = prevLeaf;
+        if (nextLeaf != 0) {
+            state->prev_leaves[nextLeaf] = to;
+        }
+        if (prevLeaf != 0) {
+            void* prev = getPage(pager, prevLeaf);
+            *leafNodeNextLeaf(prev) = to;
+            pagerMarkDirty(pager, prevLeaf);
+            pagerUnpinTo(mark);
+        }
+    }
+
+    for (uint32_t i = 0; i < numChildren; i++) {
+        void* child = getPage(pager, children[i]);
+        *nodeParent(child) = to;
+        pagerMarkDirty(pager, children[i]);
+        pagerUnpinTo(mark);
+        state->parents[children[i]] = to;
+    }
+    free(children);
+}
+
+VacuumResult vacuum(Table* table) {
+    Pager* pager = table->pager;
+    pagerBeginVacuum(pager);
+    pagerBeginWrite(pager);
+
+    uint32_t numPages = pager->num_pages;
+    VacuumState state;
+    state.used = calloc(numPages, sizeof(bool));
+    state.parents = malloc(numPages * sizeof(uint32_t));
+    state.prev_leaves = calloc(numPages, sizeof(uint32_t));
+    state.used[HEADER_PAGE_NUM] = true;
+
+    state.last_leaf = 0;
+    vacuumVisit(pager, &state, table->root_page_num, VACUUM_NO_PARENT);
+    for (uint32_t column = 0; column < TEXT_COLUMNS; column++) {
+        if (table->indexes[column] != NULL) {
+            state.last_leaf = 0;
+            vacuumVisit(pager, &state, table->indexes[column]->root_page_num, VACUUM_NO_PARENT);
+        }
+    }
+
+    uint32_t pagesInUse = 0;
+    for (uint32_t i = 0; i < numPages; i++) {
+        pagesInUse += state.used[i];
+    }
+
+    // Every page in use past the new end has a free page below it to go to
+    uint32_t to = 0;
+    for (uint32_t from = pagesInUse; from < numPages; from++) {
+        if (!state.used[from]) {
+            continue;
+        }
+        while (state.used[to]) {
+            to++;
+        }
+        vacuumMovePage(table, &state, from, to);
+        state.used[to] = true;
+    }
+
+    void* header = getPage(pager, HEADER_PAGE_NUM);
+    *headerFreelistTrunk(header) = 0;
+    *headerFreePages(header) = 0;
+    pagerMarkDirty(pager, HEADER_PAGE_NUM);
+    pagerUnpinAll(pager);
+
+    pagerTruncate(pager, pagesInUse);
+    pagerCommit(pager);
+    pagerEndWrite(pager);
+    pagerEndVacuum(pager);
+
+    free(state.used);
+    free(state.parents);
+    free(state.prev_leaves);
+
+    VacuumResult result = { .pages_freed = numPages - pagesInUse, .pages_left = pagesInUse };
+    return result;
+}
+
+Pager* pagerOpen(const char* filename, DbOptions* options) {
+    int fd = open(filename,
+                O_RDWR |      // Read/Write mode
+                    O_CREAT,  // Create file if it does not exist
+                S_IWUSR |     // User write permission
+                    S_IRUSR   // User read permission
+                );
+
+    if (fd == -1) {
+        printf("Unable to open file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t fileLength = lseek(fd, 0, SEEK_END);
+    // A file's format is settled when it's created
+    bool compressed = fileLength == 0 ? options->compress : compressedDetect(fd);
+    if (compressed && options->use_mmap) {
+        printf("A compressed database can't be opened with --mmap\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Pager* pager = malloc(sizeof(Pager));
+    pager->file_descriptor = fd;
+    pager->file_length = fileLength;
+    pager->num_pages = (fileLength / PAGE_SIZE);
+    pager->compressed = NULL;
+
+    if (compressed) {
+        pager->compressed = compressedOpen(fd, fileLength);
+        pager->num_pages = pager->compressed->num_pages;
+    } else if (fileLength % PAGE_SIZE != 0) {
+        printf("DB file is not a whole number of pages. Corrupt file detected\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&pager->stats, 0, sizeof(PagerStats));
+    pthread_mutex_init(&pager->mutex, NULL);
+    pthread_cond_init(&pager->frame_unpinned, NULL);
+    pthread_mutex_init(&pager->writer_mutex, NULL);
+    pthread_cond_init(&pager->scans_changed, NULL);
+    pager->scans = 0;
+    pager->vacuuming = false;
+    pager->pins = 0;
+    pager->map = NULL;
+    pager->page_latches = NULL;
+    pager->num_latch_chunks = 0;
+    pager->wal = NULL;
+
+    if (options->use_mmap) {
+        pager->map = mmap(NULL, PAGER_MMAP_RESERVE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+        if (pager->map == MAP_FAILED) {
+            printf("Unable to map db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->sync_low = UINT32_MAX;
+        pager->sync_high = 0;
+        pager->num_latch_chunks = (PAGER_MMAP_RESERVE / PAGE_SIZE) >> PAGER_LATCH_CHUNK_BITS;
+        pager->page_latches = calloc(pager->num_latch_chunks, sizeof(pthread_rwlock_t*));
+
+        pager->frames = NULL;
+        pager->dirty_frames = NULL;
+        pager->frame_slab = NULL;
+        pager->num_frames = 0;
+        pager->frames_in_use = 0;
+        pager->frame_table = NULL;
+        return pager;
+    }
+
+    uint32_t cacheFrames = options->cache_frames;
+    if (cacheFrames < PAGER_MIN_CACHE_FRAMES) {
+        cacheFrames = PAGER_MIN_CACHE_FRAMES;
+    }
+
+    pager->num_frames = cacheFrames;
+    pager->frames_in_use = 0;
+    pager->clock_hand = 0;
+    pager->frames = calloc(cacheFrames, sizeof(Frame));
+    pager->dirty_frames = malloc(cacheFrames * sizeof(Frame*));
+
+    // Every frame's page is carved out of one page-aligned mapping up front. The kernel
+    // only backs the pages frames have been used for, so a large budget costs nothing until it fills
+    pager->frame_slab = mmap(NULL, (size_t) cacheFrames * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pager->frame_slab == MAP_FAILED) {
+        printf("Unable to allocate %d cache frames: %d\n", cacheFrames, errno);
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < cacheFrames; i++) {
+        pthread_rwlock_init(&pager->frames[i].latch, NULL);
+        pager->frames[i].data = pager->frame_slab + (size_t) i * PAGE_SIZE;
+    }
+
+    // Keep the hash table at most half full
+    pager->frame_table_bits = 1;
+    while ((1u << pager->frame_table_bits) < 2 * cacheFrames) {
+        pager->frame_table_bits++;
+    }
+    pager->frame_table = malloc((1u << pager->frame_table_bits) * sizeof(int32_t));
+    for (uint32_t i = 0; i < (1u << pager->frame_table_bits); i++) {
+        pager->frame_table[i] = -1;
+    }
+
+    if (options->use_wal) {
+        pager->wal = walOpen(filename, fd, pager->compressed);
+        // The last commit in the log has the size, whether the database file has
+        // caught up with it or still has pages a vacuum dropped
+        if (pager->wal->committed_frame != 0) {
+            pager->num_pages = pager->wal->committed_pages;
+        }
+    }
+
+    pagerStartReadAhead(pager);
+    return pager;
+}
+
+// Initialize and open new database file 
+Table* dbOpen(const char* filename, DbOptions* options) {   
+    Pager* pager = pagerOpen(filename, options);
+
+    Table* table = (Table*)calloc(1, sizeof(Table));
+    table->pager = pager;
+    table->root_page_num = 0;
+    pthread_mutex_init(&table->statement_cache_mutex, NULL);
+    
+    if (pager->num_pages == 0) {
+        // New DB file. Initialize page 0 as leaf node, and the header page after it
+        pagerBeginWrite(pager);
+        void* rootNode = getPage(pager, 0);
+        initializeLeafNode(rootNode);
+        setNodeRoot(rootNode, true);
+        pagerMarkDirty(pager, 0);
+        void* header = getPage(pager, HEADER_PAGE_NUM);
+        *headerMagic(header) = HEADER_MAGIC;
+        pagerMarkDirty(pager, HEADER_PAGE_NUM);
+        pagerUnpinAll(pager);
+        pagerEndWrite(pager);
+    }
+
+    if (pager->num_pages <= HEADER_PAGE_NUM) {
+        printf("DB file has no header page. Corrupt file detected\n");
+        exit(EXIT_FAILURE);
+    }
+    void* header = getPage(pager, HEADER_PAGE_NUM);
+    if (*headerMagic(header) != HEADER_MAGIC) {
+        printf("DB file has no header page. Corrupt file detected\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t column = 0; column < TEXT_COLUMNS; column++) {
+        if (*headerIndexRoot(header, column) != 0) {
+            table->indexes[column] = openIndex(table, *headerIndexRoot(header, column));
+        }
+    }
+    pagerUnpinAll(pager);
+
+    return table;
+}
+
+NodeType getNodeType(void* node) {
+    uint8_t value = *((uint8_t*)((uint8_t*) node + NODE_TYPE_OFFSET));
+    return (NodeType) value;
+}
+
+void setNodeType(void* node, NodeType type) {
+    uint8_t value = type;
+    *((uint8_t*)((uint8_t*) node + NODE_TYPE_OFFSET)) = value;
+}
+
+void splitLeafNodeAndInsert(Cursor* cursor, uint32_t key, void* newValue, uint32_t newValueSize) {
+    // Create a new node and move half of cells over
+    // Insert the new value in one of the two nodes
+    // Update parent or create a new parent if needed
+    void* oldNode = getPage(cursor->table->pager, cursor->page_num);
+    uint32_t newPageNum = getUnusedPageNum(cursor->table->pager);
+    void* newNode = getPage(cursor->table->pager, newPageNum);
+    pagerMarkDirty(cursor->table->pager, cursor->page_num);
+    pagerMarkDirty(cursor->table->pager, newPageNum);
+    initializeLeafNode(newNode);
+    *nodeParent(newNode) = *nodeParent(oldNode);
+    *leafNodeNextLeaf(newNode) =*leafNodeNextLeaf(oldNode);
+    *leafNodeNextLeaf(oldNode) = newPageNum;
+
+    // Now all existing keys plus the new key should be divided between old (left)
+    // and new (right) nodes, so that each ends up with about half of the bytes.
+    // Both are rebuilt from a copy of the old node, which also packs its values tightly
+    uint8_t cells[PAGE_SIZE];
+    memcpy(cells, oldNode, PAGE_SIZE);
+    uint32_t numCells = *leafNodeNumCells(cells) + 1;
+
+    uint32_t totalBytes = LEAF_NODE_SLOT_SIZE + newValueSize;
+    for (uint32_t i = 0; i < numCells - 1; i++) {
+        totalBytes += LEAF_NODE_SLOT_SIZE + *leafNodeValueSize(cells, i);
+    }
+    uint32_t leftBytes = 0;
+    uint32_t leftCount = 0;
+    for (uint32_t i = 0; i < numCells - 1; i++) {
+        uint32_t valueSize = i == cursor->cell_num ? newValueSize
+                             : *leafNodeValueSize(cells, i < cursor->cell_num ? i : i - 1);
+        if (leftCount > 0 && 2 * (leftBytes + LEAF_NODE_SLOT_SIZE + valueSize) > totalBytes) {
+            break;
+        }
+        leftBytes += LEAF_NODE_SLOT_SIZE + valueSize;
+        leftCount++;
+    }
+
+    // Clear out the old cells too, so stale bytes don't end up on disk
+    *leafNodeNumCells(oldNode) = 0;
+    *leafNodeContentStart(oldNode) = PAGE_SIZE;
+    memset(leafNodeSlot(oldNode, 0), 0, LEAF_NODE_SPACE_FOR_CELLS);
+    for (uint32_t i = 0; i < numCells; i++) {
+        void* destinationNode = i < leftCount ? oldNode : newNode;
+
+        if (i == cursor->cell_num) {
+            leafNodeAppendCell(destinationNode, key, newValue, newValueSize);
+        } else {
+            uint32_t source = i < cursor->cell_num ? i : i - 1;
+            leafNodeAppendCell(destinationNode, *leafNodeKey(cells, source),
+                               leafNodeValue(cells, source), *leafNodeValueSize(cells, source));
+        }
+    }
+
+    // Now update the nodes' parent
+    if (isRootNode(oldNode)) {
+        return createNewRoot(cursor->table, newPageNum);
+    } else {
+        uint32_t parentPageNum = *nodeParent(oldNode);
+        uint32_t newMax = getNodeMaxKey(cursor->table->pager, oldNode);
+        void* parent = getPage(cursor->table->pager, parentPageNum);
+        pagerMarkDirty(cursor->table->pager, parentPageNum);
+        updateInternalNodeKey(parent, cursor->page_num, newMax);
+        insertInternalNode(cursor->table, parentPageNum, cursor->page_num, newPageNum);
+        return;
+    }
+}
+
+void createNewRoot(Table* table, uint32_t rightChildPageNum) {
+    // Old root is copied to new page and becomes left child
+    // Address of right child is passed in
+    // Re-initialize root page to contain the new root node
+    // New root node points to two children
+
+    void* root = getPage(table->pager, table->root_page_num);
+    void* rightChild = getPage(table->pager, rightChildPageNum);
+    uint32_t leftChildPageNum = getUnusedPageNum(table->pager);
+    void* leftChild = getPage(table->pager, leftChildPageNum);
+    pagerMarkDirty(table->pager, table->root_page_num);
+    pagerMarkDirty(table->pager, rightChildPageNum);
+    pagerMarkDirty(table->pager, leftChildPageNum);
+
+    // Left child has data copied from old root
+    memcpy(leftChild, root, PAGE_SIZE);
+    setNodeRoot(leftChild, false);
+
+    initializeInternalNode(root);
+    setNodeRoot(root, true);
+    *internalNodeNumKeys(root) = 1;
+    *internalNodeChild(root, 0) = leftChildPageNum;
+    uint32_t leftChildMaxKey = getNodeMaxKey(table->pager, leftChild);
+    *internalNodeKey(root, 0) = leftChildMaxKey;
+    *internalNodeRightChild(root) = rightChildPageNum;
+
+    // In order to get a reference to parent node, we need to record in each node a pointer to parent
+    *nodeParent(leftChild) = table->root_page_num;
+    *nodeParent(rightChild) = table->root_page_num;
+
+    // When an internal root is promoted, its children now hang off the left child
+    if (getNodeType(leftChild) == NODE_INTERNAL) {
+        for (uint32_t i = 0; i <= *internalNodeNumKeys(leftChild); i++) {
+            uint32_t mark = pagerPinMark();
+            uint32_t childPageNum = *internalNodeChild(leftChild, i);
+            void* child = getPage(table->pager, childPageNum);
+            *nodeParent(child) = leftChildPageNum;
+            pagerMarkDirty(table->pager, childPageNum);
+            pagerUnpinTo(mark);
+        }
+    }
+}
+
+uint32_t* internalNodeNumKeys(void* node) {
+    return (uint32_t*) ((uint8_t*) node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+}
+
+uint32_t* internalNodeRightChild(void* node) {
+    return (uint32_t*) ((uint8_t*) node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+}
+
+uint32_t* internalNodeCell(void* node, uint32_t cellNum) {
+    return (uint32_t*) ((uint8_t*) node + INTERNAL_NODE_HEADER_SIZE + cellNum * INTERNAL_NODE_CELL_SIZE);
+}
+
+uint32_t* internalNodeChild(void* node, uint32_t childNum) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    if (childNum > numKeys) {
+        printf("Tried to access child_num %d > num_keys %d\n", childNum, numKeys);
+        exit(EXIT_FAILURE);
+    } else if (childNum == numKeys) {
+        return internalNodeRightChild(node);
+    } else {
+        return internalNodeCell(node, childNum);
+    }
+}
+
+uint32_t* internalNodeKey(void* node, uint32_t keyNum) {
+    return (uint32_t*) ((uint8_t*) internalNodeCell(node, keyNum) + INTERNAL_NODE_CHILD_SIZE);
+}
+
+// Position of a child among its parent's children. An index can repeat a key across
+// several children, so they're told apart by page number. Only splits and vacuum need
+// this, and they're rare enough for a linear search
+uint32_t internalNodeChildIndex(void* node, uint32_t childPageNum) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    for (uint32_t i = 0; i <= numKeys; i++) {
+        if (*internalNodeChild(node, i) == childPageNum) {
+            return i;
+        }
+    }
+    printf("Page %d is missing from its parent\n", childPageNum);
+    exit(EXIT_FAILURE);
+}
+
+void updateInternalNodeKey(void* node, uint32_t childPageNum, uint32_t newKey) {
+    uint32_t childIndex = internalNodeChildIndex(node, childPageNum);
+    // The right child has no key of its own to update
+    if (childIndex < *internalNodeNumKeys(node)) {
+        *internalNodeKey(node, childIndex) = newKey;
+    }
+}
+
+// For an internal node, the max key lives in its right child's subtree
+// For a leaf node, however, it's the key at the max index
+uint32_t getNodeMaxKey(Pager* pager, void* node) {
+    if (getNodeType(node) == NODE_LEAF) {
+        return *leafNodeKey(node, *leafNodeNumCells(node) - 1);
+    }
+
+    void* rightChild = getPage(pager, *internalNodeRightChild(node));
+    // A delete can leave a leaf empty while scans are open. The key before it still bounds the node
+    if (getNodeType(rightChild) == NODE_LEAF && *leafNodeNumCells(rightChild) == 0 && *internalNodeNumKeys(node) > 0) {
+        return *internalNodeKey(node, *internalNodeNumKeys(node) - 1);
+    }
+    return getNodeMaxKey(pager, rightChild);
+}
+
+// Getter and Setter functions to help keep track of the root node
+bool isRootNode(void* node){
+    uint8_t value = *((uint8_t*)((uint8_t*) node + IS_ROOT_OFFSET));
+    return (bool) value;
+}
+
+void setNodeRoot(void* node, bool isRoot) {
+    uint8_t value = isRoot;
+    *((uint8_t*)((uint8_t*) node + IS_ROOT_OFFSET)) = value;
+}
+
+
+
+void initializeInternalNode(void* node) {
+    setNodeType(node, NODE_INTERNAL);
+    setNodeRoot(node, false);
+    *internalNodeNumKeys(node) = 0;
+}
+
+// Meta Commands
+void printConstants() {
+    printf("ROW_SIZE: %d\n", ROW_SIZE);
+    printf("COMMON_NODE_METADATA_SIZE: %d\n", COMMON_NODE_METADATA_SIZE);
+    printf("LEAF_NODE_METADATA_SIZE: %zu\n", LEAF_NODE_METADATA_SIZE);
+    printf("LEAF_NODE_SLOT_SIZE: %zu\n", LEAF_NODE_SLOT_SIZE);
+    printf("LEAF_NODE_MAX_VALUE_SIZE: %zu\n", LEAF_NODE_MAX_VALUE_SIZE);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %zu\n", LEAF_NODE_SPACE_FOR_CELLS);
+    printf("LEAF_NODE_MAX_CELLS: %zu\n", LEAF_NODE_MAX_CELLS);
+}
+
+// Metadata functions to visualize the B-Tree
+void indent(uint32_t level) {
+    for(uint32_t i = 0; i < level; i++) {
+        printf(" ");
+    }
+}
+
+void print_tree(Pager* pager, uint32_t pageNum, uint32_t indentationLevel) {
+    void* node = getPage(pager, pageNum);
+    uint32_t numKeys, child;
+
+    switch(getNodeType(node)) {
+        case (NODE_LEAF):
+            numKeys = *leafNodeNumCells(node);
+            indent(indentationLevel);
+            printf("- leaf (size %d)\n", numKeys);
+
+            for (uint32_t i = 0; i < numKeys; i++) {
+                indent(indentationLevel + 1);
+                printf("- %d\n", *leafNodeKey(node, i));
+            }
+            break;
+        case (NODE_INTERNAL):
+            numKeys = *internalNodeNumKeys(node);
+            indent(indentationLevel);
+            printf("- internal (size %d)\n", numKeys);
+            for (uint32_t i = 0; i < numKeys; i++) {
+                child = *internalNodeChild(node, i);
+                uint32_t mark = pagerPinMark();
+                print_tree(pager, child, indentationLevel + 1);
+                pagerUnpinTo(mark);
+                indent(indentationLevel + 1);
+                printf("- key %d\n", *internalNodeKey(node, i));
+            }
+
+            child = *internalNodeRightChild(node);
+            print_tree(pager, child, indentationLevel + 1);
+            break;
+    }
+}
+
+// Return the index of the child node which 'should' contain the given key value
+uint32_t internalNodeFindChild(void* node, uint32_t key) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+
+    // Binary search to find index of child to search
+    uint32_t minIndex = 0;
+    uint32_t maxIndex = numKeys;
+
+    while (minIndex != maxIndex) {
+        uint32_t index = (minIndex + maxIndex) / 2;
+        uint32_t keyToRight = *internalNodeKey(node, index);
+
+        if (keyToRight >= key) {
+            maxIndex = index;
+        } else {
+            minIndex = index + 1;
+        }
+    }
+
+    return minIndex;
+}
+
+// True when inserting into the node can't split it, so its parent won't change
+// Leaves are judged by free space, since the descent doesn't know how big the row is
+bool nodeIsSafe(void* node) {
+    if (getNodeType(node) == NODE_LEAF) {
+        return leafNodeHasRoom(node, LEAF_NODE_MAX_VALUE_SIZE);
+    }
+    return *internalNodeNumKeys(node) < INTERNAL_NODE_MAX_CELLS;
+}
+
+// Prefetch the children after childIndex whose keys start before end. A small pool only
+// takes a few at a time, or they'd evict each other before the scan gets to them
+void internalNodeReadAhead(Pager* pager, void* node, uint32_t childIndex, uint64_t end) {
+    uint32_t window = PAGER_READAHEAD_WINDOW;
+    if (pager->map == NULL && pager->num_frames / 4 < window) {
+        window = pager->num_frames / 4;
+    }
+
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    for (uint32_t i = childIndex + 1; i <= numKeys && i <= childIndex + window; i++) {
+        if (*internalNodeKey(node, i - 1) >= end) {
+            break;
+        }
+        pagerPrefetch(pager, *internalNodeChild(node, i));
+    }
+}
+
+// Walk down to the leaf that should hold key, latch crabbing on the way. A reader
+// lets go of each node as soon as its child is latched. The writer keeps every node
+// a split could reach, which is everything below the deepest safe node
+// The leaf is left pinned and latched, on top of the pin stack
+// If fence isn't NULL it receives the key every earlier leaf stays at or below, or -1 for the leftmost leaf
+// A scan passes the key it stops before as readAheadEnd, and the leaves after the one
+// it starts on are read ahead up to there. 0 reads nothing ahead
+void* descendToLeaf(Table* table, uint32_t key, uint32_t* leafPageNum, int64_t* fence, uint64_t readAheadEnd) {
+    Pager* pager = table->pager;
+    uint32_t mark = pagerPinMark();
+    uint32_t pageNum = table->root_page_num;
+    void* node = getPage(pager, pageNum);
+    int64_t leftFence = -1;
+
+    while (getNodeType(node) == NODE_INTERNAL) {
+        uint32_t childIndex = internalNodeFindChild(node, key);
+        if (childIndex > 0) {
+            leftFence = *internalNodeKey(node, childIndex - 1);
+        }
+        void* parent = node;
+        pageNum = *internalNodeChild(node, childIndex);
+        node = getPage(pager, pageNum);
+        if (readAheadEnd > 0 && getNodeType(node) == NODE_LEAF) {
+            internalNodeReadAhead(pager, parent, childIndex, readAheadEnd);
+        }
+        if (!pinStack.writing || nodeIsSafe(node)) {
+            pagerUnpinBelowTop(mark);
+        }
+    }
+
+    *leafPageNum = pageNum;
+    if (fence != NULL) {
+        *fence = leftFence;
+    }
+    return node;
+}
+
+// Add a new child / key pair (aka cell) to the parent, right after leftPageNum, the node
+// the child was split off from. Keys alone can't place it, since an index may repeat them
+void insertInternalNode(Table* table, uint32_t parentPageNum, uint32_t leftPageNum, uint32_t childPageNum) {
+    Pager* pager = table->pager;
+    void* parent = getPage(pager, parentPageNum);
+    void* child = getPage(pager, childPageNum);
+    uint32_t childMaxKey = getNodeMaxKey(pager, child);
+    uint32_t originalNumKeys = *internalNodeNumKeys(parent);
+
+    // If there's no room in the internal node for another cell, split it first
+    if (originalNumKeys >= INTERNAL_NODE_MAX_CELLS) {
+        internalNodeSplitAndInsert(table, parentPageNum, leftPageNum, childPageNum);
+        return;
+    }
+
+    pagerMarkDirty(pager, parentPageNum);
+    *internalNodeNumKeys(parent) = originalNumKeys + 1;
+
+    if (*internalNodeRightChild(parent) == leftPageNum) {
+        // Replace the right child. The left node gets a cell of its own
+        void* left = getPage(pager, leftPageNum);
+        *internalNodeChild(parent, originalNumKeys) = leftPageNum;
+        *internalNodeKey(parent, originalNumKeys) = getNodeMaxKey(pager, left);
+        *internalNodeRightChild(parent) = childPageNum;
+        return;
+    }
+
+    // Make room for a new cell
+    uint32_t index = internalNodeChildIndex(parent, leftPageNum) + 1;
+    for (uint32_t i = originalNumKeys; i > index; i--) {
+        void* destination = internalNodeCell(parent, i);
+        void* source = internalNodeCell(parent, i - 1);
+        memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+    }
+
+    *internalNodeChild(parent, index) = childPageNum;
+    *internalNodeKey(parent, index) = childMaxKey;
+}
+
+// Split a full internal node in half and add the new child to whichever half it belongs in
+// The split propagates upwards, and a full root is first pushed down into a new left child
+void internalNodeSplitAndInsert(Table* table, uint32_t parentPageNum, uint32_t leftPageNum, uint32_t childPageNum) {
+    Pager* pager = table->pager;
+    uint32_t oldPageNum = parentPageNum;
+    void* oldNode = getPage(pager, oldPageNum);
+    uint32_t oldMax = getNodeMaxKey(pager, oldNode);
+
+    void* child = getPage(pager, childPageNum);
+    uint32_t childMax = getNodeMaxKey(pager, child);
+
+    uint32_t newPageNum = getUnusedPageNum(pager);
+    void* newNode = getPage(pager, newPageNum);
+    initializeInternalNode(newNode);
+    pagerMarkDirty(pager, newPageNum);
+
+    bool splittingRoot = isRootNode(oldNode);
+    if (splittingRoot) {
+        // Root keeps its page number, so its cells move down into a new left child
+        // and the new node starts out as the root's right child
+        createNewRoot(table, newPageNum);
+        void* root = getPage(pager, table->root_page_num);
+        oldPageNum = *internalNodeChild(root, 0);
+        oldNode = getPage(pager, oldPageNum);
+    }
+    pagerMarkDirty(pager, oldPageNum);
+
+    // Lay out every child in key order with the new one right after its left neighbour,
+    // then deal them out to both halves
+    uint32_t numKeys = *internalNodeNumKeys(oldNode);
+    uint32_t numChildren = numKeys + 2;
+    uint32_t children[INTERNAL_NODE_MAX_CELLS + 2];
+    uint32_t keys[INTERNAL_NODE_MAX_CELLS + 2];
+    uint32_t count = 0;
+    uint32_t childIndex = internalNodeChildIndex(oldNode, leftPageNum) + 1;
+
+    for (uint32_t i = 0; i <= numKeys; i++) {
+        if (count == childIndex) {
+            children[count] = childPageNum;
+            keys[count++] = childMax;
+        }
+        children[count] = *internalNodeChild(oldNode, i);
+        keys[count++] = (i < numKeys) ? *internalNodeKey(oldNode, i) : oldMax;
+    }
+    if (count == childIndex) {
+        children[count] = childPageNum;
+        keys[count++] = childMax;
+    }
+
+    uint32_t leftCount = numChildren / 2;
+    uint32_t rightCount = numChildren - leftCount;
+
+    *internalNodeNumKeys(oldNode) = leftCount - 1;
+    for (uint32_t i = 0; i < leftCount - 1; i++) {
+        *internalNodeCell(oldNode, i) = children[i];
+        *internalNodeKey(oldNode, i) = keys[i];
+    }
+    *internalNodeRightChild(oldNode) = children[leftCount - 1];
+
+    *internalNodeNumKeys(newNode) = rightCount - 1;
+    for (uint32_t i = 0; i < rightCount - 1; i++) {
+        *internalNodeCell(newNode, i) = children[leftCount + i];
+        *internalNodeKey(newNode, i) = keys[leftCount + i];
+    }
+    *internalNodeRightChild(newNode) = children[numChildren - 1];
+
+    uint32_t leftMax = keys[leftCount - 1];
+
+    // Children that moved to the new node need their parent pointers fixed up
+    // They're only touched once, so don't keep them pinned
+    for (uint32_t i = leftCount; i < numChildren; i++) {
+        uint32_t mark = pagerPinMark();
+        *nodeParent(getPage(pager, children[i])) = newPageNum;
+        pagerMarkDirty(pager, children[i]);
+        pagerUnpinTo(mark);
+    }
+    if (childIndex < leftCount) {
+        *nodeParent(child) = oldPageNum;
+        pagerMarkDirty(pager, childPageNum);
+    }
+
+    if (splittingRoot) {
+        void* root = getPage(pager, table->root_page_num);
+        *internalNodeKey(root, 0) = leftMax;
+        pagerMarkDirty(pager, table->root_page_num);
+    } else {
+        uint32_t grandparentPageNum = *nodeParent(oldNode);
+        void* grandparent = getPage(pager, grandparentPageNum);
+        pagerMarkDirty(pager, grandparentPageNum);
+        updateInternalNodeKey(grandparent, oldPageNum, leftMax);
+        *nodeParent(newNode) = grandparentPageNum;
+        insertInternalNode(table, grandparentPageNum, oldPageNum, newPageNum);
+    }
+}
@@ -0,0 +1,498 @@
+#ifndef DB_H
+#define DB_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
+#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
+#define PAGER_DEFAULT_CACHE_FRAMES 1024
+#define PAGER_MIN_CACHE_FRAMES 16
+#define PAGER_MMAP_RESERVE ((size_t) 1 << 40) // Address space set aside for the mapping (1 TiB)
+#define PAGER_MMAP_GROW_PAGES 256            // Grow the file 1 MiB at a time
+#define PAGER_MAX_WRITE_RUN 512              // Pages per pwritev, stays below IOV_MAX
+#define PAGER_LATCH_CHUNK_BITS 10            // mmap mode allocates page latches 1024 pages at a time
+#define PAGER_COMPRESSED_SECTOR 256          // Compressed pages take up whole sectors of this size
+#define PAGER_COMPRESSED_MAX_SECTORS 16      // A page stored as is, PAGE_SIZE / PAGER_COMPRESSED_SECTOR
+#define PAGER_READAHEAD_THREADS 4            // Threads reading prefetched pages into the pool
+#define PAGER_READAHEAD_QUEUE 256            // Prefetched pages that can wait for a thread at once
+#define PAGER_READAHEAD_WINDOW 16            // Leaves a scan asks for ahead of the one it starts on
+#define BULK_LOAD_SORT_ROWS (1 << 17)        // Rows sorted in memory before .load spills a run (~38 MB)
+#define BULK_LOAD_DEFAULT_FILL 1.0           // Fraction of each node .load fills
+#define BULK_LOAD_MAX_LEVELS 8
+#define RESULT_WRITER_BUFFER_SIZE (64 * 1024) // Formatted output handed to the file at once
+#define WAL_AUTOCHECKPOINT_FRAMES 1000       // Wake the checkpointer once this many frames wait to be copied back
+#define WAL_MAX_FRAMES (8 * WAL_AUTOCHECKPOINT_FRAMES) // Past this the writer checkpoints inline
+#define SELECT_KEY_LIMIT ((uint64_t) UINT32_MAX + 1) // Exclusive upper bound of an unbounded select
+#define SELECT_MAX_CONDITIONS 8
+#define SELECT_MAX_AGGREGATES 8
+#define STATEMENT_CACHE_SIZE 64              // Idle prepared statements kept per table
+#define SCAN_MAX_THREADS 64
+#define SCAN_PARTITIONS_PER_THREAD 8         // Enough small partitions that stealing can even out skew
+#define SCAN_BATCH_ROWS 64                   // Rows handed to a scan visitor per call
+
+// db.c is compiled with -fvisibility=hidden, so libdb.so only exports what's marked with this
+#define DB_API __attribute__((visibility("default")))
+
+
+// Enums
+typedef enum {
+  PREPARE_SUCCESS,
+  PREPARE_SYNTAX_ERROR,
+  PREPARE_NEGATIVE_ID,
+  PREPARE_UNRECOGNIZED_STATEMENT,
+  PREPARE_STRING_TOO_LONG,
+  PREPARE_BAD_PARAMETER // Bind to a parameter that doesn't exist, or with the wrong type
+ } PrepareResult;
+
+typedef enum {
+    STATEMENT_INSERT,
+    STATEMENT_SELECT,
+    STATEMENT_CREATE_INDEX,
+    STATEMENT_DELETE,
+    STATEMENT_UPDATE
+} StatementType;
+
+typedef enum {
+    EXECUTE_SUCCESS,  // Statement ran to completion
+    EXECUTE_ROW,      // dbStep copied a row out, call it again for the next one
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_TABLE_FULL,
+    EXECUTE_UNBOUND_PARAMETER,
+    EXECUTE_INDEX_EXISTS
+} ExecuteResult;
+
+typedef enum {
+    KEY_EQUAL,
+    KEY_GREATER,
+    KEY_GREATER_EQUAL,
+    KEY_LESS,
+    KEY_LESS_EQUAL
+} KeyOperator;
+
+typedef enum {
+    AGGREGATE_COUNT, // count(*)
+    AGGREGATE_SUM,   // sum(id)
+    AGGREGATE_MIN,   // min(id)
+    AGGREGATE_MAX    // max(id)
+} AggregateFunction;
+
+// Columns that can be compared against in a "where" clause and indexed
+typedef enum {
+    COLUMN_USERNAME,
+    COLUMN_EMAIL
+} TextColumn;
+#define TEXT_COLUMNS 2
+
+// What a "?" placeholder is bound into
+typedef enum {
+    PARAM_ID,
+    PARAM_USERNAME, // Column of a row to insert, or of a select's "where username = ?"
+    PARAM_EMAIL,
+    PARAM_KEY, // Right-hand side of a "where id <op> ?" condition
+    PARAM_SET_USERNAME, // Value an "update" sets the column to
+    PARAM_SET_EMAIL
+} ParamTarget;
+
+typedef enum {
+    NODE_INTERNAL,
+    NODE_LEAF
+ } NodeType;
+
+// Structs
+
+typedef struct {
+    uint32_t id;
+    char username[COLUMN_USERNAME_SIZE + 1]; // Add additional byte for null character
+                                            //          |
+    char email[COLUMN_EMAIL_SIZE + 1];     //       <---|  
+} Row;
+
+typedef struct {
+    KeyOperator op;
+    uint64_t key;
+} KeyCondition;
+
+typedef struct {
+    ParamTarget target;
+    uint32_t index; // Row of a multi-row insert, or condition of a select
+    bool bound;
+} Param;
+
+typedef struct {
+    StatementType type;
+    Row row_to_insert; // Used by the "insert" command, and holds the values an "update" sets
+    Row* rows;         // Rows of a multi-row "insert ... values", NULL otherwise
+    uint32_t num_rows;
+    KeyCondition conditions[SELECT_MAX_CONDITIONS]; // "where" clause of a "select", "update" or "delete", joined by "and"
+    uint32_t num_conditions;
+    uint64_t range_low;  // Keys a "select" returns, or an "update" or "delete" changes: range_low <= id < range_high
+    uint64_t range_high; // 64 bits wide so the range can run past UINT32_MAX
+    AggregateFunction aggregates[SELECT_MAX_AGGREGATES]; // "select count(*), max(id) ...", none for a plain select
+    uint32_t num_aggregates;
+    uint64_t aggregate_values[SELECT_MAX_AGGREGATES];    // Results of the last run
+    bool aggregate_null[SELECT_MAX_AGGREGATES];          // sum, min and max of no rows
+    Row match;           // Values a "where username = ..." and "where email = ..." compare against
+    bool match_columns[TEXT_COLUMNS]; // Which columns of match are set
+    bool update_columns[TEXT_COLUMNS]; // Columns an "update" sets
+    TextColumn index_column;          // Used only by "create index"
+    Param* params;       // "?" placeholders in the order they appear
+    uint32_t num_params;
+} Statement;
+
+typedef struct {
+    uint32_t cache_frames;
+    bool use_mmap; // Map the whole file instead of caching pages in the buffer pool
+    bool use_wal;  // Log committed pages to <filename>-wal instead of writing them in place
+    bool compress; // Create new files in the compressed format. Existing files keep the format they have
+} DbOptions;
+
+// A frame is one slot of the buffer pool. It holds a single page while it is cached
+typedef struct {
+    uint32_t page_num;
+    uint32_t pin_count;  // A pinned frame is still referenced by the running statement and can't be evicted
+    bool referenced;     // CLOCK reference bit, gives recently used pages a second chance
+    bool dirty;          // Page has to be written back before its frame is reused
+    bool loading;        // Being read in by a read-ahead thread, which keeps it pinned until it's done
+    void* data;
+    pthread_rwlock_t latch; // Guards the page contents. Only taken while the frame is pinned
+} Frame;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+    uint64_t prefetches;
+    uint64_t readaheads;     // Prefetched pages the read-ahead threads read into the pool
+    uint64_t flushed_pages;
+    uint64_t flush_writes;   // pwritev calls used for those pages
+} PagerStats;
+
+typedef struct {
+    uint64_t commits;
+    uint64_t syncs;
+    uint64_t frames_written;
+    uint64_t checkpoints;
+    uint64_t pages_checkpointed;
+} WalStats;
+
+// Where a page is stored in a compressed database file
+typedef struct {
+    uint32_t sector;  // First sector of the extent
+    uint32_t length;  // Compressed bytes, PAGE_SIZE if stored as is, 0 if never written
+} PageExtent;
+
+typedef struct {
+    uint32_t* sectors;
+    uint32_t count;
+    uint32_t capacity;
+} SectorList;
+
+// Compressed database file. Every page is compressed on its way to disk and stored as
+// a variable-size extent, found through a page map that is kept in memory
+typedef struct {
+    int file_descriptor;
+    PageExtent* map;
+    uint32_t num_pages;        // Entries in the map
+    uint32_t map_capacity;
+    bool map_dirty;            // The map has changed since it was last written out
+    PageExtent map_extent;     // Where the last written copy of the map is
+    uint32_t file_sectors;     // New extents that don't fit a free one go here, at the end
+
+    // Free extents, indexed by size in sectors. Extents given up since the map was last
+    // written aren't in here: the copy of the map on disk may still point at them
+    SectorList free[PAGER_COMPRESSED_MAX_SECTORS + 1];
+    uint32_t pending_sectors;  // Sectors given up that way
+
+    pthread_mutex_t mutex;     // Guards everything above, held across the reads and writes of extents
+    uint64_t pages_written;
+    uint64_t pages_stored_raw; // Pages that didn't compress by at least a sector
+    uint64_t map_writes;
+} CompressedFile;
+
+// A logged frame and the page it holds, sorted by page when checkpointing
+typedef struct {
+    uint32_t page_num;
+    uint32_t frame;
+} WalPageFrame;
+
+// Write-ahead log. Committed pages are appended to the log as frames and later
+// copied back into the database file by a background checkpointer thread
+typedef struct {
+    int file_descriptor;
+    int db_file_descriptor;
+    CompressedFile* compressed; // Checkpoints go through it when the database file is compressed
+    char* path;
+    uint32_t salt;             // Changes whenever the log restarts, so stale frames are ignored
+
+    uint32_t max_frame;        // Frames written to the log, committed or not
+    uint32_t committed_frame;  // Last frame of the last committed statement
+    uint32_t committed_pages;  // Database size in pages as of that commit
+    uint32_t synced_frame;     // Committed frames known to be on disk
+    uint32_t synced_pages;     // Database size as of that frame, checkpoints cut the file down to it
+    uint32_t backfilled;       // Frames already copied into the database file
+    bool syncing;              // A group commit leader is inside fdatasync
+
+    uint32_t* frame_pages;     // Page number stored in each frame
+    uint32_t frame_pages_capacity;
+
+    // Open-addressed hash table mapping page numbers to their latest frame (frame 0 marks an empty slot)
+    uint32_t* index_pages;
+    uint32_t* index_frames;
+    uint32_t index_bits;
+    uint32_t index_count;
+
+    WalPageFrame* checkpoint_entries; // Scratch for walCheckpoint, so a warm log checkpoints without allocating
+    uint32_t checkpoint_capacity;
+    void* checkpoint_page;
+
+    pthread_t checkpointer;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool checkpoint_requested;
+    bool checkpoint_running;
+    bool closing;
+
+    WalStats stats;
+} Wal;
+
+// This structure will locate a certain block of memory and return it
+// Pages are cached in a fixed budget of frames and evicted with the CLOCK algorithm
+// Any number of threads can read at once. Statements that change the tree hold
+// writer_mutex, so there is never more than one writer
+typedef struct {
+    int file_descriptor;
+    off_t file_length;
+    uint32_t num_pages;
+
+    // mmap mode: pages are addressed straight inside the mapping and the buffer pool is unused
+    uint8_t* map;
+    uint32_t sync_low;    // Range of pages modified since the last commit
+    uint32_t sync_high;
+    pthread_rwlock_t** page_latches; // Latches for mapped pages, in chunks allocated on first use
+    uint32_t num_latch_chunks;
+
+    Frame* frames;
+    uint8_t* frame_slab;      // Page-aligned memory holding every frame's page, one after another
+    Frame** dirty_frames;     // Scratch array for collecting dirty frames, one entry per frame
+    uint32_t num_frames;      // Frame budget
+    uint32_t frames_in_use;   // Frames are handed out in order until the budget is reached
+    uint32_t clock_hand;
+
+    // Open-addressed hash table mapping page numbers to frame indexes (-1 marks an empty slot)
+    int32_t* frame_table;
+    uint32_t frame_table_bits;
+
+    // Guards the frame table, the clock, frame metadata, stats and pool I/O.
+    // Never held while waiting for a page latch
+    pthread_mutex_t mutex;
+    pthread_cond_t frame_unpinned; // Signalled when a pin count drops to zero
+    uint32_t pins;                 // Pins held by every thread together
+
+    pthread_mutex_t writer_mutex;
+
+    // Open scans hold on to page numbers between steps, so a vacuum waits for them to
+    // finish and holds new ones back while it moves pages. Guarded by mutex
+    uint32_t scans;
+    bool vacuuming;
+    pthread_cond_t scans_changed;
+
+    Wal* wal; // NULL unless the write-ahead log is enabled
+    CompressedFile* compressed; // NULL unless the file is in the compressed format
+
+    // Read-ahead. Prefetched pages wait in a ring for one of the threads, which reads them
+    // into frames without holding the pool mutex. Guarded by mutex
+    pthread_t readahead_threads[PAGER_READAHEAD_THREADS];
+    uint32_t readahead_queue[PAGER_READAHEAD_QUEUE];
+    uint32_t readahead_head;
+    uint32_t readahead_count;
+    uint32_t readahead_loading;    // Frames being read in right now
+    bool readahead_closing;
+    pthread_cond_t readahead_wanted; // Signalled when a page is queued
+    pthread_cond_t frame_loaded;     // Broadcast when a read-ahead thread is done with a frame
+
+    PagerStats stats;
+} Pager;
+
+struct PreparedStatement;
+
+// A finalized statement kept around so preparing the same text again skips parsing
+typedef struct {
+    struct PreparedStatement* statement; // NULL marks an empty slot
+    uint64_t hash;
+    uint64_t last_used;
+} CachedStatement;
+
+// Let's get a table structure to print to pages of rows. This will keep track of how many rows exist
+// An index is a B-tree in the same file, opened as a Table of its own that shares the pager
+typedef struct Table {
+    uint32_t root_page_num; // A B-Tree is identified by its root node number
+    Pager* pager;
+    struct Table* indexes[TEXT_COLUMNS]; // Index on each column, NULL if it has none
+
+    pthread_mutex_t statement_cache_mutex;
+    CachedStatement statement_cache[STATEMENT_CACHE_SIZE];
+    uint64_t statement_clock;  // Ticks on every finalize, orders the cache for LRU eviction
+    uint64_t statement_cache_hits;
+    uint64_t statement_cache_misses;
+} Table;
+
+typedef struct {
+    Table* table;
+    uint32_t page_num;
+    uint32_t cell_num;
+    bool end_of_table; // Indicates the next position past the last element
+    void* snapshot;    // Scans read a private copy of the current leaf, so no latch is held between rows
+    uint64_t scan_end; // Key the scan stops before, leaves are only read ahead up to it
+} Cursor;
+
+// A statement prepared with dbPrepare, along with where a "select" has got to
+typedef struct PreparedStatement {
+    Statement statement;
+    Table* table;
+    char* sql;       // Statement text, the key it's cached under once finalized
+    uint64_t hash;
+    Cursor* cursor;  // Points at scan_cursor while a "select" is being stepped through
+    Cursor scan_cursor;
+    void* snapshot;  // Page the scan cursor copies leaves into, kept from one run to the next
+    Table* index;    // Index the open cursor reads, NULL when it walks the table itself
+    uint32_t index_key;
+    bool done;       // Ran to completion, dbReset runs it again
+} PreparedStatement;
+
+// Receives the rows of a parallel scan a batch at a time
+// Unordered scans call it from every worker thread at once, worker tells them apart
+typedef void (*ScanVisitor)(void* context, uint32_t worker, Row* rows, uint32_t count);
+
+typedef struct {
+    uint64_t low;       // Rows visited: low <= id < high
+    uint64_t high;
+    uint32_t threads;   // 0 runs one worker per online CPU
+    bool ordered;       // Deliver every row on the calling thread in key order, always as worker 0
+    ScanVisitor visit;
+    void* context;
+} ParallelScan;
+
+typedef enum {
+    EXPORT_CSV,    // "id,username,email" header, then one line per row
+    EXPORT_BINARY  // Per row: 4-byte id, 2-byte value size, then the value as leaves store it
+} ExportFormat;
+
+typedef enum {
+    BULK_LOAD_SUCCESS,
+    BULK_LOAD_OPEN_ERROR,  // The input file couldn't be opened, errno says why
+    BULK_LOAD_PARSE_ERROR, // A line isn't "id username email", error_line says which. Nothing was loaded
+    BULK_LOAD_TEMP_FILE_ERROR // Input too big to sort in memory couldn't be spilled to temporary files
+} BulkLoadStatus;
+
+typedef struct {
+    BulkLoadStatus status;
+    uint32_t loaded;
+    uint32_t duplicates;  // Keys seen again later in the input, the first row for each is kept
+    uint32_t error_line;
+} BulkLoadResult;
+
+typedef struct {
+    uint32_t pages_freed; // Cut from the end of the file
+    uint32_t pages_left;
+} VacuumResult;
+
+// Collects formatted rows and hands them to a file in large writes. Numbers and strings
+// are formatted by hand, so a row costs a few copies instead of a printf
+typedef struct {
+    FILE* file;
+    uint32_t used;
+    char buffer[RESULT_WRITER_BUFFER_SIZE];
+} ResultWriter;
+
+// Row and page sizes, defined in db.c
+extern const uint32_t ROW_SIZE;
+extern const uint32_t PAGE_SIZE;
+
+/*
+
+Library API
+
+    - dbPrepare compiles one statement. Any value can be written as "?" and bound afterwards
+    - Parameters are numbered from 1, in the order they appear in the statement
+    - dbStep returns EXECUTE_ROW with the row copied into the caller's buffer,
+      until it returns EXECUTE_SUCCESS or an error. An insert never writes a row, so it can pass NULL
+    - Nothing is printed, so the engine can run inside another process
+    - dbFinalize keeps the compiled statement in a per-table cache. Preparing the
+      same text again reuses it with every parameter unbound, without parsing
+    - A select of aggregates returns EXECUTE_ROW once without touching the row.
+      Read the results with dbAggregateValue
+    - A table can be shared between threads, as long as each prepared statement is only
+      used by one thread at a time. Selects run in parallel, inserts take turns
+    - "create index on users(email)" (or username) keeps an index that a select with
+      "where email = ..." looks rows up through. Such a select returns rows in index order
+    - "delete where ..." takes the same conditions as a select, a bare "delete" removes every row.
+      It only merges underfull leaves while no select is open, so run it between selects to keep the tree dense
+    - "update set email = ..., username = ... where ..." rewrites matching rows where they lie.
+      A "?" can stand for a value being set as well as one in the where clause
+    - bulkLoad reads "id username email" lines from a file and builds the tree from them.
+      It returns whether the input could be read, and how many rows were loaded or skipped
+    - vacuum moves pages in use down into free ones and cuts the file short. It waits
+      for open selects to finish first, so never call it with one open on the same thread.
+      It returns how many pages it freed and how many are left
+    - exportTable writes every row to a file, as CSV or in the binary row layout.
+      Like a select it runs alongside inserts, seeing the leaves as they were when it reached them.
+      It returns the number of rows written, or -1 with errno set if the file couldn't be written
+
+*/
+DB_API Table* dbOpen(const char* filename, DbOptions* options);
+DB_API void dbClose(Table* table);
+DB_API PrepareResult dbPrepare(Table* table, const char* sql, PreparedStatement** prepared);
+DB_API PrepareResult dbBindInt(PreparedStatement* prepared, uint32_t index, int64_t value);
+DB_API PrepareResult dbBindText(PreparedStatement* prepared, uint32_t index, const char* value);
+DB_API ExecuteResult dbStep(PreparedStatement* prepared, Row* row);
+DB_API void dbReset(PreparedStatement* prepared);
+DB_API void dbFinalize(PreparedStatement* prepared);
+DB_API uint32_t dbAggregateCount(PreparedStatement* prepared);
+DB_API bool dbAggregateValue(PreparedStatement* prepared, uint32_t index, uint64_t* value);
+DB_API void parallelScan(Table* table, ParallelScan* scan);
+DB_API BulkLoadResult bulkLoad(Table* table, const char* path, double fillFactor);
+DB_API int64_t exportTable(Table* table, const char* path, ExportFormat format);
+DB_API VacuumResult vacuum(Table* table);
+
+// Lower level entry points, used by the REPL's meta commands, server.c and bench.c.
+// They link in from libdb.a and aren't exported from libdb.so
+void resultWriterInit(ResultWriter* writer, FILE* file);
+void resultWriterBytes(ResultWriter* writer, const char* bytes, uint32_t length);
+void resultWriterUint(ResultWriter* writer, uint64_t value);
+void resultWriterRow(ResultWriter* writer, Row* row);
+void resultWriterFlush(ResultWriter* writer);
+PrepareResult prepareStatement(char* sql, Statement* statement);
+void closeStatement(Statement* statement);
+ExecuteResult executeInsert(Statement* statement, Table* table);
+void printConstants();
+void print_tree(Pager* pager, uint32_t pageNum, uint32_t indentationLevel);
+
+Cursor* tableStart(Table* table);
+void tableFind(Table* table, uint32_t key, Cursor* cursor);
+Cursor* tableSeek(Table* table, uint32_t key);
+void incrementCursor(Cursor* cursor);
+void* cursorValue(Cursor* cursor);
+uint32_t cursorKey(Cursor* cursor);
+void cursorRow(Cursor* cursor, Row* row);
+uint32_t rowValueSize(Row* row);
+uint32_t serializeRow(Row* source, void* destination);
+void deserializeRow(void* source, Row* destination);
+
+void* getPage(Pager* pager, uint32_t pageNum);
+uint32_t pagerPinMark();
+void pagerUnpinTo(uint32_t mark);
+void pagerUnpinAll(Pager* pager);
+void pagerBeginWrite(Pager* pager);
+void pagerEndWrite(Pager* pager);
+void pagerCommit(Pager* pager);
+void pagerFlushAll(Pager* pager);
+void printStats(Pager* pager);
+void printStatementCacheStats(Table* table);
+
+#endif
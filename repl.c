@@ -0,0 +1,296 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "db.h"
+#include "server.h"
+
+/*
+
+Interactive shell. Reads one statement or meta command per line from stdin
+and drives the engine through the library API in db.h
+
+*/
+
+typedef enum {
+    META_COMMAND_SUCCESS,
+    META_COMMAND_UNRECOGNIZED_COMMAND
+} MetaCommandResult;
+
+// Implement InputBuffer Wrapper
+typedef struct {
+    char* buffer;
+    size_t buffer_len;
+    size_t input_len;
+} InputBuffer;
+
+// Methods
+InputBuffer* newInputBuffer() {
+    InputBuffer* input_buffer = (InputBuffer*) malloc(sizeof(InputBuffer));
+    input_buffer->buffer = NULL;
+    input_buffer->buffer_len = 0;
+    input_buffer->input_len = 0;
+
+    return input_buffer;
+}
+
+void printPrompt() {
+    printf("db > ");
+}
+
+// Rows are collected here and written out after the statement finishes, or whenever
+// the buffer fills up, rather than with one printf each
+ResultWriter output;
+
+void printRow(Row* row){
+    resultWriterRow(&output, row);
+}
+
+void printAggregates(PreparedStatement* statement) {
+    resultWriterBytes(&output, "(", 1);
+    for (uint32_t i = 0; i < dbAggregateCount(statement); i++) {
+        uint64_t value;
+        if (i > 0) {
+            resultWriterBytes(&output, ", ", 2);
+        }
+        if (dbAggregateValue(statement, i, &value)) {
+            resultWriterUint(&output, value);
+        } else {
+            resultWriterBytes(&output, "NULL", 4);
+        }
+    }
+    resultWriterBytes(&output, ")\n", 2);
+}
+
+void printLoadResult(BulkLoadResult result, const char* path) {
+    switch (result.status) {
+        case (BULK_LOAD_SUCCESS):
+            printf("Loaded %d rows", result.loaded);
+            if (result.duplicates > 0) {
+                printf(" (%d duplicate keys skipped)", result.duplicates);
+            }
+            printf("\n");
+            break;
+        case (BULK_LOAD_OPEN_ERROR):
+            printf("Unable to open %s\n", path);
+            break;
+        case (BULK_LOAD_PARSE_ERROR):
+            printf("Could not parse line %d of %s\n", result.error_line, path);
+            break;
+        case (BULK_LOAD_TEMP_FILE_ERROR):
+            printf("Unable to write temporary files while sorting %s: %s\n", path, strerror(errno));
+            break;
+    }
+}
+
+// Returns false once stdin is exhausted
+bool readInput(InputBuffer* input_buffer) {
+    ssize_t bytesRead = getline(&(input_buffer->buffer), &(input_buffer->buffer_len), stdin);
+
+    // Basic error-handling
+    if (bytesRead <= 0) {
+        return false;
+    }
+
+    // Ignore any trailing newlines
+    if (input_buffer->buffer[bytesRead - 1] == '\n') {
+        bytesRead--;
+    }
+    input_buffer->input_len = bytesRead;
+    input_buffer->buffer[bytesRead] = 0;
+    return true;
+}
+
+void closeInputBuffer(InputBuffer* buffer) {
+    free(buffer->buffer);
+    free(buffer);
+}
+
+MetaCommandResult execMetaCommand(InputBuffer* buffer, Table* table){ 
+    if (strcmp(buffer->buffer, ".exit") == 0) {
+        dbClose(table);
+        exit(EXIT_SUCCESS);
+    } else if (strcmp(buffer->buffer, ".btree") == 0) {
+        printf("Tree:\n");
+        print_tree(table->pager, 0, 0);
+        pagerUnpinAll(table->pager);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(buffer->buffer, ".constants") == 0) {
+        printf("Constants:\n");
+        printConstants();
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(buffer->buffer, ".load ", 6) == 0) {
+        strtok(buffer->buffer, " ");
+        char* path = strtok(NULL, " ");
+        char* fill = strtok(NULL, " ");
+        double fillFactor = fill ? atof(fill) : BULK_LOAD_DEFAULT_FILL;
+
+        if (path == NULL) {
+            printf("Usage: .load <file> [fill factor]\n");
+        } else if (fillFactor <= 0 || fillFactor > 1) {
+            printf("Fill factor must be greater than 0 and at most 1\n");
+        } else {
+            printLoadResult(bulkLoad(table, path, fillFactor), path);
+        }
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(buffer->buffer, ".export ", 8) == 0) {
+        strtok(buffer->buffer, " ");
+        char* path = strtok(NULL, " ");
+        char* format = strtok(NULL, " ");
+
+        if (path == NULL || format == NULL || (strcmp(format, "csv") != 0 && strcmp(format, "binary") != 0)) {
+            printf("Usage: .export <file> csv|binary\n");
+            return META_COMMAND_SUCCESS;
+        }
+
+        int64_t exported = exportTable(table, path, strcmp(format, "csv") == 0 ? EXPORT_CSV : EXPORT_BINARY);
+        if (exported < 0) {
+            printf("Unable to write %s: %s\n", path, strerror(errno));
+        } else {
+            printf("Exported %ld rows to %s\n", exported, path);
+        }
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(buffer->buffer, ".flush") == 0) {
+        // Write dirty pages back now instead of on eviction or at exit
+        pagerFlushAll(table->pager);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(buffer->buffer, ".vacuum") == 0) {
+        VacuumResult result = vacuum(table);
+        printf("Freed %d pages, %d left\n", result.pages_freed, result.pages_left);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(buffer->buffer, ".stats") == 0) {
+        printf("Buffer pool:\n");
+        printStats(table->pager);
+        printf("Statement cache:\n");
+        printStatementCacheStats(table);
+        return META_COMMAND_SUCCESS;
+    } else {
+        return  META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 2) {
+        printf("Must supply a databse filename\n");
+        printf("Usage: %s <filename> [--cache-frames N] [--mmap] [--wal] [--compress] [--serve SOCKET]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char* filename = argv[1];
+    resultWriterInit(&output, stdout);
+    char* socketPath = NULL;
+    DbOptions options = { .cache_frames = PAGER_DEFAULT_CACHE_FRAMES, .use_mmap = false, .use_wal = false, .compress = false };
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--cache-frames") == 0 && i + 1 < argc) {
+            options.cache_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options.use_mmap = true;
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            options.use_wal = true;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            options.compress = true;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options.use_mmap && options.use_wal) {
+        // Pages in the mapping are written in place, so there's nothing for the log to protect
+        printf("--wal can't be combined with --mmap\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.use_mmap && options.compress) {
+        // Compressed pages have to be decoded into the pool, they can't be used where they lie
+        printf("--compress can't be combined with --mmap\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Table* table = dbOpen(filename, &options);
+
+    if (socketPath != NULL) {
+        serve(table, socketPath);
+        dbClose(table);
+        exit(EXIT_SUCCESS);
+    }
+
+    InputBuffer* buffer = newInputBuffer();
+
+    while (true) {
+        printPrompt();
+        if (!readInput(buffer)) {
+            // End of input closes the database just like .exit
+            closeInputBuffer(buffer);
+            dbClose(table);
+            exit(EXIT_SUCCESS);
+        }
+
+        if (buffer->buffer[0] == '.') {
+            switch (execMetaCommand(buffer, table)) {
+                case (META_COMMAND_SUCCESS):
+                    continue;
+                case (META_COMMAND_UNRECOGNIZED_COMMAND):
+                    printf("Unrecognized command %s\n", buffer->buffer);
+                    continue;
+            }
+        }
+
+        PreparedStatement* statement;
+        switch (dbPrepare(table, buffer->buffer, &statement)) {
+            case (PREPARE_SUCCESS):
+                break;
+            case (PREPARE_NEGATIVE_ID):
+                printf("ID must be a positive number\n");
+                continue;
+            case (PREPARE_STRING_TOO_LONG):
+                printf("String is too long\n");
+                continue;
+            case (PREPARE_SYNTAX_ERROR):
+            case (PREPARE_BAD_PARAMETER):
+                printf("Syntax error. Could not parse statement\n");
+                continue;
+            case (PREPARE_UNRECOGNIZED_STATEMENT):
+                printf("Unrecognized keyword at start of '%s'\n", buffer->buffer);
+                continue;
+        }
+
+        Row row;
+        ExecuteResult result;
+        while ((result = dbStep(statement, &row)) == EXECUTE_ROW) {
+            if (dbAggregateCount(statement) > 0) {
+                printAggregates(statement);
+            } else {
+                printRow(&row);
+            }
+        }
+        dbFinalize(statement);
+        // Hand the rows to stdout ahead of whatever printf writes next
+        resultWriterFlush(&output);
+
+        switch (result) {
+            case (EXECUTE_SUCCESS):
+                printf("Executed\n");
+                break;
+            case (EXECUTE_DUPLICATE_KEY):
+                printf("Error: Duplicate key\n");
+                break;
+            case (EXECUTE_TABLE_FULL):
+                printf("Error: Table full\n");
+                break;
+            case (EXECUTE_UNBOUND_PARAMETER):
+                printf("Error: Parameters can't be used here\n");
+                break;
+            case (EXECUTE_INDEX_EXISTS):
+                printf("Error: Index already exists\n");
+                break;
+            case (EXECUTE_ROW):
+                break;
+        }
+    }
+}
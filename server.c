@@ -0,0 +1,538 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+/*
+
+Server mode
+
+One thread polls the listening socket and every client. Requests are decoded
+straight out of each client's input buffer and answered into its output buffer,
+so a client can pipeline as many requests as it likes. Statements run one at a
+time, the same as they would from the REPL. A select whose rows pile up faster
+than the client reads them is paused, and carries on once the replies drain.
+
+*/
+
+typedef struct {
+    int file_descriptor;
+
+    uint8_t* input;
+    size_t input_len;
+    size_t input_capacity;
+
+    uint8_t* output;
+    size_t output_start;     // Bytes before this were already sent
+    size_t output_len;
+    size_t output_capacity;
+
+    PreparedStatement** statements; // Handle n is statements[n - 1], NULL once closed
+    uint32_t num_statements;
+
+    PreparedStatement* running; // Paused until the client reads more replies, or NULL
+    bool finalize_running;      // running came from SERVER_QUERY and is finalized when it finishes
+
+    bool closing; // No more requests will be read. Close once the replies are sent
+} Connection;
+
+volatile sig_atomic_t serverStopping = 0;
+
+void serverStop(int signalNumber) {
+    (void) signalNumber;
+    serverStopping = 1;
+}
+
+void reserveBuffer(uint8_t** buffer, size_t* capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return;
+    }
+
+    size_t newCapacity = *capacity ? *capacity : SERVER_READ_SIZE;
+    while (newCapacity < needed) {
+        newCapacity *= 2;
+    }
+    *buffer = realloc(*buffer, newCapacity);
+    *capacity = newCapacity;
+}
+
+size_t pendingOutput(Connection* connection) {
+    return connection->output_len - connection->output_start;
+}
+
+// Move the unsent replies to the front of the buffer, so it doesn't keep growing
+// while a client that never quite catches up is sent more
+void compactOutput(Connection* connection) {
+    if (connection->output_start > 0) {
+        memmove(connection->output, connection->output + connection->output_start, pendingOutput(connection));
+        connection->output_len -= connection->output_start;
+        connection->output_start = 0;
+    }
+}
+
+void appendOutput(Connection* connection, const void* data, size_t length) {
+    reserveBuffer(&connection->output, &connection->output_capacity, connection->output_len + length);
+    memcpy(connection->output + connection->output_len, data, length);
+    connection->output_len += length;
+}
+
+// Start a response. The length is filled in by endResponse once the body is written
+size_t beginResponse(Connection* connection, uint8_t status) {
+    size_t start = connection->output_len;
+    uint32_t length = 0;
+    appendOutput(connection, &length, sizeof(length));
+    appendOutput(connection, &status, sizeof(status));
+    return start;
+}
+
+void endResponse(Connection* connection, size_t start) {
+    uint32_t length = connection->output_len - start - sizeof(uint32_t);
+    memcpy(connection->output + start, &length, sizeof(length));
+}
+
+void respondOk(Connection* connection, uint32_t value) {
+    size_t start = beginResponse(connection, SERVER_OK);
+    appendOutput(connection, &value, sizeof(value));
+    endResponse(connection, start);
+}
+
+void respondError(Connection* connection, uint8_t status, uint8_t code) {
+    size_t start = beginResponse(connection, status);
+    appendOutput(connection, &code, sizeof(code));
+    endResponse(connection, start);
+}
+
+// Send the results of an aggregate select as one SERVER_AGGREGATES response
+void appendAggregates(Connection* connection, PreparedStatement* prepared) {
+    size_t start = beginResponse(connection, SERVER_AGGREGATES);
+    uint32_t count = dbAggregateCount(prepared);
+    appendOutput(connection, &count, sizeof(count));
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t value = 0;
+        uint8_t present = dbAggregateValue(prepared, i, &value);
+        appendOutput(connection, &present, sizeof(present));
+        appendOutput(connection, &value, sizeof(value));
+    }
+    endResponse(connection, start);
+}
+
+// Step a statement to completion, sending rows in batches of SERVER_ROWS_PER_MESSAGE
+// Once SERVER_MAX_PENDING_OUTPUT is waiting to be sent, the statement is left in
+// connection->running between batches and false is returned. processRequests resumes it
+bool runStatement(Connection* connection, PreparedStatement* prepared, bool finalize) {
+    Row row;
+    ExecuteResult result;
+    size_t start = 0;
+    size_t countOffset = 0;
+    uint32_t count = 0;
+
+    while (true) {
+        if (count == 0 && pendingOutput(connection) >= SERVER_MAX_PENDING_OUTPUT) {
+            connection->running = prepared;
+            connection->finalize_running = finalize;
+            return false;
+        }
+        if ((result = dbStep(prepared, &row)) != EXECUTE_ROW) {
+            break;
+        }
+
+        if (dbAggregateCount(prepared) > 0) {
+            appendAggregates(connection, prepared);
+            continue;
+        }
+
+        if (count == 0) {
+            start = beginResponse(connection, SERVER_ROWS);
+            countOffset = connection->output_len;
+            appendOutput(connection, &count, sizeof(count));
+        }
+
+        appendOutput(connection, &row.id, sizeof(row.id));
+        reserveBuffer(&connection->output, &connection->output_capacity, connection->output_len + rowValueSize(&row));
+        connection->output_len += serializeRow(&row, connection->output + connection->output_len);
+
+        if (++count == SERVER_ROWS_PER_MESSAGE) {
+            memcpy(connection->output + countOffset, &count, sizeof(count));
+            endResponse(connection, start);
+            count = 0;
+        }
+    }
+
+    if (count > 0) {
+        memcpy(connection->output + countOffset, &count, sizeof(count));
+        endResponse(connection, start);
+    }
+
+    if (result == EXECUTE_SUCCESS) {
+        respondOk(connection, 0);
+    } else {
+        respondError(connection, SERVER_EXECUTE_ERROR, result);
+    }
+
+    connection->running = NULL;
+    if (finalize) {
+        dbFinalize(prepared);
+    }
+    return true;
+}
+
+PreparedStatement* findStatement(Connection* connection, uint32_t handle) {
+    if (handle == 0 || handle > connection->num_statements) {
+        return NULL;
+    }
+    return connection->statements[handle - 1];
+}
+
+uint32_t addStatement(Connection* connection, PreparedStatement* prepared) {
+    for (uint32_t i = 0; i < connection->num_statements; i++) {
+        if (connection->statements[i] == NULL) {
+            connection->statements[i] = prepared;
+            return i + 1;
+        }
+    }
+
+    connection->statements = realloc(connection->statements, (connection->num_statements + 1) * sizeof(PreparedStatement*));
+    connection->statements[connection->num_statements++] = prepared;
+    return connection->num_statements;
+}
+
+// Bind the parameters of a SERVER_EXECUTE request
+// Returns false if the request is malformed, otherwise the bind result is left in result
+bool bindParameters(PreparedStatement* prepared, uint8_t* body, uint32_t length, PrepareResult* result) {
+    uint16_t count;
+    if (length < sizeof(count)) {
+        return false;
+    }
+    memcpy(&count, body, sizeof(count));
+    uint32_t offset = sizeof(count);
+    *result = PREPARE_SUCCESS;
+
+    for (uint32_t i = 1; i <= count; i++) {
+        if (offset + 1 > length) {
+            return false;
+        }
+        uint8_t type = body[offset++];
+
+        PrepareResult bound;
+        if (type == SERVER_PARAM_INT) {
+            int64_t value;
+            if (offset + sizeof(value) > length) {
+                return false;
+            }
+            memcpy(&value, body + offset, sizeof(value));
+            offset += sizeof(value);
+            bound = dbBindInt(prepared, i, value);
+        } else if (type == SERVER_PARAM_TEXT) {
+            uint32_t textLength;
+            if (offset + sizeof(textLength) > length) {
+                return false;
+            }
+            memcpy(&textLength, body + offset, sizeof(textLength));
+            offset += sizeof(textLength);
+            if (textLength > length - offset) {
+                return false;
+            }
+
+            if (textLength > COLUMN_EMAIL_SIZE) {
+                bound = PREPARE_STRING_TOO_LONG;
+            } else {
+                char text[COLUMN_EMAIL_SIZE + 1];
+                memcpy(text, body + offset, textLength);
+                text[textLength] = 0;
+                bound = dbBindText(prepared, i, text);
+            }
+            offset += textLength;
+        } else {
+            return false;
+        }
+
+        if (bound != PREPARE_SUCCESS && *result == PREPARE_SUCCESS) {
+            *result = bound;
+        }
+    }
+
+    return offset == length;
+}
+
+// Answer one request. Returns false if the connection should be dropped
+bool handleRequest(Connection* connection, Table* table, uint8_t* message, uint32_t length) {
+    if (length == 0) {
+        return false;
+    }
+    uint8_t opcode = message[0];
+    uint8_t* body = message + 1;
+    uint32_t bodyLength = length - 1;
+
+    if (opcode == SERVER_QUERY || opcode == SERVER_PREPARE) {
+        char* sql = malloc(bodyLength + 1);
+        memcpy(sql, body, bodyLength);
+        sql[bodyLength] = 0;
+
+        PreparedStatement* prepared;
+        PrepareResult result = dbPrepare(table, sql, &prepared);
+        free(sql);
+        if (result != PREPARE_SUCCESS) {
+            respondError(connection, SERVER_PREPARE_ERROR, result);
+        } else if (opcode == SERVER_QUERY) {
+            runStatement(connection, prepared, true);
+        } else {
+            respondOk(connection, addStatement(connection, prepared));
+        }
+        return true;
+    }
+
+    uint32_t handle;
+    if (bodyLength < sizeof(handle)) {
+        return false;
+    }
+    memcpy(&handle, body, sizeof(handle));
+    PreparedStatement* prepared = findStatement(connection, handle);
+
+    if (prepared == NULL) {
+        respondError(connection, SERVER_BAD_REQUEST, 0);
+        return true;
+    }
+
+    if (opcode == SERVER_EXECUTE) {
+        PrepareResult result;
+        if (!bindParameters(prepared, body + sizeof(handle), bodyLength - sizeof(handle), &result)) {
+            return false;
+        }
+
+        if (result != PREPARE_SUCCESS) {
+            respondError(connection, SERVER_PREPARE_ERROR, result);
+        } else {
+            dbReset(prepared);
+            runStatement(connection, prepared, false);
+        }
+        return true;
+    }
+
+    if (opcode == SERVER_CLOSE) {
+        dbFinalize(prepared);
+        connection->statements[handle - 1] = NULL;
+        respondOk(connection, 0);
+        return true;
+    }
+
+    return false;
+}
+
+// Answer every complete request that's buffered, unless the client has stopped reading replies
+// A malformed request ends the connection once the replies before it are sent
+void processRequests(Connection* connection, Table* table) {
+    size_t offset = 0;
+
+    // Finish a paused statement before starting on the requests after it. Waiting until half
+    // the backlog is sent means each resume produces plenty of rows for what compacting costs
+    if (connection->running != NULL) {
+        if (pendingOutput(connection) >= SERVER_MAX_PENDING_OUTPUT / 2) {
+            return;
+        }
+        compactOutput(connection);
+        if (!runStatement(connection, connection->running, connection->finalize_running)) {
+            return;
+        }
+    }
+
+    while (connection->running == NULL && pendingOutput(connection) < SERVER_MAX_PENDING_OUTPUT) {
+        uint32_t length;
+        if (connection->input_len - offset < sizeof(length)) {
+            break;
+        }
+        memcpy(&length, connection->input + offset, sizeof(length));
+        if (length > SERVER_MAX_MESSAGE) {
+            connection->closing = true;
+            connection->input_len = 0;
+            return;
+        }
+        if (connection->input_len - offset - sizeof(length) < length) {
+            break;
+        }
+
+        if (!handleRequest(connection, table, connection->input + offset + sizeof(length), length)) {
+            connection->closing = true;
+            connection->input_len = 0;
+            return;
+        }
+        offset += sizeof(length) + length;
+    }
+
+    memmove(connection->input, connection->input + offset, connection->input_len - offset);
+    connection->input_len -= offset;
+}
+
+// Send as much pending output as the socket takes without blocking
+bool flushOutput(Connection* connection) {
+    while (connection->output_start < connection->output_len) {
+        ssize_t sent = send(connection->file_descriptor, connection->output + connection->output_start,
+                            connection->output_len - connection->output_start, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        connection->output_start += sent;
+    }
+
+    connection->output_start = 0;
+    connection->output_len = 0;
+    return true;
+}
+
+// Returns false if the socket failed
+// A client that shuts down its side still gets answers to everything it sent
+bool readRequests(Connection* connection, Table* table) {
+    reserveBuffer(&connection->input, &connection->input_capacity, connection->input_len + SERVER_READ_SIZE);
+    ssize_t received = recv(connection->file_descriptor, connection->input + connection->input_len, SERVER_READ_SIZE, MSG_DONTWAIT);
+    if (received == -1) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+
+    connection->input_len += received;
+    processRequests(connection, table);
+    if (received == 0) {
+        connection->closing = true;
+    }
+    return true;
+}
+
+void closeConnection(Connection* connection) {
+    if (connection->running != NULL && connection->finalize_running) {
+        dbFinalize(connection->running);
+    }
+    for (uint32_t i = 0; i < connection->num_statements; i++) {
+        if (connection->statements[i] != NULL) {
+            dbFinalize(connection->statements[i]);
+        }
+    }
+
+    close(connection->file_descriptor);
+    free(connection->statements);
+    free(connection->input);
+    free(connection->output);
+    free(connection);
+}
+
+int openListener(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Socket path is too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1) {
+        printf("Unable to create socket: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    unlink(path);
+    if (bind(listener, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(listener, SOMAXCONN) == -1) {
+        printf("Unable to listen on %s: %d\n", path, errno);
+        exit(EXIT_FAILURE);
+    }
+    return listener;
+}
+
+void serve(Table* table, const char* path) {
+    int listener = openListener(path);
+
+    // No SA_RESTART, so a signal breaks out of poll
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serverStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    Connection** connections = NULL;
+    uint32_t numConnections = 0;
+    struct pollfd* polls = NULL;
+
+    printf("Listening on %s\n", path);
+    fflush(stdout);
+
+    while (!serverStopping) {
+        polls = realloc(polls, (numConnections + 1) * sizeof(struct pollfd));
+        polls[0].fd = listener;
+        polls[0].events = POLLIN;
+
+        for (uint32_t i = 0; i < numConnections; i++) {
+            Connection* connection = connections[i];
+            size_t pending = pendingOutput(connection);
+            polls[i + 1].fd = connection->file_descriptor;
+            bool reading = !connection->closing && pending < SERVER_MAX_PENDING_OUTPUT;
+            polls[i + 1].events = (reading ? POLLIN : 0) | (pending > 0 ? POLLOUT : 0);
+        }
+
+        if (poll(polls, numConnections + 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error polling: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+
+        // Service existing clients before accepting, so the polls array still lines up
+        for (uint32_t i = numConnections; i > 0; i--) {
+            Connection* connection = connections[i - 1];
+            short events = polls[i].revents;
+            bool open = true;
+
+            if (events & POLLIN) {
+                open = readRequests(connection, table);
+            } else if (events & POLLERR) {
+                open = false;
+            }
+
+            // Replies freed up room, so requests held back while the client caught up can run.
+            // A paused statement still finishes for a client that has shut down its side
+            if (open && (events & POLLOUT)) {
+                open = flushOutput(connection);
+                if (open && (!connection->closing || connection->running != NULL)) {
+                    processRequests(connection, table);
+                }
+            }
+            if (open) {
+                open = flushOutput(connection);
+            }
+            if (open && connection->closing) {
+                // Done once everything is sent, or if the client went away entirely
+                open = connection->output_len > 0 && !(events & POLLHUP);
+            }
+
+            if (!open) {
+                closeConnection(connection);
+                connections[i - 1] = connections[--numConnections];
+            }
+        }
+
+        if (polls[0].revents & POLLIN) {
+            int client = accept(listener, NULL, NULL);
+            if (client != -1) {
+                Connection* connection = calloc(1, sizeof(Connection));
+                connection->file_descriptor = client;
+                connections = realloc(connections, (numConnections + 1) * sizeof(Connection*));
+                connections[numConnections++] = connection;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < numConnections; i++) {
+        closeConnection(connections[i]);
+    }
+    free(connections);
+    free(polls);
+    close(listener);
+    unlink(path);
+}
@@ -0,0 +1,59 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "db.h"
+
+/*
+
+Wire protocol for --serve
+
+    - Every message, in both directions, is a uint32 length followed by that many bytes
+    - The first byte after the length is an opcode (requests) or a status (responses)
+    - Integers are in host byte order, the socket is local only
+    - Requests may be pipelined. Each one is answered in order by zero or more
+      SERVER_ROWS messages followed by exactly one final message
+
+Requests
+    SERVER_QUERY     SQL text. Runs a statement that has no parameters
+    SERVER_PREPARE   SQL text. Final message carries a uint32 statement handle
+    SERVER_EXECUTE   uint32 handle, uint16 parameter count, then each parameter:
+                     uint8 SERVER_PARAM_INT + int64, or SERVER_PARAM_TEXT + uint32 length + bytes
+    SERVER_CLOSE     uint32 handle
+
+Responses
+    SERVER_OK              Final. uint32, the handle for SERVER_PREPARE and 0 otherwise
+    SERVER_ROWS            uint32 row count, then the rows. Each is a uint32 id followed by the
+                           value as it's stored in a leaf: uint8 username length, uint8 email
+                           length, then the username and email bytes
+    SERVER_AGGREGATES      Sent instead of rows by a select of aggregates. uint32 count, then
+                           each value as a uint8 that is 0 for NULL, followed by a uint64
+    SERVER_PREPARE_ERROR   Final. uint8 PrepareResult
+    SERVER_EXECUTE_ERROR   Final. uint8 ExecuteResult
+    SERVER_BAD_REQUEST     Final. The request couldn't be decoded or named an unknown handle
+
+*/
+
+#define SERVER_QUERY 1
+#define SERVER_PREPARE 2
+#define SERVER_EXECUTE 3
+#define SERVER_CLOSE 4
+
+#define SERVER_PARAM_INT 1
+#define SERVER_PARAM_TEXT 2
+
+#define SERVER_OK 0
+#define SERVER_ROWS 1
+#define SERVER_PREPARE_ERROR 2
+#define SERVER_EXECUTE_ERROR 3
+#define SERVER_BAD_REQUEST 4
+#define SERVER_AGGREGATES 5
+
+#define SERVER_MAX_MESSAGE (16 << 20)        // Longer requests close the connection
+#define SERVER_ROWS_PER_MESSAGE 256
+#define SERVER_MAX_PENDING_OUTPUT (4 << 20)  // Stop reading requests from a client that isn't reading replies
+#define SERVER_READ_SIZE 65536
+
+// Serve the table on a Unix socket at path until SIGINT or SIGTERM
+void serve(Table* table, const char* path);
+
+#endif
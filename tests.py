@@ -1,49 +1,713 @@
-import os
-import unittest
-from subprocess import run
-
-class DBTests(unittest.TestCase):
-    def __init__(self) -> None:
-        self.output = []
-        # self.tests = []
-    
-    def run(self, commands):
-        """
-        Helper function to send a list of commands to the database program
-        """
-
-        # Start the db program
-        # os.system("./db")
-        run(["./db", "r+"])
-        for command in commands:
-            output = run(command, capture_output=True).stdout
-            self.output.append(output)
-
-    def test(self, results):
-        for idx, command in enumerate(self.output):
-            self.assertEquals(command, results[idx])
-            
-        print("Done")
-
-if __name__ == "__main__":
-    db = DBTests()
-
-    # Some rudimentary unit testing
-    tests = [
-        "insert 1 user1 person1@example.com",
-        "select",
-        "insert 2 user2 person2@example.com",
-        "select",
-        ".exit"
-    ]
-
-    expected_results = [
-        "db > Executed",
-        "db > (1, user1, person1@example.com)",
-        "db > Executed",
-        "db > (1, user1, person1@example.com)\n(2, user2, person2@exmample.com)"
-        "db >"
-    ]
-
-    db.run(tests)
-    db.test(expected_results)
+import csv
+import ctypes
+import os
+import signal
+import socket
+import struct
+import threading
+import unittest
+from subprocess import PIPE, Popen, run
+
+DB_FILE = "test.db"
+
+# Mirrors of the structs in db.h the library API takes
+class DbOptions(ctypes.Structure):
+    _fields_ = [("cache_frames", ctypes.c_uint32), ("use_mmap", ctypes.c_bool), ("use_wal", ctypes.c_bool),
+                ("compress", ctypes.c_bool)]
+
+class Row(ctypes.Structure):
+    _fields_ = [("id", ctypes.c_uint32), ("username", ctypes.c_char * 33), ("email", ctypes.c_char * 256)]
+
+ScanVisitor = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_uint32, ctypes.POINTER(Row), ctypes.c_uint32)
+
+class ParallelScan(ctypes.Structure):
+    _fields_ = [("low", ctypes.c_uint64), ("high", ctypes.c_uint64), ("threads", ctypes.c_uint32),
+                ("ordered", ctypes.c_bool), ("visit", ScanVisitor), ("context", ctypes.c_void_p)]
+
+EXECUTE_SUCCESS, EXECUTE_ROW = 0, 1
+SOCKET_FILE = "test.sock"
+
+def load_library():
+    lib = ctypes.CDLL("./libdb.so")
+    lib.dbOpen.restype = ctypes.c_void_p
+    lib.dbOpen.argtypes = [ctypes.c_char_p, ctypes.POINTER(DbOptions)]
+    lib.dbClose.argtypes = [ctypes.c_void_p]
+    lib.dbPrepare.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(ctypes.c_void_p)]
+    lib.dbBindInt.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_int64]
+    lib.dbBindText.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_char_p]
+    lib.dbStep.argtypes = [ctypes.c_void_p, ctypes.POINTER(Row)]
+    lib.dbReset.argtypes = [ctypes.c_void_p]
+    lib.dbFinalize.argtypes = [ctypes.c_void_p]
+    lib.parallelScan.argtypes = [ctypes.c_void_p, ctypes.POINTER(ParallelScan)]
+    return lib
+
+def file_state(path):
+    """Modification time and contents, which change if anything writes to the file"""
+    with open(path, "rb") as f:
+        return os.stat(path).st_mtime_ns, f.read()
+
+class DBTests(unittest.TestCase):
+    def setUp(self):
+        if os.path.exists(DB_FILE):
+            os.remove(DB_FILE)
+
+    def tearDown(self):
+        for path in (DB_FILE, DB_FILE + "-wal", SOCKET_FILE):
+            if os.path.exists(path):
+                os.remove(path)
+
+    def run_script(self, commands, *options):
+        """
+        Helper function to send a list of commands to the database program
+        """
+
+        script = "\n".join(commands) + "\n"
+        result = run(["./db", DB_FILE, *options], input=script, capture_output=True, text=True)
+        return result.stdout.split("\n")
+
+    def test_insert_and_select(self):
+        # Some rudimentary unit testing
+        output = self.run_script([
+            "insert 1 user1 person1@example.com",
+            "select",
+            "insert 2 user2 person2@example.com",
+            "select",
+            ".exit"
+        ])
+
+        self.assertEqual(output, [
+            "db > Executed",
+            "db > (1, user1, person1@example.com)",
+            "Executed",
+            "db > Executed",
+            "db > (1, user1, person1@example.com)",
+            "(2, user2, person2@example.com)",
+            "Executed",
+            "db > "
+        ])
+
+    def test_duplicate_key(self):
+        output = self.run_script([
+            "insert 1 user1 person1@example.com",
+            "insert 1 user1 person1@example.com",
+            ".exit"
+        ])
+
+        self.assertEqual(output[1], "db > Error: Duplicate key")
+
+    def test_multi_row_insert(self):
+        values = ", ".join(f"({i}, user{i}, 'person{i}@example.com')" for i in range(100, 0, -1))
+        output = self.run_script([
+            f"insert values {values}",
+            "insert values (101, user101, a@example.com), (50, dup, dup@example.com)",
+            "select",
+            ".exit"
+        ], "--cache-frames", "16")
+
+        self.assertEqual(output[0], "db > Executed")
+        self.assertEqual(output[1], "db > Error: Duplicate key")
+        rows = [line.replace("db > ", "") for line in output if "(" in line]
+        self.assertEqual(rows, [f"({i}, user{i}, person{i}@example.com)" for i in range(1, 101)])
+
+    def test_end_of_input_closes_database(self):
+        result = run(["./db", DB_FILE], input="insert 1 user1 person1@example.com\n", capture_output=True, text=True, timeout=10)
+        self.assertEqual(result.returncode, 0)
+
+        output = self.run_script(["select", ".exit"])
+        self.assertEqual(output[0], "db > (1, user1, person1@example.com)")
+
+    def test_library_api(self):
+        lib = load_library()
+        options = DbOptions(64, False, False)
+        table = lib.dbOpen(DB_FILE.encode(), ctypes.byref(options))
+
+        insert = ctypes.c_void_p()
+        self.assertEqual(lib.dbPrepare(table, b"insert ? ? ?", ctypes.byref(insert)), 0)
+        self.assertEqual(lib.dbStep(insert, None), 4)  # EXECUTE_UNBOUND_PARAMETER
+        for i in range(1, 101):
+            lib.dbBindInt(insert, 1, i)
+            lib.dbBindText(insert, 2, f"user{i}".encode())
+            lib.dbBindText(insert, 3, f"person{i}@example.com".encode())
+            lib.dbReset(insert)
+            self.assertEqual(lib.dbStep(insert, None), EXECUTE_SUCCESS)
+        self.assertNotEqual(lib.dbBindText(insert, 1, b"not a number"), 0)
+        lib.dbFinalize(insert)
+
+        # Preparing the same text again comes out of the statement cache with nothing bound
+        self.assertEqual(lib.dbPrepare(table, b"insert ? ? ?", ctypes.byref(insert)), 0)
+        self.assertEqual(lib.dbStep(insert, None), 4)
+        lib.dbFinalize(insert)
+
+        select = ctypes.c_void_p()
+        self.assertEqual(lib.dbPrepare(table, b"select where id >= ? and id < ?", ctypes.byref(select)), 0)
+        lib.dbBindInt(select, 1, 40)
+        lib.dbBindInt(select, 2, 43)
+        row = Row()
+        ids = []
+        while lib.dbStep(select, ctypes.byref(row)) == EXECUTE_ROW:
+            ids.append((row.id, row.username.decode()))
+        lib.dbFinalize(select)
+        lib.dbClose(table)
+
+        self.assertEqual(ids, [(40, "user40"), (41, "user41"), (42, "user42")])
+
+    def test_readers_run_alongside_a_writer(self):
+        # ctypes drops the GIL around each call, so the threads really do share the table
+        lib = load_library()
+        options = DbOptions(16, False, False)
+        table = lib.dbOpen(DB_FILE.encode(), ctypes.byref(options))
+
+        def insert_all(keys):
+            insert = ctypes.c_void_p()
+            lib.dbPrepare(table, b"insert ? ? ?", ctypes.byref(insert))
+            for key in keys:
+                lib.dbBindInt(insert, 1, key)
+                lib.dbBindText(insert, 2, b"user")
+                lib.dbBindText(insert, 3, b"person@example.com")
+                lib.dbReset(insert)
+                if lib.dbStep(insert, None) != EXECUTE_SUCCESS:
+                    failures.append(f"insert {key}")
+            lib.dbFinalize(insert)
+
+        def select_ids():
+            select = ctypes.c_void_p()
+            lib.dbPrepare(table, b"select", ctypes.byref(select))
+            row = Row()
+            ids = []
+            while lib.dbStep(select, ctypes.byref(row)) == EXECUTE_ROW:
+                ids.append(row.id)
+            lib.dbFinalize(select)
+            return ids
+
+        failures = []
+        even = list(range(2, 4001, 2))
+        insert_all(even)
+
+        def reader():
+            for _ in range(10):
+                ids = select_ids()
+                # Rows come back once each and in order, and nothing committed before the scan is missed
+                if ids != sorted(set(ids)) or not set(even) <= set(ids):
+                    failures.append("scan")
+
+        odd = list(range(1, 4000, 2))
+        odd = odd[::2] + odd[1::2][::-1]  # Splits all over the tree, not just at the right edge
+        threads = [threading.Thread(target=insert_all, args=(odd,))]
+        threads += [threading.Thread(target=reader) for _ in range(3)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        self.assertEqual(failures, [])
+        self.assertEqual(select_ids(), list(range(1, 4001)))
+        lib.dbClose(table)
+
+    def test_parallel_scan(self):
+        lib = load_library()
+        options = DbOptions(64, False, False)
+        table = lib.dbOpen(DB_FILE.encode(), ctypes.byref(options))
+
+        insert = ctypes.c_void_p()
+        lib.dbPrepare(table, b"insert values (?, ?, ?), (?, ?, ?), (?, ?, ?), (?, ?, ?)", ctypes.byref(insert))
+        for first in range(1, 3001, 4):
+            for i in range(4):
+                lib.dbBindInt(insert, i * 3 + 1, first + i)
+                lib.dbBindText(insert, i * 3 + 2, b"user")
+                lib.dbBindText(insert, i * 3 + 3, b"person@example.com")
+            lib.dbReset(insert)
+            lib.dbStep(insert, None)
+        lib.dbFinalize(insert)
+
+        def scan(low, high, ordered):
+            ids = []
+            workers = set()
+            def visit(context, worker, rows, count):
+                workers.add(worker)
+                ids.extend(rows[i].id for i in range(count))
+            scan = ParallelScan(low, high, 4, ordered, ScanVisitor(visit), None)
+            lib.parallelScan(table, ctypes.byref(scan))
+            return ids, workers
+
+        ids, workers = scan(0, 2 ** 32, True)
+        self.assertEqual(ids, list(range(1, 3001)))
+        self.assertEqual(workers, {0})
+
+        ids, workers = scan(100, 2500, False)
+        self.assertEqual(sorted(ids), list(range(100, 2500)))
+        self.assertTrue(workers <= {0, 1, 2, 3})
+        lib.dbClose(table)
+
+    def test_server_mode(self):
+        server = Popen(["./db", DB_FILE, "--serve", SOCKET_FILE], stdout=PIPE, text=True)
+        try:
+            self.assertEqual(server.stdout.readline(), f"Listening on {SOCKET_FILE}\n")
+            client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            client.connect(SOCKET_FILE)
+
+            def request(opcode, body):
+                return struct.pack("=IB", len(body) + 1, opcode) + body
+
+            def text(value):
+                return struct.pack("=BI", 2, len(value)) + value
+
+            # Prepare once, then pipeline every insert and a query without waiting for replies
+            num_rows = 500
+            requests = request(2, b"insert ? ? ?")
+            for i in range(1, num_rows + 1):
+                params = struct.pack("=HBq", 3, 1, i) + text(f"user{i}".encode()) + text(f"person{i}@example.com".encode())
+                requests += request(3, struct.pack("=I", 1) + params)
+            requests += request(1, b"insert 1 dup dup@example.com")
+            requests += request(1, b"select where id between 100 and 399")
+            requests += request(1, b"select count(*), min(id) where id > 500")
+            client.sendall(requests)
+
+            buffered = b""
+            def response():
+                nonlocal buffered
+                while len(buffered) < 4 or len(buffered) < 4 + struct.unpack_from("=I", buffered)[0]:
+                    buffered += client.recv(65536)
+                length = struct.unpack_from("=I", buffered)[0]
+                message, buffered = buffered[4:4 + length], buffered[4 + length:]
+                return message[0], message[1:]
+
+            self.assertEqual(response(), (0, struct.pack("=I", 1)))
+            for _ in range(num_rows):
+                self.assertEqual(response(), (0, struct.pack("=I", 0)))
+            self.assertEqual(response(), (3, bytes([2])))  # EXECUTE_DUPLICATE_KEY
+
+            rows = []
+            status, body = response()
+            while status == 1:
+                count, offset = struct.unpack_from("=I", body)[0], 4
+                for n in range(count):
+                    key, username_length, email_length = struct.unpack_from("=IBB", body, offset)
+                    offset += 6
+                    rows.append((key, body[offset:offset + username_length].decode()))
+                    offset += username_length + email_length
+                self.assertEqual(offset, len(body))
+                status, body = response()
+            self.assertEqual(status, 0)
+            self.assertEqual(rows, [(i, f"user{i}") for i in range(100, 400)])
+
+            self.assertEqual(response(), (5, struct.pack("=IBQBQ", 2, 1, 0, 0, 0)))
+            self.assertEqual(response(), (0, struct.pack("=I", 0)))
+            client.close()
+        finally:
+            server.send_signal(signal.SIGTERM)
+            self.assertEqual(server.wait(timeout=10), 0)
+            server.stdout.close()
+
+        output = self.run_script(["select where id = 500", ".exit"])
+        self.assertEqual(output[0], "db > (500, user500, person500@example.com)")
+
+    def test_server_pauses_a_select_the_client_isnt_reading(self):
+        # About 16 MB of rows, four times the most a client is allowed to fall behind
+        load_file = "test_load.txt"
+        num_rows = 60000
+        email = "x" * 240 + "@example.com"
+        with open(load_file, "w") as f:
+            for i in range(1, num_rows + 1):
+                f.write(f"{i} user{i} {email}\n")
+        try:
+            self.run_script([f".load {load_file}", ".exit"])
+        finally:
+            os.remove(load_file)
+
+        def request(opcode, body):
+            return struct.pack("=IB", len(body) + 1, opcode) + body
+
+        def resident_kb(pid):
+            with open(f"/proc/{pid}/status") as f:
+                return int(next(line for line in f if line.startswith("VmRSS")).split()[1])
+
+        server = Popen(["./db", DB_FILE, "--serve", SOCKET_FILE], stdout=PIPE, text=True)
+        try:
+            self.assertEqual(server.stdout.readline(), f"Listening on {SOCKET_FILE}\n")
+            reader = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            reader.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+            reader.connect(SOCKET_FILE)
+            other = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            other.connect(SOCKET_FILE)
+            reader.settimeout(10)
+            other.settimeout(10)
+
+            # The paused select leaves the server free to answer other clients
+            before = resident_kb(server.pid)
+            reader.sendall(request(1, b"select"))
+            other.sendall(request(1, b"insert 60001 late late@example.com") + request(1, b"select count(*)"))
+            replies = b""
+            while len(replies) < 9 + 18 + 9:
+                replies += other.recv(65536)
+            self.assertEqual(replies, struct.pack("=IBI", 5, 0, 0) + struct.pack("=IBIBQ", 14, 5, 1, 1, num_rows + 1)
+                             + struct.pack("=IBI", 5, 0, 0))
+            self.assertLess(resident_kb(server.pid) - before, 10 * 1024)
+
+            # Reading the replies lets the select run on to the end
+            buffered = b""
+            rows = 0
+            while True:
+                while len(buffered) < 5 or len(buffered) < 4 + struct.unpack_from("=I", buffered)[0]:
+                    buffered += reader.recv(1 << 20)
+                length, status = struct.unpack_from("=IB", buffered)
+                if status != 1:
+                    break
+                rows += struct.unpack_from("=I", buffered, 5)[0]
+                buffered = buffered[4 + length:]
+            self.assertEqual(status, 0)
+            self.assertIn(rows, (num_rows, num_rows + 1))
+            reader.close()
+            other.close()
+        finally:
+            server.send_signal(signal.SIGTERM)
+            self.assertEqual(server.wait(timeout=10), 0)
+            server.stdout.close()
+
+    def test_buffer_pool_evicts_and_writes_back(self):
+        def stats(output, start=0):
+            lines = output[output.index("db > Buffer pool:", start) + 1:]
+            return {line.split(": ")[0]: line.split(": ")[1] for line in lines[:9]}
+
+        # Far more pages than 16 frames, so dirty pages are written back as they're evicted
+        num_rows = 3000
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in range(1, num_rows + 1)]
+        output = self.run_script(commands + [".stats", ".exit"], "--cache-frames", "16")
+        pool = stats(output)
+        self.assertEqual(pool["frames"], "16/16 (4096 bytes each)")
+        self.assertGreater(int(pool["evictions"]), 0)
+        self.assertGreater(int(pool["writebacks"]), 0)
+        hits, misses = int(pool["hits"]), int(pool["misses"])
+        self.assertEqual(pool["hit ratio"], f"{hits / (hits + misses):.4f}")
+
+        # A second lookup of the same row finds every page of its path in the pool
+        output = self.run_script(["select where id = 1", ".stats", "select where id = 1", ".stats", ".exit"],
+                                 "--cache-frames", "16")
+        first = stats(output)
+        second = stats(output, output.index("db > Buffer pool:") + 1)
+        self.assertGreater(int(first["misses"]), 0)
+        self.assertEqual(second["misses"], first["misses"])
+        self.assertGreater(int(second["hits"]), int(first["hits"]))
+
+        # Every row written back through evictions reads back, and reading evicts without writing
+        output = self.run_script(["select", ".stats", ".exit"], "--cache-frames", "16")
+        rows = [line.replace("db > ", "") for line in output[:num_rows]]
+        self.assertEqual(rows, [f"({i}, user{i}, person{i}@example.com)" for i in range(1, num_rows + 1)])
+        pool = stats(output)
+        self.assertGreater(int(pool["evictions"]), 0)
+        self.assertEqual(pool["writebacks"], "0")
+
+    def test_only_dirty_pages_are_flushed(self):
+        # A fresh file's pages are all dirty and adjacent, so they go out in one pwritev
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in range(1, 301)]
+        output = self.run_script(commands + [".flush", ".stats", ".exit"])
+        flushed = next(line for line in output if line.startswith("flushed:")).split()
+        self.assertGreater(int(flushed[1]), 1)
+        self.assertEqual(flushed[4:], ["1", "writes"])
+
+        # Reading doesn't dirty anything, so nothing is written, not even at exit
+        before = file_state(DB_FILE)
+        output = self.run_script(["select", ".btree", ".flush", ".stats", ".exit"])
+        self.assertIn("flushed: 0 pages in 0 writes", output)
+        self.assertIn("writebacks: 0", output)
+        self.assertEqual(file_state(DB_FILE), before)
+
+        # An insert into one leaf writes just that page
+        output = self.run_script(["select", "insert 301 user301 person301@example.com", ".flush", ".stats", ".exit"])
+        self.assertIn("flushed: 1 pages in 1 writes", output)
+
+    def test_tree_grows_past_internal_node_capacity(self):
+        # Enough rows for the root to split more than once with a tiny cache
+        num_rows = 20000
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in range(num_rows, 0, -1)]
+        output = self.run_script(commands + [".exit"], "--cache-frames", "16")
+        self.assertEqual(output.count("db > Executed"), num_rows)
+
+        # Rows must survive being evicted from the pool and written back
+        output = self.run_script([".btree", ".exit"])
+        keys = [int(line.strip()[2:]) for line in output if line.strip()[2:].isdigit()]
+        self.assertEqual(keys, list(range(1, num_rows + 1)))
+
+    def test_select_walks_every_leaf(self):
+        num_rows = 1000
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in range(num_rows, 0, -1)]
+        output = self.run_script(commands + ["select", ".exit"], "--cache-frames", "16")
+
+        rows = [line.replace("db > ", "") for line in output if "(" in line]
+        self.assertEqual(rows, [f"({i}, user{i}, person{i}@example.com)" for i in range(1, num_rows + 1)])
+
+    def test_rows_take_only_the_space_they_need(self):
+        # Sixty short rows used to take five leaves, now they share the root
+        short = [f"insert {i} u{i} e{i}@x.io" for i in range(1, 61)]
+        output = self.run_script(short + [".btree", ".exit"])
+        self.assertIn("- leaf (size 60)", output)
+        os.remove(DB_FILE)
+
+        # Full length rows mixed in still fit and split correctly
+        def row(i):
+            if i % 7 == 0:
+                return (i, chr(97 + i % 26) * 32, chr(97 + i % 26) * 255)
+            return (i, f"u{i}", f"e{i}@x.io")
+
+        rows = [row(i) for i in range(1, 301)]
+        commands = [f"insert {i} {u} {e}" for i, u, e in reversed(rows)]
+        output = self.run_script(commands + ["select", ".exit"])
+        selected = [line.replace("db > ", "") for line in output if "(" in line]
+        self.assertEqual(selected, [f"({i}, {u}, {e})" for i, u, e in rows])
+
+    def test_range_select(self):
+        num_rows = 1000
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in range(2, num_rows * 2 + 1, 2)]
+        self.run_script(commands + [".exit"], "--cache-frames", "16")
+
+        def select_ids(query):
+            output = self.run_script([query, ".exit"])
+            return [int(line.replace("db > ", "")[1:].split(",")[0]) for line in output if "(" in line]
+
+        self.assertEqual(select_ids("select where id >= 501 and id < 521"), list(range(502, 521, 2)))
+        self.assertEqual(select_ids("select where id between 1990 and 5000"), [1990, 1992, 1994, 1996, 1998, 2000])
+        self.assertEqual(select_ids("select where id = 1000"), [1000])
+        self.assertEqual(select_ids("select where id = 1001"), [])
+        self.assertEqual(select_ids("select where id > 2000"), [])
+
+    def test_aggregates(self):
+        self.assertEqual(self.run_script(["select count(*), sum(id), min(id), max(id)", ".exit"])[0],
+                         "db > (0, NULL, NULL, NULL)")
+
+        # Keys 3, 6, ..., 3000 spread over many leaves
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in range(3000, 0, -3)]
+        self.run_script(commands + [".exit"], "--cache-frames", "16")
+
+        def aggregate(query):
+            return self.run_script([query, ".exit"])[0].replace("db > ", "")
+
+        self.assertEqual(aggregate("select count(*), sum(id), min(id), max(id)"), f"(1000, {sum(range(3, 3001, 3))}, 3, 3000)")
+        self.assertEqual(aggregate("select count(*),max(id) where id >= 100 and id < 2000"), "(633, 1998)")
+        self.assertEqual(aggregate("select min(id) , max(id) where id between 1001 and 1001"), "(NULL, NULL)")
+        self.assertEqual(aggregate("select max(id) where id < 3"), "(NULL)")
+        self.assertEqual(aggregate("select count(*) max(id)"), "Syntax error. Could not parse statement")
+
+    def test_secondary_index(self):
+        def ids(output):
+            return sorted(int(line.replace("db > ", "")[1:].split(",")[0]) for line in output if "(" in line)
+
+        commands = [f"insert {i} user{i % 3} person{i % 10}@example.com" for i in range(1, 1001)]
+        output = self.run_script(commands + ["select where email = person3@example.com", "create index on users(email)",
+                                             "create index on users(email)", "select where email = person3@example.com", ".exit"])
+        expected = list(range(3, 1001, 10))
+        self.assertEqual(ids(output[1000:1101]), expected)
+        self.assertEqual(output[1102:1104], ["db > Error: Index already exists", "db > (3, user0, person3@example.com)"])
+        self.assertEqual(ids(output[1103:]), expected)
+
+        # The index is kept up to date by later inserts and found again when the file is reopened.
+        # Every row with the same username has the same index key, so those keys span several leaves
+        commands = [f"insert {i} user{i % 3} person{i % 10}@example.com" for i in range(2000, 1000, -1)]
+        output = self.run_script(["create index on users (username)"] + commands + [".exit"])
+        self.assertEqual(output.count("db > Executed"), 1001)
+        output = self.run_script(["select where email = person3@example.com and id > 990", ".exit"])
+        self.assertEqual(ids(output), [993] + list(range(1003, 2001, 10)))
+        output = self.run_script(["select count(*), min(id) where username = user1", ".exit"])
+        self.assertEqual(output[0], "db > (667, 1)")
+
+    def test_delete(self):
+        num_rows = 1000
+        commands = [f"insert {i} user{i} person{i % 10}@example.com" for i in range(num_rows, 0, -1)]
+        self.run_script(commands + ["create index on users(email)", ".exit"])
+
+        output = self.run_script(["delete where id = 500", "delete where id between 100 and 899",
+                                  "delete where id > 950 and email = person3@example.com", "delete where id = 5000",
+                                  "select count(*) where email = person7@example.com", "select count(*)", ".exit"])
+        self.assertEqual(output[:8], ["db > Executed"] * 4 + ["db > (20)", "Executed", "db > (195)", "Executed"])
+        output = self.run_script(["select where id >= 95 and id < 905", ".exit"])
+        rows = [line.replace("db > ", "") for line in output if "(" in line]
+        self.assertEqual(rows, [f"({i}, user{i}, person{i % 10}@example.com)" for i in [95, 96, 97, 98, 99, 900, 901, 902, 903, 904]])
+
+        # Merged leaves collapse the tree back into its root, and the pages they used can be given back
+        output = self.run_script(["delete where id >= 5", ".btree", "delete", "select", ".vacuum", ".exit"])
+        self.assertEqual(output[1:4], ["db > Tree:", "- leaf (size 4)", " - 1"])
+        self.assertEqual(output[7:9], ["db > Executed", "db > Executed"])
+        self.assertTrue(output[9].startswith("db > Freed ") and output[9].endswith(" pages, 3 left"))
+        self.assertEqual(os.path.getsize(DB_FILE), 3 * 4096)
+
+    def test_update(self):
+        num_rows = 1000
+        commands = [f"insert {i} user{i} person{i % 10}@example.com" for i in range(1, num_rows + 1)]
+        self.run_script(commands + ["create index on users(email)", ".exit"])
+
+        output = self.run_script(["update set email = other@example.com where id = 7", "update set username = u, email = x where id between 10 and 19",
+                                  "update set username = renamed where email = person3@example.com", "update set email = missing where id = 5000",
+                                  "select count(*) where email = person7@example.com", "select count(*) where email = x", ".exit"])
+        self.assertEqual(output[:8], ["db > Executed"] * 4 + ["db > (98)", "Executed", "db > (10)", "Executed"])
+        output = self.run_script(["select where id = 3", "select where id >= 6 and id < 14", ".exit"])
+        rows = [line.replace("db > ", "") for line in output if "(" in line]
+        self.assertEqual(rows, ["(3, renamed, person3@example.com)", "(6, user6, person6@example.com)", "(7, user7, other@example.com)", "(8, user8, person8@example.com)",
+                                "(9, user9, person9@example.com)", "(10, u, x)", "(11, u, x)", "(12, u, x)", "(13, u, x)"])
+
+        # Values that no longer fit in their leaf split it
+        long_email = "a" * 250
+        output = self.run_script([f"update set email = {long_email} where id < 500", "select count(*) where email = " + long_email,
+                                  "select count(*)", ".exit"])
+        self.assertEqual(output[:5], ["db > Executed", "db > (499)", "Executed", "db > (1000)", "Executed"])
+        output = self.run_script(["select where id >= 498 and id < 502", ".exit"])
+        rows = [line.replace("db > ", "") for line in output if "(" in line]
+        self.assertEqual(rows, [f"(498, user498, {long_email})", f"(499, user499, {long_email})",
+                                "(500, user500, person0@example.com)", "(501, user501, person1@example.com)"])
+
+    def test_vacuum_keeps_every_row(self):
+        num_rows = 1000
+        commands = [f"insert {i} user{i} person{i % 10}@example.com" for i in range(num_rows, 0, -1)]
+        output = self.run_script(["create index on users(email)"] + commands + [".vacuum", ".exit"])
+        self.assertTrue(output[num_rows + 1].startswith("db > Freed 0 pages, "))
+        pages = int(output[num_rows + 1].split(", ")[1].split(" ")[0])
+        self.assertEqual(os.path.getsize(DB_FILE), pages * 4096)
+
+        output = self.run_script(["select", "select count(*) where email = person7@example.com", ".exit"])
+        rows = [line.replace("db > ", "") for line in output if "@" in line]
+        self.assertEqual(rows, [f"({i}, user{i}, person{i % 10}@example.com)" for i in range(1, num_rows + 1)])
+        self.assertIn("db > (100)", output)
+
+    def test_mmap_mode_shares_file_format(self):
+        num_rows = 500
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in range(1, num_rows + 1)]
+        self.run_script(commands + [".exit"], "--mmap")
+        self.assertEqual(os.path.getsize(DB_FILE) % 4096, 0)
+
+        output = self.run_script(["select", ".exit"])
+        rows = [line.replace("db > ", "") for line in output if "(" in line]
+        self.assertEqual(len(rows), num_rows)
+
+    def test_wal_is_checkpointed_on_exit(self):
+        num_rows = 3000
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in range(1, num_rows + 1)]
+        output = self.run_script(commands + [".exit"], "--wal", "--cache-frames", "16")
+        self.assertEqual(output.count("db > Executed"), num_rows)
+        self.assertFalse(os.path.exists(DB_FILE + "-wal"))
+
+        output = self.run_script(["select", ".exit"])
+        rows = [line.replace("db > ", "") for line in output if "(" in line]
+        self.assertEqual(rows[-1], f"({num_rows}, user{num_rows}, person{num_rows}@example.com)")
+        self.assertEqual(len(rows), num_rows)
+
+    def test_scans_read_ahead_through_a_small_pool(self):
+        num_rows = 3000
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in range(1, num_rows + 1)]
+        self.run_script(commands + [".exit"], "--compress")
+
+        # Read-ahead threads fill frames while the scans use them, and the writer evicts them
+        output = self.run_script(["select", "update set username = renamed where id >= 1000 and id < 2000",
+                                  "select count(*) where username = renamed", "select where id >= 1998 and id < 2002",
+                                  ".stats", ".exit"], "--cache-frames", "16")
+        rows = [line.replace("db > ", "") for line in output if "@" in line]
+        self.assertEqual(rows[:num_rows], [f"({i}, user{i}, person{i}@example.com)" for i in range(1, num_rows + 1)])
+        self.assertEqual(rows[num_rows:], ["(1998, renamed, person1998@example.com)", "(1999, renamed, person1999@example.com)",
+                                           "(2000, user2000, person2000@example.com)", "(2001, user2001, person2001@example.com)"])
+        self.assertIn("db > (1000)", output)
+        self.assertTrue(any(line.startswith("read ahead: ") for line in output))
+
+    def test_compressed_file_reopens_without_the_flag(self):
+        num_rows = 2000
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in range(1, num_rows + 1)]
+        self.run_script(commands + [".exit"])
+        plain_size = os.path.getsize(DB_FILE)
+        os.remove(DB_FILE)
+
+        output = self.run_script(commands + [".exit"], "--compress", "--wal", "--cache-frames", "16")
+        self.assertEqual(output.count("db > Executed"), num_rows)
+        self.assertLess(os.path.getsize(DB_FILE), plain_size)
+
+        # The format is recorded in the file, so it opens the same way without --compress
+        output = self.run_script(["insert 2001 user2001 person2001@example.com", "select", ".exit"])
+        rows = [line.replace("db > ", "") for line in output if "(" in line]
+        self.assertEqual(rows, [f"({i}, user{i}, person{i}@example.com)" for i in range(1, num_rows + 2)])
+
+    def test_bulk_load_builds_sorted_tree(self):
+        load_file = "test_load.txt"
+        num_rows = 5000
+        with open(load_file, "w") as f:
+            for i in range(num_rows, 0, -1):
+                f.write(f"{i} user{i} person{i}@example.com\n")
+            f.write("1 duplicate duplicate@example.com\n")
+
+        try:
+            output = self.run_script([f".load {load_file} 0.8", "insert 5001 user5001 person5001@example.com", "select", ".exit"])
+        finally:
+            os.remove(load_file)
+
+        self.assertEqual(output[0], "db > Loaded 5000 rows (1 duplicate keys skipped)")
+        rows = [line.replace("db > ", "") for line in output if "(" in line and "Loaded" not in line]
+        self.assertEqual(rows, [f"({i}, user{i}, person{i}@example.com)" for i in range(1, num_rows + 2)])
+
+    def test_bulk_load_merges_spilled_runs(self):
+        # More rows than BULK_LOAD_SORT_ROWS (1 << 17), so they're sorted as two runs and merged
+        load_file = "test_load.txt"
+        num_rows = 140000
+        first_run = 1 << 17
+        with open(load_file, "w") as f:
+            for i in range(num_rows, 0, -1):
+                f.write(f"{i} user{i} person{i}@example.com\n")
+            # Duplicates in the second run of keys the first run already has, and of one of its own
+            f.write(f"{num_rows} first_run_dup a@example.com\n")
+            f.write(f"{num_rows - first_run + 1} first_run_dup b@example.com\n")
+            f.write("1 second_run_dup c@example.com\n")
+
+        try:
+            output = self.run_script([f".load {load_file}", "select count(*), min(id), max(id), sum(id)",
+                                      f"select where id = {num_rows}", f"select where id = {num_rows - first_run + 1}",
+                                      "select where id = 1", ".exit"])
+        finally:
+            os.remove(load_file)
+
+        self.assertEqual(output[:7], [
+            f"db > Loaded {num_rows} rows (3 duplicate keys skipped)",
+            f"db > ({num_rows}, 1, {num_rows}, {num_rows * (num_rows + 1) // 2})",
+            "Executed",
+            f"db > ({num_rows}, user{num_rows}, person{num_rows}@example.com)",
+            "Executed",
+            f"db > ({num_rows - first_run + 1}, user{num_rows - first_run + 1}, person{num_rows - first_run + 1}@example.com)",
+            "Executed",
+        ])
+        self.assertEqual(output[7], "db > (1, user1, person1@example.com)")
+
+        with open(load_file, "w") as f:
+            f.write("1 user1 person1@example.com\n2 missing_email\n")
+        try:
+            output = self.run_script([".load missing.txt", f".load {load_file}", ".exit"])
+        finally:
+            os.remove(load_file)
+        self.assertEqual(output[:2], ["db > Unable to open missing.txt", f"db > Could not parse line 2 of {load_file}"])
+
+    def test_export(self):
+        num_rows = 2000
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in range(num_rows, 1, -1)]
+        commands += ['insert 1 a,b "quoted"@example.com', ".export test.csv csv", ".export test.bin binary",
+                     ".export test.csv", ".export no_such_dir/test.csv csv", ".exit"]
+        try:
+            output = self.run_script(commands)
+            with open("test.csv", newline="") as f:
+                csv_rows = list(csv.reader(f))
+            with open("test.bin", "rb") as f:
+                data = f.read()
+        finally:
+            for path in ("test.csv", "test.bin"):
+                if os.path.exists(path):
+                    os.remove(path)
+
+        self.assertEqual(output[-5:-1], ["db > Exported 2000 rows to test.csv", "db > Exported 2000 rows to test.bin",
+                                         "db > Usage: .export <file> csv|binary",
+                                         "db > Unable to write no_such_dir/test.csv: No such file or directory"])
+        expected = [["1", "a,b", '"quoted"@example.com']]
+        expected += [[str(i), f"user{i}", f"person{i}@example.com"] for i in range(2, num_rows + 1)]
+        self.assertEqual(csv_rows, [["id", "username", "email"]] + expected)
+
+        # Each binary record is the id, the value size and the value as the leaf holds it
+        binary_rows = []
+        offset = 0
+        while offset < len(data):
+            key, size = struct.unpack_from("<IH", data, offset)
+            user_len, email_len = data[offset + 6], data[offset + 7]
+            value = data[offset + 8:offset + 6 + size]
+            binary_rows.append([str(key), value[:user_len].decode(), value[user_len:user_len + email_len].decode()])
+            offset += 6 + size
+        self.assertEqual(binary_rows, expected)
+
+if __name__ == "__main__":
+    unittest.main()